@@ -121,7 +121,7 @@ def initialize_chain(test_dir):
             os.remove(log_filename("cache", i, "debug.log"))
             os.remove(log_filename("cache", i, "db.log"))
             os.remove(log_filename("cache", i, "peers.dat"))
-            os.remove(log_filename("cache", i, "fee_estimates.dat"))
+            os.remove(log_filename("cache", i, "fee_estimates_v2.dat"))
 
     for i in range(4):
         from_dir = os.path.join("cache", "node"+str(i))
@@ -7,6 +7,7 @@
 
 #include "serialize.h"
 
+#include <stdint.h>
 #include <vector>
 
 class COutPoint;
@@ -97,4 +98,45 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, it is not limited by the protocol size constraints.
+ *
+ * contains(item) will always return true if item was one of the last N to 1.5*N
+ * insert()'ed ... but may also return true for items that were not inserted.
+ *
+ * Entries are kept in three generations of N/2 items: every filter bit is stored
+ * as two bits holding the generation that last set it, and the oldest generation
+ * is wiped in place when a new one starts. This needs about 2/3 of the memory of
+ * two alternating plain bloom filters and a fraction of that of an mruset, and
+ * its size does not depend on what is inserted.
+ *
+ * The hash seed is randomized on construction and clear(), so don't create global
+ * CRollingBloomFilter objects; they may be built before the RNG is seeded.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void clear();
+
+    //! Bytes used by the filter data
+    size_t DynamicMemoryUsage() const { return data.capacity() * sizeof(uint64_t); }
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+};
+
 #endif // BITCOIN_BLOOM_H
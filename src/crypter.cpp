@@ -11,6 +11,7 @@
 #include <string>
 #include <vector>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 
@@ -147,50 +148,94 @@ bool CCryptoKeyStore::Lock()
     return true;
 }
 
-bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
+/** Decrypt the secret of a key, without checking it belongs to vchPubKey */
+static bool DecryptKey(const CKeyingMaterial& vMasterKey, const std::vector<unsigned char>& vchCryptedSecret, const CPubKey& vchPubKey, CKey& key)
 {
+    CKeyingMaterial vchSecret;
+    if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+        return false;
+    if (vchSecret.size() != 32)
+        return false;
+    key.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+    return key.IsValid();
+}
+
+static bool CheckCryptedKey(const CKeyingMaterial& vMasterKey, const CryptedKeyMap::value_type& item)
+{
+    CKey key;
+    return DecryptKey(vMasterKey, item.second.second, item.second.first, key) && key.GetPubKey() == item.second.first;
+}
+
+/** Check every nStep-th key from nStart, for one of the threads of a full check */
+static void CheckCryptedKeys(const CKeyingMaterial& vMasterKey, const std::vector<const CryptedKeyMap::value_type*>& vKeys,
+                             unsigned int nStart, unsigned int nStep, std::vector<char>& vResults)
+{
+    for (unsigned int i = nStart; i < vKeys.size(); i += nStep)
+        vResults[i] = CheckCryptedKey(vMasterKey, *vKeys[i]);
+}
+
+int nUnlockThreads = 0;
+
+bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn, bool* pfCorrupted)
+{
+    if (pfCorrupted)
+        *pfCorrupted = false;
     {
         LOCK(cs_KeyStore);
         if (!SetCrypted())
             return false;
 
+        // Decrypting and checking every key takes long in big wallets, so
+        // unless asked to check them all (on several threads) at the first
+        // unlock, only a sample spread over the wallet is checked here and
+        // GetKey checks the others when they are first used.
+        std::vector<const CryptedKeyMap::value_type*> vKeys;
+        bool fCheckAll = !fDecryptionThoroughlyChecked && nUnlockThreads > 0;
+        unsigned int nSample = fDecryptionThoroughlyChecked ? 1 : UNLOCK_CHECK_SAMPLE;
+        unsigned int nStep = fCheckAll ? 1 : std::max((size_t)1, mapCryptedKeys.size() / nSample);
+        unsigned int nIndex = 0;
+        for (CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin(); mi != mapCryptedKeys.end(); ++mi, ++nIndex)
+        {
+            if (nIndex % nStep == 0)
+                vKeys.push_back(&*mi);
+            if (!fCheckAll && vKeys.size() == nSample)
+                break;
+        }
+
+        std::vector<char> vResults(vKeys.size(), false);
+        if (fCheckAll && nUnlockThreads > 1)
+        {
+            boost::thread_group threadGroup;
+            for (int i = 0; i < nUnlockThreads; i++)
+                threadGroup.create_thread(boost::bind(&CheckCryptedKeys, boost::cref(vMasterKeyIn), boost::cref(vKeys), i, nUnlockThreads, boost::ref(vResults)));
+            threadGroup.join_all();
+        }
+        else
+            CheckCryptedKeys(vMasterKeyIn, vKeys, 0, 1, vResults);
+
         bool keyPass = false;
         bool keyFail = false;
-        CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi)
+        for (unsigned int i = 0; i < vKeys.size(); i++)
         {
-            const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CKeyingMaterial vchSecret;
-            if(!DecryptSecret(vMasterKeyIn, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
-            {
-                keyFail = true;
-                break;
-            }
-            if (vchSecret.size() != 32)
-            {
-                keyFail = true;
-                break;
-            }
-            CKey key;
-            key.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
-            if (key.GetPubKey() != vchPubKey)
-            {
+            if (vResults[i])
+                keyPass = true;
+            else
                 keyFail = true;
-                break;
-            }
-            keyPass = true;
-            if (fDecryptionThoroughlyChecked)
-                break;
         }
         if (keyPass && keyFail)
         {
-            LogPrintf("The wallet is probably corrupted: Some keys decrypt but not all.");
-            assert(false);
+            // Refuse to unlock rather than abort, so the keys can still be
+            // reached one by one with -unlockthreads=0
+            LogPrintf("The wallet is probably corrupted: Some keys decrypt but not all.\n");
+            if (pfCorrupted)
+                *pfCorrupted = true;
+            return false;
         }
         if (keyFail || !keyPass)
             return false;
         vMasterKey = vMasterKeyIn;
+        BOOST_FOREACH(const CryptedKeyMap::value_type* pitem, vKeys)
+            setCheckedKeys.insert(pitem->first);
         fDecryptionThoroughlyChecked = true;
     }
     NotifyStatusChanged(this);
@@ -214,6 +259,7 @@ bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 
         if (!AddCryptedKey(pubkey, vchCryptedSecret))
             return false;
+        setCheckedKeys.insert(pubkey.GetID());
     }
     return true;
 }
@@ -243,12 +289,17 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         {
             const CPubKey &vchPubKey = (*mi).second.first;
             const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CKeyingMaterial vchSecret;
-            if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
-                return false;
-            if (vchSecret.size() != 32)
+            if (!DecryptKey(vMasterKey, vchCryptedSecret, vchPubKey, keyOut))
                 return false;
-            keyOut.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+            if (!setCheckedKeys.count(address))
+            {
+                if (keyOut.GetPubKey() != vchPubKey)
+                {
+                    LogPrintf("The wallet is probably corrupted: key %s does not decrypt to its public key.\n", address.ToString());
+                    return false;
+                }
+                setCheckedKeys.insert(address);
+            }
             return true;
         }
     }
@@ -290,6 +341,7 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
                 return false;
             if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
                 return false;
+            setCheckedKeys.insert(vchPubKey.GetID());
         }
         mapKeys.clear();
     }
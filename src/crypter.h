@@ -66,6 +66,13 @@ public:
 
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
 
+/** How many keys Unlock checks, spread over the wallet, when it does not check them all */
+static const unsigned int UNLOCK_CHECK_SAMPLE = 16;
+
+/** Threads checking every key at the first unlock, 0 to check a sample (-unlockthreads) */
+extern int nUnlockThreads;
+static const int MAX_UNLOCK_THREADS = 16;
+
 /** Encryption/decryption context with key information */
 class CCrypter
 {
@@ -124,16 +131,21 @@ private:
     //! if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
 
-    //! keeps track of whether Unlock has run a thorough check before
+    //! keeps track of whether Unlock has checked more than a single key before
     bool fDecryptionThoroughlyChecked;
 
+    //! keys whose decrypted secret has been checked against their public key;
+    //! the others are checked by GetKey on first use
+    mutable std::set<CKeyID> setCheckedKeys;
+
 protected:
     bool SetCrypted();
 
     //! will encrypt previously unencrypted keys
     bool EncryptKeys(CKeyingMaterial& vMasterKeyIn);
 
-    bool Unlock(const CKeyingMaterial& vMasterKeyIn);
+    //! pfCorrupted is set when some of the keys checked decrypt and others do not
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn, bool* pfCorrupted = NULL);
 
 public:
     CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
@@ -6,6 +6,8 @@
 
 #include "net.h"
 #include "firewall.h"
+#include <map>
+#include <set>
 #include <string>
 #include "addrman.h"
 
@@ -172,6 +174,174 @@ int Firewall_AverageSend = 0;
 int Firewall_AverageRecv = 0;
 int ALL_CHECK_TIMER = GetTime();
 
+// * Firewall Rule Cache *
+// The FIREWALL_* arrays and tunables above stay the canonical settings (the
+// RPC calls edit them in place). Everything FireWall() needs per message is
+// derived from them once, here, whenever they change: address lookups become
+// set/subnet matches on CNetAddr and the byte/time limits are pre-scaled.
+CCriticalSection cs_firewall;
+bool Firewall_SettingsDirty = true;
+std::set<CNetAddr> Firewall_WhiteListAddr;
+std::vector<CSubNet> Firewall_WhiteListSubNet;
+std::set<string> Firewall_WhiteListNames;
+std::set<CNetAddr> Firewall_BlackListAddr;
+std::vector<CSubNet> Firewall_BlackListSubNet;
+std::set<string> Firewall_BlackListNames;
+std::set<int> Firewall_ForkedHeights;
+std::set<string> Firewall_FloodPatterns;
+// Flooding warnings seen so far, as bitmasks, and whether they matched a pattern
+std::map<uint32_t, bool> Firewall_FloodPatternMatch;
+
+uint64_t Firewall_FloodMinBytes = 0;
+uint64_t Firewall_FloodMaxBytes = 0;
+uint64_t Firewall_FloodMinBytesHalf = 0;
+uint64_t Firewall_FloodMaxBytesHalf = 0;
+int64_t Firewall_FloodMinCheckSeconds = 0;
+int64_t Firewall_FloodMaxCheckSeconds = 0;
+
+/** Minimum time between two examinations of the same node (seconds) */
+static const int64_t FIREWALL_EXAM_INTERVAL = 1;
+
+enum FirewallAttackType
+{
+    ATTACK_NONE = 0,
+    ATTACK_LOWBW_HIGHHEIGHT,
+    ATTACK_HIGHBW_HIGHHEIGHT,
+    ATTACK_LOWBW_LOWHEIGHT,
+    ATTACK_HIGHBW_LOWHEIGHT,
+    ATTACK_INVALID_STARTHEIGHT,
+    ATTACK_INVALID_PROTOCOL,
+    ATTACK_FORKED_WALLET,
+    ATTACK_FLOODING_WALLET,
+};
+
+const char* AttackTypeName(FirewallAttackType type)
+{
+    switch (type)
+    {
+    case ATTACK_NONE: return "";
+    case ATTACK_LOWBW_HIGHHEIGHT: return "2-LowBW-HighHeight";
+    case ATTACK_HIGHBW_HIGHHEIGHT: return "2-HighBW-HighHeight";
+    case ATTACK_LOWBW_LOWHEIGHT: return "3-LowBW-LowHeight";
+    case ATTACK_HIGHBW_LOWHEIGHT: return "3-HighBW-LowHeight";
+    case ATTACK_INVALID_STARTHEIGHT: return "1-StartHeight-Invalid";
+    case ATTACK_INVALID_PROTOCOL: return "1-Protocol-Invalid";
+    case ATTACK_FORKED_WALLET: return "Forked Wallet";
+    case ATTACK_FLOODING_WALLET: return "Flooding Wallet";
+    }
+    return "";
+}
+
+
+// * Function: ParseFirewallAddress *
+// Accepts "ip", "ip:port" (the old addrName form) or "ip/mask". Anything else
+// (a host name) is kept as a name and matched against the peer's addrName.
+void ParseFirewallAddress(const string& strEntry, std::set<CNetAddr>& setAddr, std::vector<CSubNet>& vSubNet, std::set<string>& setName)
+{
+    if (strEntry.find('/') != string::npos)
+    {
+        CSubNet subnet(strEntry, false);
+        if (subnet.IsValid())
+            vSubNet.push_back(subnet);
+        else
+            LogPrintf("%s Ignoring invalid subnet in list: %s\n", ModuleName.c_str(), strEntry.c_str());
+        return;
+    }
+
+    CService addr;
+    if (Lookup(strEntry.c_str(), addr, 0, false))
+    {
+        setAddr.insert(addr);
+        return;
+    }
+
+    // Not resolved here (no DNS lookups per settings change); match by name only
+    LogPrintf("%s List entry %s is not an IP address, matching it against peer names only\n", ModuleName.c_str(), strEntry.c_str());
+    setName.insert(strEntry);
+}
+
+
+// * Function: MatchFirewallAddress *
+bool MatchFirewallAddress(const CNode* pnode, const std::set<CNetAddr>& setAddr, const std::vector<CSubNet>& vSubNet, const std::set<string>& setName)
+{
+    if (setAddr.count(pnode->addr))
+        return true;
+
+    BOOST_FOREACH(const CSubNet& subnet, vSubNet)
+        if (subnet.Match(pnode->addr))
+            return true;
+
+    if (!setName.empty())
+    {
+        // Entries may be given with or without the port
+        if (setName.count(pnode->addrName))
+            return true;
+
+        int nPort = 0;
+        string strHost;
+        SplitHostPort(pnode->addrName, nPort, strHost);
+        if (setName.count(strHost))
+            return true;
+    }
+
+    return false;
+}
+
+
+// * Function: FirewallSettingsChanged *
+void FirewallSettingsChanged()
+{
+    LOCK(cs_firewall);
+    Firewall_SettingsDirty = true;
+}
+
+
+// * Function: UpdateFirewallCache *
+// Rebuild the rule cache from the FIREWALL_* settings (cs_firewall must be held)
+void UpdateFirewallCache()
+{
+    int i;
+
+    Firewall_WhiteListAddr.clear();
+    Firewall_WhiteListSubNet.clear();
+    Firewall_WhiteListNames.clear();
+    Firewall_BlackListAddr.clear();
+    Firewall_BlackListSubNet.clear();
+    Firewall_BlackListNames.clear();
+    Firewall_ForkedHeights.clear();
+    Firewall_FloodPatterns.clear();
+    Firewall_FloodPatternMatch.clear();
+
+    // Entries can be blanked out in place, so walk the whole array
+    for (i = 0; i < 256; i++)
+    {
+        if (FIREWALL_WHITELIST[i] != "")
+            ParseFirewallAddress(FIREWALL_WHITELIST[i], Firewall_WhiteListAddr, Firewall_WhiteListSubNet, Firewall_WhiteListNames);
+
+        if (FIREWALL_BLACKLIST[i] != "")
+            ParseFirewallAddress(FIREWALL_BLACKLIST[i], Firewall_BlackListAddr, Firewall_BlackListSubNet, Firewall_BlackListNames);
+
+        if (FIREWALL_FLOODPATTERNS[i] != "")
+            Firewall_FloodPatterns.insert(FIREWALL_FLOODPATTERNS[i]);
+    }
+
+    // The forked height list ends at its first empty slot and its last two
+    // entries are ignored, as the check has always done
+    int nForkedHeights = CountIntArray(FIREWALL_FORKED_NODEHEIGHT) - 2;
+    for (i = 0; i < nForkedHeights; i++)
+        Firewall_ForkedHeights.insert(FIREWALL_FORKED_NODEHEIGHT[i]);
+
+    Firewall_FloodMinBytes = std::max(FIREWALL_FLOODINGWALLET_MINBYTES, 0);
+    Firewall_FloodMaxBytes = std::max(FIREWALL_FLOODINGWALLET_MAXBYTES, 0);
+    Firewall_FloodMinBytesHalf = Firewall_FloodMinBytes / 2;
+    Firewall_FloodMaxBytesHalf = Firewall_FloodMaxBytes / 2;
+    Firewall_FloodMinCheckSeconds = (int64_t)FIREWALL_FLOODINGWALLET_MINCHECK * 60;
+    Firewall_FloodMaxCheckSeconds = (int64_t)FIREWALL_FLOODINGWALLET_MAXCHECK * 60;
+
+    Firewall_SettingsDirty = false;
+}
+
+
 // * Function: LoadFirewallSettings (phc.conf)*
 void LoadFirewallSettings()
 {
@@ -246,12 +416,14 @@ void LoadFirewallSettings()
     FIREWALL_FLOODINGWALLET_MINCHECK = GetArg("-firewallfloodingwalletmincheck", FIREWALL_FLOODINGWALLET_MINCHECK);
     FIREWALL_FLOODINGWALLET_MAXCHECK = GetArg("-firewallfloodingwalletmaxcheck", FIREWALL_FLOODINGWALLET_MAXCHECK);
 
+    FirewallSettingsChanged();
+
 return;
 }
 
 
 // * Function: ForceDisconnectNode *
-bool ForceDisconnectNode(CNode *pnode, string FromFunction)
+bool ForceDisconnectNode(CNode *pnode, const char* FromFunction)
 {
     TRY_LOCK(pnode->cs_vSend, lockSend);
         if (lockSend){
@@ -268,11 +440,7 @@ bool ForceDisconnectNode(CNode *pnode, string FromFunction)
                 }
             }
 
-return true;  
-        }
-        else
-        {
-            pnode->vSendMsg.end();
+return true;
         }
 
 return false;
@@ -282,24 +450,8 @@ return false;
 // * Function: CheckBlackList *
 bool CheckBlackList(CNode *pnode)
 {
-    int i;
-    int TmpBlackListCount;
-    TmpBlackListCount = CountStringArray(FIREWALL_BLACKLIST);
-
-    if (TmpBlackListCount > 0)
-    {
-        for (i = 0; i < TmpBlackListCount; i++)
-        {  
-            if (pnode->addrName == FIREWALL_BLACKLIST[i])
-            {   
-// Banned IP FOUND!
-return true;
-            }
-        }
-    }
-
-// Banned IP not found
-return false;
+    LOCK(cs_firewall);
+return MatchFirewallAddress(pnode, Firewall_BlackListAddr, Firewall_BlackListSubNet, Firewall_BlackListNames);
 }
 
 
@@ -320,37 +472,36 @@ return false;
 // * Function: AddToBlackList *
 bool AddToBlackList(CNode *pnode)
 {
-    int TmpBlackListCount;
-    TmpBlackListCount = CountStringArray(FIREWALL_BLACKLIST);
+    {
+        LOCK(cs_firewall);
+
+        if (!Firewall_BlackListAddr.insert(pnode->addr).second)
+            return false;
+
+        // Keep the settings array (reported by RPC) in step with the cache
+        int TmpBlackListCount = CountStringArray(FIREWALL_BLACKLIST);
 
         // Restart Blacklist count
-        if (TmpBlackListCount >  255)
+        if (TmpBlackListCount > 255)
         {
             TmpBlackListCount = 0;
         }
 
-        if (CheckBlackList(pnode) == false)
-        {
-            // increase Blacklist count
-            TmpBlackListCount = TmpBlackListCount + 1;
-            // Add node IP to blacklist
-            FIREWALL_BLACKLIST[TmpBlackListCount] = pnode->addrName;
+        FIREWALL_BLACKLIST[TmpBlackListCount] = pnode->addr.ToStringIP();
+    }
 
-            if (FIREWALL_LIVE_DEBUG == true)
-            {
-                if (FIREWALL_LIVEDEBUG_BLACKLIST == true)
-                {
-                    cout << ModuleName << "Blacklisted: " << pnode->addrName << "]\n" << endl;
-                }
-            }
+    if (FIREWALL_LIVE_DEBUG == true)
+    {
+        if (FIREWALL_LIVEDEBUG_BLACKLIST == true)
+        {
+            cout << ModuleName << "Blacklisted: " << pnode->addrName << "]\n" << endl;
+        }
+    }
 
-            // Append Blacklist to debug.log
-            LogPrint("net", "%s Blacklisted: %s\n", ModuleName.c_str(), pnode->addrName.c_str());
+    // Append Blacklist to debug.log
+    LogPrint("net", "%s Blacklisted: %s\n", ModuleName.c_str(), pnode->addrName.c_str());
 
 return true;
-        }
-
-return false;
 }
 
 
@@ -374,52 +525,80 @@ return true;
 }
 
 
+// * Function: GetNodeHeight *
+int GetNodeHeight(const CNode *pnode)
+{
+    if (pnode->nSyncHeight == 0 || pnode->nSyncHeight < pnode->nStartingHeight)
+    {
+        return pnode->nStartingHeight;
+    }
+
+return pnode->nSyncHeight;
+}
+
+
+// * Function: FloodWarningsToString *
+string FloodWarningsToString(uint32_t nWarnings)
+{
+    string WARNINGS;
+    for (int i = 1; i < 32; i++)
+        if (nWarnings & (1U << i))
+            WARNINGS += itostr(i);
+
+return WARNINGS;
+}
+
+
+// * Function: MatchFloodPattern *
+// Warnings are kept as a bitmask; the pattern string ("5681012...") is only
+// assembled the first time a given combination is seen (cs_firewall must be held)
+bool MatchFloodPattern(uint32_t nWarnings)
+{
+    std::map<uint32_t, bool>::const_iterator it = Firewall_FloodPatternMatch.find(nWarnings);
+    if (it != Firewall_FloodPatternMatch.end())
+        return it->second;
+
+    bool fMatch = !Firewall_FloodPatterns.empty() && Firewall_FloodPatterns.count(FloodWarningsToString(nWarnings)) > 0;
+
+    Firewall_FloodPatternMatch.insert(std::make_pair(nWarnings, fMatch));
+
+return fMatch;
+}
+
+
 // * Function: CheckAttack *
 // Artificially Intelligent Attack Detection & Mitigation
-bool CheckAttack(CNode *pnode, string FromFunction)
+bool CheckAttack(CNode *pnode, const char* FromFunction)
 {
     bool DETECTED_ATTACK = false;
     BanReason BAN_REASON;
-    
+
     bool BLACKLIST_ATTACK = false;
 
     int BAN_TIME = 0; // Default 24 hours
     bool BAN_ATTACK = false;
 
-    //BanReason BAN_REASON;
+    // Per filter result, only turned into text if live debug output is on
+    bool fLiveDebug = FIREWALL_LIVE_DEBUG;
+    bool fBandwidthAbuseResult = false;
+    bool fNoFalsePositiveResult = false;
+    bool fInvalidWalletResult = false;
+    bool fForkedWalletResult = false;
+    bool fFloodingWalletResult = false;
+    uint32_t nFloodWarnings = 0;
 
-    string ATTACK_CHECK_NAME;
-    string ATTACK_CHECK_LOG;
+    int64_t nTimeConnected = GetTime() - pnode->nTimeConnected;
+    FirewallAttackType ATTACK_TYPE = ATTACK_NONE;
 
-    int nTimeConnected = GetTime() - pnode->nTimeConnected;
-    string ATTACK_TYPE = "";
-
-    int NodeHeight;
-
-    if (pnode->nSyncHeight == 0)
-    {
-        NodeHeight = pnode->nStartingHeight;
-    }
-    else
-    {
-        NodeHeight = pnode->nSyncHeight;
-    }
-
-    if (pnode->nSyncHeight < pnode->nStartingHeight)
-    {
-        NodeHeight = pnode->nStartingHeight;
-    }
-   
+    int NodeHeight = GetNodeHeight(pnode);
 
     // ---Filter 1 -------------
     if (FIREWALL_DETECT_BANDWIDTHABUSE == true)
     {
-        ATTACK_CHECK_NAME = "Bandwidth Abuse";
-
         // ### Attack Detection ###
         // Calculate the ratio between Recieved bytes and Sent Bytes
         // Detect a valid syncronizaion vs. a flood attack
-        
+
         if (nTimeConnected > FIREWALL_BANDWIDTHABUSE_MAXCHECK)
         {
             // * Attack detection #2
@@ -430,26 +609,26 @@ bool CheckAttack(CNode *pnode, string FromFunction)
                 {
                     // too low bandiwidth ratio limits
                     DETECTED_ATTACK = true;
-                    ATTACK_TYPE = "2-LowBW-HighHeight";
+                    ATTACK_TYPE = ATTACK_LOWBW_HIGHHEIGHT;
                 }
 
                 if (pnode->nTrafficAverage > Firewall_AverageTraffic_Max)
                 {
                     // too high bandiwidth ratio limits
                     DETECTED_ATTACK = true;
-                    ATTACK_TYPE = "2-HighBW-HighHeight";
+                    ATTACK_TYPE = ATTACK_HIGHBW_HIGHHEIGHT;
                 }
             }
 
             // * Attack detection #3
             // Node is behind on the chain than average minimum
             if (NodeHeight < Firewall_AverageHeight_Min)
-            {  
+            {
                 if (pnode->nTrafficAverage < Firewall_AverageTraffic_Min)
                 {
                     // too low bandiwidth ratio limits
                     DETECTED_ATTACK = true;
-                    ATTACK_TYPE = "3-LowBW-LowHeight";
+                    ATTACK_TYPE = ATTACK_LOWBW_LOWHEIGHT;
                 }
 
                 if (pnode->nTrafficAverage > Firewall_AverageTraffic_Max)
@@ -457,15 +636,12 @@ bool CheckAttack(CNode *pnode, string FromFunction)
 
                     // too high bandiwidth ratio limits
                     DETECTED_ATTACK = true;
-                    ATTACK_TYPE = "3-HighBW-LowHeight";
+                    ATTACK_TYPE = ATTACK_HIGHBW_LOWHEIGHT;
                 }
             }
         }
 
-        if (FIREWALL_LIVEDEBUG_BANDWIDTHABUSE == true)
-        {
-            ATTACK_CHECK_LOG = ATTACK_CHECK_LOG  + " {" +  ATTACK_CHECK_NAME + ":" + BoolToString(DETECTED_ATTACK) + "}";
-        }
+        fBandwidthAbuseResult = DETECTED_ATTACK;
 
         // ### Attack Mitigation ###
         if (DETECTED_ATTACK == true)
@@ -489,40 +665,26 @@ bool CheckAttack(CNode *pnode, string FromFunction)
 
     if (FIREWALL_NOFALSEPOSITIVE_BANDWIDTHABUSE == true)
     {
-        ATTACK_CHECK_NAME = "No False Positive - Bandwidth Abuse";
-
         // ### AVOID FALSE POSITIVE FROM BANDWIDTH ABUSE ###
         if (DETECTED_ATTACK == true)
         {
-
-            if (ATTACK_TYPE == "2-LowBW-HighHeight")
-            {
-                ATTACK_TYPE = "";
-                DETECTED_ATTACK = false;
-            }   
-
-            if (ATTACK_TYPE == "2-HighBW-HighHeight")
+            switch (ATTACK_TYPE)
             {
-                // Node/peer is in wallet sync (catching up to full blockheight)
-                ATTACK_TYPE = "";
+            case ATTACK_LOWBW_HIGHHEIGHT:
+            case ATTACK_HIGHBW_HIGHHEIGHT: // Node/peer is in wallet sync (catching up to full blockheight)
+            case ATTACK_LOWBW_LOWHEIGHT:
+                ATTACK_TYPE = ATTACK_NONE;
                 DETECTED_ATTACK = false;
-            }
+                break;
 
-            if (ATTACK_TYPE == "3-LowBW-LowHeight")
-            {
-                ATTACK_TYPE = "";
-                DETECTED_ATTACK = false;
-            }   
-
-            if (ATTACK_TYPE == "3-HighBW-LowHeight")
-            {
-                double tnTraffic = pnode->nSendBytes / pnode->nRecvBytes;
-                if (pnode->nTrafficAverage < Firewall_AverageTraffic_Max)
+            case ATTACK_HIGHBW_LOWHEIGHT:
+                if (pnode->nTrafficAverage < Firewall_AverageTraffic_Max && pnode->nRecvBytes > 0)
                 {
+                    double tnTraffic = pnode->nSendBytes / pnode->nRecvBytes;
                     if (tnTraffic < FIREWALL_BANDWIDTHABUSE_MINATTACK || tnTraffic > FIREWALL_BANDWIDTHABUSE_MAXATTACK)
                     {
                         // wallet full sync
-                        ATTACK_TYPE = "";
+                        ATTACK_TYPE = ATTACK_NONE;
                         DETECTED_ATTACK = false;
                     }
                 }
@@ -530,17 +692,17 @@ bool CheckAttack(CNode *pnode, string FromFunction)
                 if (pnode->nSendBytes > pnode->nRecvBytes)
                 {
                     // wallet full sync
-                    ATTACK_TYPE = "";
+                    ATTACK_TYPE = ATTACK_NONE;
                     DETECTED_ATTACK = false;
                 }
-            }   
-        }
-        
-        if (FIREWALL_LIVEDEBUG_NOFALSEPOSITIVE == true)
-        {
-            ATTACK_CHECK_LOG = ATTACK_CHECK_LOG  + " {" +  ATTACK_CHECK_NAME + ":" + BoolToString(DETECTED_ATTACK) + "}";
+                break;
+
+            default:
+                break;
+            }
         }
 
+        fNoFalsePositiveResult = DETECTED_ATTACK;
         // ##########################
     }
     // ----------------
@@ -548,82 +710,29 @@ bool CheckAttack(CNode *pnode, string FromFunction)
     // ---Filter 2-------------
     if (FIREWALL_DETECT_INVALIDWALLET == true)
     {
-        ATTACK_CHECK_NAME = "Invalid Wallet";
-
         // ### Attack Detection ###
-        // Start Height = -1
-        // Check for more than FIREWALL_INVALIDWALLET_MAXCHECK minutes connection length
+        // Check for more than FIREWALL_INVALIDWALLET_MAXCHECK seconds connection length
         if (nTimeConnected > FIREWALL_INVALIDWALLET_MAXCHECK)
         {
-            // Check for -1 blockheight
-            if (pnode->nStartingHeight == -1)
-            {
-                // Trigger Blacklisting
-                DETECTED_ATTACK = true;
-                ATTACK_TYPE = "1-StartHeight-Invalid";
-            }
-        }
-
-        // Check for -1 blockheight
-        if (nTimeConnected > FIREWALL_INVALIDWALLET_MAXCHECK)
-        {
-            // Check for -1 blockheight
+            // Check for -1 (or any negative) blockheight
             if (pnode->nStartingHeight < 0)
             {
                 // Trigger Blacklisting
                 DETECTED_ATTACK = true;
-                ATTACK_TYPE = "1-StartHeight-Invalid";
-            }
-        }
-        
-        // (Protocol: 0
-        // Check for more than FIREWALL_INVALIDWALLET_MAXCHECK minutes connection length
-        if (nTimeConnected > FIREWALL_INVALIDWALLET_MAXCHECK)
-        {
-            // Check for 0 protocol
-            if (pnode->nRecvVersion == 0)
-            {
-                // Trigger Blacklisting
-                DETECTED_ATTACK = true;
-                ATTACK_TYPE = "1-Protocol-Invalid";
+                ATTACK_TYPE = ATTACK_INVALID_STARTHEIGHT;
             }
-        }
 
-        // (Protocol: 0
-        // Check for more than FIREWALL_INVALIDWALLET_MAXCHECK minutes connection length
-        if (nTimeConnected > FIREWALL_INVALIDWALLET_MAXCHECK)
-        {
-            // Check for 
+            // Check for 0 (or lower) protocol
             if (pnode->nRecvVersion < 1)
             {
                 // Trigger Blacklisting
                 DETECTED_ATTACK = true;
-                ATTACK_TYPE = "1-Protocol-Invalid";
+                ATTACK_TYPE = ATTACK_INVALID_PROTOCOL;
             }
         }
-
-        //// Resetting sync Height
-        //if (nTimeConnected > 60)
-        //{
-            //if (pnode->nSyncHeight > pnode->nSyncHeightOld)
-            //{
-                //pnode->nSyncHeightOld = pnode->nSyncHeight;
-            //}
-
-            //if (pnode->nSyncHeight < pnode->nSyncHeightOld - FIREWALL_AVERAGE_RANGE)
-            //{
-                // Trigger Blacklisting
-                //DETECTED = true;
-                //ATTACK_TYPE = "1-SyncReset";
-            //}
-
-        //}
         // ##########################
 
-        if (FIREWALL_LIVEDEBUG_INVALIDWALLET == true)
-        {
-            ATTACK_CHECK_LOG = ATTACK_CHECK_LOG  + " {" +  ATTACK_CHECK_NAME + ":" + BoolToString(DETECTED_ATTACK) + "}";
-        }
+        fInvalidWalletResult = DETECTED_ATTACK;
 
         // ### Attack Mitigation ###
         if (DETECTED_ATTACK == true)
@@ -648,41 +757,19 @@ bool CheckAttack(CNode *pnode, string FromFunction)
     // ---Filter 3-------------
     if (FIREWALL_DETECT_FORKEDWALLET == true)
     {
-
-        ATTACK_CHECK_NAME = "Forked Wallet";
-
         // ### Attack Detection ###
-
-        int i;
-        int TmpNodeHeightCount;
-        TmpNodeHeightCount = CountIntArray(FIREWALL_FORKED_NODEHEIGHT) - 2;
-        
-        if (TmpNodeHeightCount > 0)
         {
-            for (i = 0; i < TmpNodeHeightCount; i++)
-            { 
-                // Check for Forked Wallet (stuck on blocks)
-                if (pnode->nStartingHeight == (int)FIREWALL_FORKED_NODEHEIGHT[i])
-                {
-                    DETECTED_ATTACK = true;
-                    ATTACK_TYPE = ATTACK_CHECK_NAME;
-                }
-                // Check for Forked Wallet (stuck on blocks)
-                if (pnode->nSyncHeight == (int)FIREWALL_FORKED_NODEHEIGHT[i])
-                {
-                    DETECTED_ATTACK = true;
-                    ATTACK_TYPE = ATTACK_CHECK_NAME;
-                }
-            }          
+            LOCK(cs_firewall);
+            // Check for Forked Wallet (stuck on blocks)
+            if (Firewall_ForkedHeights.count(pnode->nStartingHeight) || Firewall_ForkedHeights.count(pnode->nSyncHeight))
+            {
+                DETECTED_ATTACK = true;
+                ATTACK_TYPE = ATTACK_FORKED_WALLET;
+            }
         }
         // #######################
 
-        // ### LIVE DEBUG OUTPUT ####
-        if (FIREWALL_LIVEDEBUG_FORKEDWALLET == true)
-        {
-            ATTACK_CHECK_LOG = ATTACK_CHECK_LOG  + " {" +  ATTACK_CHECK_NAME + ":" + BoolToString(DETECTED_ATTACK) + "}";
-        }
-        // #######################
+        fForkedWalletResult = DETECTED_ATTACK;
 
         // ### Attack Mitigation ###
         if (DETECTED_ATTACK == true)
@@ -709,197 +796,109 @@ bool CheckAttack(CNode *pnode, string FromFunction)
     // ---Filter 4-------------
     if (FIREWALL_DETECT_FLOODINGWALLET == true)
     {
-        ATTACK_CHECK_NAME = "Flooding Wallet";
-        std::size_t FLOODING_MAXBYTES = FIREWALL_FLOODINGWALLET_MAXBYTES;
-        std::size_t FLOODING_MINBYTES = FIREWALL_FLOODINGWALLET_MINBYTES;
-        
-        string WARNINGS = "";
+        // Bit N set = WARNING #N raised
+        uint32_t WARNINGS = 0;
 
         // WARNING #1 - Too high of bandwidth with low BlockHeight
-        if (NodeHeight < Firewall_AverageHeight_Min)
-        {  
-            if (pnode->nTrafficAverage > Firewall_AverageTraffic_Max)
-            {
-                WARNINGS = WARNINGS + "1";
-            }
-        }
-        
-        // WARNING #2 - Send Bytes below minimum
-        if (pnode->nSendBytes < FLOODING_MINBYTES)
-        {
-            WARNINGS = WARNINGS + "2";
-        }
+        if (NodeHeight < Firewall_AverageHeight_Min && pnode->nTrafficAverage > Firewall_AverageTraffic_Max)
+            WARNINGS |= 1U << 1;
 
-        // WARNING #3 - Send Bytes above minimum
-        if (pnode->nSendBytes < FLOODING_MINBYTES)
-        {
-            WARNINGS = WARNINGS + "3";
-        }
+        // WARNING #2, #3 - Send Bytes below minimum
+        if (pnode->nSendBytes < Firewall_FloodMinBytes)
+            WARNINGS |= (1U << 2) | (1U << 3);
 
         // WARNING #4 - Send Bytes below maximum
-        if (pnode->nSendBytes < FLOODING_MAXBYTES)
-        {
-            WARNINGS = WARNINGS + "4";
-        }
+        if (pnode->nSendBytes < Firewall_FloodMaxBytes)
+            WARNINGS |= 1U << 4;
 
         // WARNING #5 - Send Bytes above maximum
-        if (pnode->nSendBytes > FLOODING_MAXBYTES)
-        {
-            WARNINGS = WARNINGS + "5";
-        }
+        if (pnode->nSendBytes > Firewall_FloodMaxBytes)
+            WARNINGS |= 1U << 5;
 
-        // WARNING #6 - Recv Bytes above min 
-        if (pnode->nRecvBytes > FLOODING_MINBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "6";
-        }
+        // WARNING #6 - Recv Bytes above min
+        if (pnode->nRecvBytes > Firewall_FloodMinBytesHalf)
+            WARNINGS |= 1U << 6;
 
         // WARNING #7 - Recv Bytes below min
-        if (pnode->nRecvBytes < FLOODING_MINBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "7";
-        }
+        if (pnode->nRecvBytes < Firewall_FloodMinBytesHalf)
+            WARNINGS |= 1U << 7;
 
-        // WARNING #8 - Recv Bytes above max 
-        if (pnode->nRecvBytes > FLOODING_MAXBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "8";
-        }
+        // WARNING #8 - Recv Bytes above max
+        if (pnode->nRecvBytes > Firewall_FloodMaxBytesHalf)
+            WARNINGS |= 1U << 8;
 
         // WARNING #9 - Recv Bytes below max
-        if (pnode->nRecvBytes < FLOODING_MAXBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "9";
-        }
+        if (pnode->nRecvBytes < Firewall_FloodMaxBytesHalf)
+            WARNINGS |= 1U << 9;
 
-        // WARNING #10 - Recv Bytes above min 
-        if (pnode->nSendBytes > FLOODING_MINBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "10";
-        }
+        // WARNING #10, #12 - Send Bytes above min
+        if (pnode->nSendBytes > Firewall_FloodMinBytesHalf)
+            WARNINGS |= (1U << 10) | (1U << 12);
 
-        // WARNING #11 - Recv Bytes below min
-        if (pnode->nSendBytes < FLOODING_MINBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "11";
-        }
+        // WARNING #11, #13 - Send Bytes below min
+        if (pnode->nSendBytes < Firewall_FloodMinBytesHalf)
+            WARNINGS |= (1U << 11) | (1U << 13);
 
-        // WARNING #12 - Recv Bytes above max 
-        if (pnode->nSendBytes > FLOODING_MINBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "12";
-        }
-
-        // WARNING #13 - Recv Bytes below max
-        if (pnode->nSendBytes < FLOODING_MINBYTES / 2)
-        {
-            WARNINGS = WARNINGS + "13";
-        }
-
-        // WARNING #14 - 
+        // WARNING #14 -
         if (pnode->nTrafficAverage > FIREWALL_FLOODINGWALLET_MINTRAFFICAVERAGE)
-        {
-            WARNINGS = WARNINGS + "14";
-        }
+            WARNINGS |= 1U << 14;
 
-        // WARNING #15 - 
+        // WARNING #15 -
         if (pnode->nTrafficAverage < FIREWALL_FLOODINGWALLET_MINTRAFFICAVERAGE)
-        {
-            WARNINGS = WARNINGS + "15";
-        }
+            WARNINGS |= 1U << 15;
 
-        // WARNING #16 - 
+        // WARNING #16 -
         if (pnode->nTrafficAverage > FIREWALL_FLOODINGWALLET_MAXTRAFFICAVERAGE)
-        {
-            WARNINGS = WARNINGS + "16";
-        }
+            WARNINGS |= 1U << 16;
 
-        // WARNING #17 - 
+        // WARNING #17 -
         if (pnode->nTrafficAverage < FIREWALL_FLOODINGWALLET_MAXTRAFFICAVERAGE)
-        {
-            WARNINGS = WARNINGS + "17";
-        }
+            WARNINGS |= 1U << 17;
 
         // WARNING #18 - Starting Height = SyncHeight above max
         if (pnode->nStartingHeight == pnode->nSyncHeight)
-        {
-            WARNINGS = WARNINGS + "18";
-        }
+            WARNINGS |= 1U << 18;
 
         // WARNING #19 - Connected Time above min
-        if (nTimeConnected > FIREWALL_FLOODINGWALLET_MINCHECK * 60)
-        {
-            WARNINGS = WARNINGS + "19";
-        }
+        if (nTimeConnected > Firewall_FloodMinCheckSeconds)
+            WARNINGS |= 1U << 19;
 
         // WARNING #20 - Connected Time below min
-        if (nTimeConnected < FIREWALL_FLOODINGWALLET_MINCHECK * 60)
-        {
-            WARNINGS = WARNINGS + "20";
-        }
+        if (nTimeConnected < Firewall_FloodMinCheckSeconds)
+            WARNINGS |= 1U << 20;
 
         // WARNING #21 - Connected Time above max
-        if (nTimeConnected > FIREWALL_FLOODINGWALLET_MAXCHECK * 60)
-        {
-            WARNINGS = WARNINGS + "21";
-        }
+        if (nTimeConnected > Firewall_FloodMaxCheckSeconds)
+            WARNINGS |= 1U << 21;
 
         // WARNING #22 - Connected Time below max
-        if (nTimeConnected < FIREWALL_FLOODINGWALLET_MAXCHECK * 60)
-        {
-            WARNINGS = WARNINGS + "22";
-        }
+        if (nTimeConnected < Firewall_FloodMaxCheckSeconds)
+            WARNINGS |= 1U << 22;
 
         // WARNING #23 - Current BlockHeight
-        if (NodeHeight > Firewall_AverageHeight)
-        {  
-            if (NodeHeight < Firewall_AverageHeight_Max)
-            {  
-                WARNINGS = WARNINGS + "23";
-            }
-        }
+        if (NodeHeight > Firewall_AverageHeight && NodeHeight < Firewall_AverageHeight_Max)
+            WARNINGS |= 1U << 23;
 
-        // WARNING #24 - 
-        if (pnode->nSyncHeight < Firewall_AverageTraffic_Max)
-        {
-            if (pnode->nSyncHeight > Firewall_AverageHeight_Min)
-            {
-                WARNINGS = WARNINGS + "24";
-            }
-        }
+        // WARNING #24 -
+        if (pnode->nSyncHeight < Firewall_AverageTraffic_Max && pnode->nSyncHeight > Firewall_AverageHeight_Min)
+            WARNINGS |= 1U << 24;
 
-        // WARNING #25 - 
+        // WARNING #25 -
         if (DETECTED_ATTACK == true)
-        {
-            WARNINGS = WARNINGS + "25";
-        }      
-    
-        // IF WARNINGS is matches pattern for ATTACK = TRUE
-        int i;
-        int TmpFloodPatternsCount;
+            WARNINGS |= 1U << 25;
 
-        TmpFloodPatternsCount = CountStringArray(FIREWALL_FLOODPATTERNS);
-
-        if (TmpFloodPatternsCount > 0)
+        // IF WARNINGS is matches pattern for ATTACK = TRUE
         {
-            for (i = 0; i < TmpFloodPatternsCount; i++)
-            {  
-                // Check for Static Whitelisted Seed Node
-                if (WARNINGS == FIREWALL_FLOODPATTERNS[i])
-                {
-                    DETECTED_ATTACK = true;
-                    ATTACK_TYPE = ATTACK_CHECK_NAME;
-                }
-
+            LOCK(cs_firewall);
+            if (MatchFloodPattern(WARNINGS))
+            {
+                DETECTED_ATTACK = true;
+                ATTACK_TYPE = ATTACK_FLOODING_WALLET;
             }
         }
 
-        // ### LIVE DEBUG OUTPUT ####
-        if (FIREWALL_LIVEDEBUG_FLOODINGWALLET == true)
-        {
-            ATTACK_CHECK_LOG = ATTACK_CHECK_LOG  + " {" +  ATTACK_CHECK_NAME + ":" + WARNINGS + ":" + BoolToString(DETECTED_ATTACK) + "}";
-        }
-        // #######################
+        nFloodWarnings = WARNINGS;
+        fFloodingWalletResult = DETECTED_ATTACK;
 
         if (DETECTED_ATTACK == true)
         {
@@ -944,10 +943,28 @@ bool CheckAttack(CNode *pnode, string FromFunction)
     //}
     //--------------------------
 
-        if (FIREWALL_LIVE_DEBUG == true)
-        {
-            cout << ModuleName << " [Checking: " << pnode->addrName << "] [Attacks: " << ATTACK_CHECK_LOG << "]\n" << endl;
-        }
+    // ### LIVE DEBUG OUTPUT ####
+    if (fLiveDebug == true)
+    {
+        string ATTACK_CHECK_LOG;
+
+        if (FIREWALL_DETECT_BANDWIDTHABUSE == true && FIREWALL_LIVEDEBUG_BANDWIDTHABUSE == true)
+            ATTACK_CHECK_LOG += strprintf(" {Bandwidth Abuse:%s}", BoolToString(fBandwidthAbuseResult));
+
+        if (FIREWALL_NOFALSEPOSITIVE_BANDWIDTHABUSE == true && FIREWALL_LIVEDEBUG_NOFALSEPOSITIVE == true)
+            ATTACK_CHECK_LOG += strprintf(" {No False Positive - Bandwidth Abuse:%s}", BoolToString(fNoFalsePositiveResult));
+
+        if (FIREWALL_DETECT_INVALIDWALLET == true && FIREWALL_LIVEDEBUG_INVALIDWALLET == true)
+            ATTACK_CHECK_LOG += strprintf(" {Invalid Wallet:%s}", BoolToString(fInvalidWalletResult));
+
+        if (FIREWALL_DETECT_FORKEDWALLET == true && FIREWALL_LIVEDEBUG_FORKEDWALLET == true)
+            ATTACK_CHECK_LOG += strprintf(" {Forked Wallet:%s}", BoolToString(fForkedWalletResult));
+
+        if (FIREWALL_DETECT_FLOODINGWALLET == true && FIREWALL_LIVEDEBUG_FLOODINGWALLET == true)
+            ATTACK_CHECK_LOG += strprintf(" {Flooding Wallet:%s:%s}", FloodWarningsToString(nFloodWarnings), BoolToString(fFloodingWalletResult));
+
+        cout << ModuleName << " [Checking: " << pnode->addrName << "] [Attacks: " << ATTACK_CHECK_LOG << "]\n" << endl;
+    }
 
     // ----------------
     // ATTACK DETECTED (TRIGGER)!
@@ -955,10 +972,10 @@ bool CheckAttack(CNode *pnode, string FromFunction)
     {
         if (FIREWALL_LIVE_DEBUG == true)
         {
-            cout << ModuleName << " [Attack Type: " << ATTACK_TYPE << "] [Detected from: " << pnode->addrName << "] [Node Traffic: " << pnode->nTrafficRatio << "] [Node Traffic Avrg: " << pnode->nTrafficAverage << "] [Traffic Avrg: " << Firewall_AverageTraffic << "] [Sent Bytes: " << pnode->nSendBytes << "] [Recv Bytes: " << pnode->nRecvBytes << "] [Sync Height: " << pnode->nSyncHeight << "] [Protocol: " << pnode->nRecvVersion <<"\n" << endl;
+            cout << ModuleName << " [Attack Type: " << AttackTypeName(ATTACK_TYPE) << "] [Detected from: " << pnode->addrName << "] [Node Traffic: " << pnode->nTrafficRatio << "] [Node Traffic Avrg: " << pnode->nTrafficAverage << "] [Traffic Avrg: " << Firewall_AverageTraffic << "] [Sent Bytes: " << pnode->nSendBytes << "] [Recv Bytes: " << pnode->nRecvBytes << "] [Sync Height: " << pnode->nSyncHeight << "] [Protocol: " << pnode->nRecvVersion <<"\n" << endl;
         }
 
-        LogPrint("net", "%s [Attack Type: %s] [Detected from: %s] [Node Traffic: %d] [Node Traffic Avrg: %d] [Traffic Avrg: %d] [Sent Bytes: %d] [Recv Bytes: %d] [Sync Height: %i] [Protocol: %i\n", ModuleName.c_str(), ATTACK_TYPE.c_str(), pnode->addrName.c_str(), pnode->nTrafficRatio, pnode->nTrafficAverage, Firewall_AverageTraffic, pnode->nSendBytes, pnode->nRecvBytes, pnode->nSyncHeight, pnode->nRecvVersion);
+        LogPrint("net", "%s [Attack Type: %s] [Detected from: %s] [Node Traffic: %d] [Node Traffic Avrg: %d] [Traffic Avrg: %d] [Sent Bytes: %d] [Recv Bytes: %d] [Sync Height: %i] [Protocol: %i\n", ModuleName.c_str(), AttackTypeName(ATTACK_TYPE), pnode->addrName.c_str(), pnode->nTrafficRatio, pnode->nTrafficAverage, Firewall_AverageTraffic, pnode->nSendBytes, pnode->nRecvBytes, pnode->nSyncHeight, pnode->nRecvVersion);
 
         // Blacklist IP on Attack detection
         // * add node/peer IP to blacklist
@@ -980,42 +997,24 @@ bool CheckAttack(CNode *pnode, string FromFunction)
 return true;
 
     }
-    else
-    {
 
 //NO ATTACK DETECTED...
 return false;
-    }
-    // ----------------
 }
 
 // * Function: Examination *
-void Examination(CNode *pnode, string FromFunction)
+void Examination(CNode *pnode, const char* FromFunction)
 {
 // Calculate new Height Average from all peers connected
 
     bool UpdateNodeStats = false;
-    int NodeHeight;
-
-    if (pnode->nSyncHeight == 0)
-    {
-        NodeHeight = pnode->nStartingHeight;
-    }
-    else
-    {
-        NodeHeight = pnode->nSyncHeight;
-    }
-
-    if (pnode->nSyncHeight < pnode->nStartingHeight)
-    {
-        NodeHeight = pnode->nStartingHeight;
-    }
-
+    int64_t nNow = GetTime();
+    int NodeHeight = GetNodeHeight(pnode);
 
     // ** Update current average if increased ****
-    if (NodeHeight > Firewall_AverageHeight) 
+    if (NodeHeight > Firewall_AverageHeight)
     {
-        Firewall_AverageHeight = Firewall_AverageHeight + NodeHeight; 
+        Firewall_AverageHeight = Firewall_AverageHeight + NodeHeight;
         Firewall_AverageHeight = Firewall_AverageHeight / 2;
         Firewall_AverageHeight = Firewall_AverageHeight - FIREWALL_AVERAGE_TOLERANCE;      // reduce with tolerance
         Firewall_AverageHeight_Min = Firewall_AverageHeight - FIREWALL_AVERAGE_RANGE;
@@ -1031,28 +1030,36 @@ void Examination(CNode *pnode, string FromFunction)
             UpdateNodeStats = true;
         }
 
-        if (GetTime() - pnode->nTrafficTimestamp > 5){
+        if (nNow - pnode->nTrafficTimestamp > 5){
             UpdateNodeStats = true;
         }
 
-            pnode->nTrafficAverage = pnode->nTrafficAverage + (double)pnode->nTrafficRatio / 2;
-            pnode->nTrafficTimestamp = GetTime();
+        // Once for every FireWall() call since the last examination, so the
+        // average (and the thresholds tuned against it) keeps its per-message scale
+        pnode->nTrafficAverage = pnode->nTrafficAverage + (double)pnode->nTrafficRatio / 2 * pnode->nFirewallCalls;
+        pnode->nTrafficTimestamp = nNow;
 
         if (UpdateNodeStats == true)
-        {   
+        {
             Firewall_AverageTraffic = Firewall_AverageTraffic + (double)pnode->nTrafficAverage;
             Firewall_AverageTraffic = Firewall_AverageTraffic / (double)2;
             Firewall_AverageTraffic = Firewall_AverageTraffic - (double)FIREWALL_TRAFFIC_TOLERANCE;      // reduce with tolerance
             Firewall_AverageTraffic_Min = Firewall_AverageTraffic - (double)FIREWALL_TRAFFIC_ZONE;
-            Firewall_AverageTraffic_Max = Firewall_AverageTraffic + (double)FIREWALL_TRAFFIC_ZONE;    
+            Firewall_AverageTraffic_Max = Firewall_AverageTraffic + (double)FIREWALL_TRAFFIC_ZONE;
             Firewall_AverageSend = Firewall_AverageSend + pnode->nSendBytes / vNodes.size();
-            Firewall_AverageRecv = Firewall_AverageRecv + pnode->nRecvBytes / vNodes.size();        
+            Firewall_AverageRecv = Firewall_AverageRecv + pnode->nRecvBytes / vNodes.size();
 
             if (FIREWALL_LIVE_DEBUG == true)
             {
                 if (FIREWALL_LIVEDEBUG_EXAM == true)
                 {
-                    cout << ModuleName << " [BlackListed Nodes/Peers: " << CountStringArray(FIREWALL_BLACKLIST) << "] [Traffic: " << Firewall_AverageTraffic << "] [Traffic Min: " << Firewall_AverageTraffic_Min << "] [Traffic Max: " << Firewall_AverageTraffic_Max << "]" << " [Safe Height: " << Firewall_AverageHeight << "] [Height Min: " << Firewall_AverageHeight_Min << "] [Height Max: " << Firewall_AverageHeight_Max <<"] [Send Avrg: " << Firewall_AverageSend<< "] [Rec Avrg: " << Firewall_AverageRecv << "]\n" <<endl;
+                    size_t nBlackListed;
+                    {
+                        LOCK(cs_firewall);
+                        nBlackListed = Firewall_BlackListAddr.size() + Firewall_BlackListSubNet.size() + Firewall_BlackListNames.size();
+                    }
+
+                    cout << ModuleName << " [BlackListed Nodes/Peers: " << nBlackListed << "] [Traffic: " << Firewall_AverageTraffic << "] [Traffic Min: " << Firewall_AverageTraffic_Min << "] [Traffic Max: " << Firewall_AverageTraffic_Max << "]" << " [Safe Height: " << Firewall_AverageHeight << "] [Height Min: " << Firewall_AverageHeight_Min << "] [Height Max: " << Firewall_AverageHeight_Max <<"] [Send Avrg: " << Firewall_AverageSend<< "] [Rec Avrg: " << Firewall_AverageRecv << "]\n" <<endl;
 
                     cout << ModuleName << "[Check Node IP: " << pnode->addrName.c_str() << "] [Traffic: " << pnode->nTrafficRatio << "] [Traffic Average: " << pnode->nTrafficAverage << "] [Starting Height: " << pnode->nStartingHeight << "] [Sync Height: " << NodeHeight << "] [Node Sent: " << pnode->nSendBytes << "] [Node Recv: " << pnode->nRecvBytes << "] [Protocol: " << pnode->nRecvVersion << "]\n" << endl;
                 }
@@ -1063,10 +1070,12 @@ void Examination(CNode *pnode, string FromFunction)
 
     CheckAttack(pnode, FromFunction);
     }
+
+    pnode->nFirewallCalls = 0;
 }
 
 // * Function: FireWall *
-bool FireWall(CNode *pnode, string FromFunction)
+bool FireWall(CNode *pnode, const char* FromFunction)
 {
 
     if (Firewall_FirstRun == false)
@@ -1080,61 +1089,76 @@ bool FireWall(CNode *pnode, string FromFunction)
         return false;
     }
 
-    int i;
-    int TmpWhiteListCount;
-
-    TmpWhiteListCount = CountStringArray(FIREWALL_WHITELIST);
-
-    if (TmpWhiteListCount > 0)
-    {
-        for (i = 0; i < TmpWhiteListCount; i++)
-        {  
-            // Check for Static Whitelisted Seed Node
-            if (pnode->addrName == FIREWALL_WHITELIST[i])
-            {
-                return false;
-            }
-        }
-    }
-
     // Check for Node Whitelisted status
     if (pnode->fWhitelisted == true)
     {
         return false;
     }
 
-    if (FIREWALL_CLEAR_BANS == true)
+    // Rules only change on RPC/config updates; messages share one slow path
+    // per second per node for the traffic examination
+    int64_t nNow = GetTime();
+    bool fExamine = (nNow - pnode->nFirewallCheckTime >= FIREWALL_EXAM_INTERVAL);
+    bool fBlackListed;
+
     {
-        if (FIREWALL_CLEARBANS_MINNODES <= vNodes.size())
+        LOCK(cs_firewall);
+
+        if (Firewall_SettingsDirty)
+        {
+            UpdateFirewallCache();
+        }
+
+        // Check for Static Whitelisted Seed Node
+        if (MatchFirewallAddress(pnode, Firewall_WhiteListAddr, Firewall_WhiteListSubNet, Firewall_WhiteListNames))
         {
-            pnode->ClearBanned();
-            int TmpBlackListCount;
-            TmpBlackListCount = CountStringArray(FIREWALL_BLACKLIST);
-            std::fill_n(FIREWALL_BLACKLIST, TmpBlackListCount, 0);
-            LogPrint("net", "%s Cleared ban: %s\n", ModuleName.c_str(), pnode->addrName.c_str());
+            return false;
         }
+
+        if (FIREWALL_CLEAR_BANS == true)
+        {
+            if (FIREWALL_CLEARBANS_MINNODES <= vNodes.size())
+            {
+                pnode->ClearBanned();
+                if (!Firewall_BlackListAddr.empty() || !Firewall_BlackListSubNet.empty() || !Firewall_BlackListNames.empty())
+                {
+                    Firewall_BlackListAddr.clear();
+                    Firewall_BlackListSubNet.clear();
+                    Firewall_BlackListNames.clear();
+                    std::fill_n(FIREWALL_BLACKLIST, 256, string());
+                    LogPrint("net", "%s Cleared ban: %s\n", ModuleName.c_str(), pnode->addrName.c_str());
+                }
+            }
+        }
+
+        fBlackListed = MatchFirewallAddress(pnode, Firewall_BlackListAddr, Firewall_BlackListSubNet, Firewall_BlackListNames);
     }
 
-    if (CheckBlackList(pnode) == true)
+    if (fBlackListed == true)
     {
-        FromFunction = "CheckBlackList";
-
         LogPrint("net", "%s Disconnected Blacklisted IP: %s\n", ModuleName.c_str(), pnode->addrName.c_str());
 
         // Peer/Node Panic Disconnect
-        ForceDisconnectNode(pnode, FromFunction);
+        ForceDisconnectNode(pnode, "CheckBlackList");
         return true;
 
     }
 
-    if (CheckBanned(pnode) == true)
+    pnode->nFirewallCalls++;
+
+    if (!fExamine)
     {
-        FromFunction = "CheckBanned";
+        return false;
+    }
 
+    pnode->nFirewallCheckTime = nNow;
+
+    if (CheckBanned(pnode) == true)
+    {
         LogPrint("net", "%s Disconnected Banned IP: %s\n", ModuleName.c_str(), pnode->addrName.c_str());
 
         // Peer/Node Panic Disconnect
-        ForceDisconnectNode(pnode, FromFunction);
+        ForceDisconnectNode(pnode, "CheckBanned");
         return true;
 
     }
@@ -1142,6 +1166,6 @@ bool FireWall(CNode *pnode, string FromFunction)
     // Perform a Node consensus examination
     Examination(pnode, FromFunction);
 
-// Peer/Node Safe    
+// Peer/Node Safe
 return false;
 }
@@ -87,3 +87,9 @@ extern double FIREWALL_FLOODINGWALLET_MINTRAFFICAVERAGE;
 extern double FIREWALL_FLOODINGWALLET_MAXTRAFFICAVERAGE;
 extern int FIREWALL_FLOODINGWALLET_MINCHECK;
 extern int FIREWALL_FLOODINGWALLET_MAXCHECK;
+
+class CNode;
+
+void LoadFirewallSettings();
+void FirewallSettingsChanged();
+bool FireWall(CNode *pnode, const char* FromFunction);
@@ -47,6 +47,7 @@ CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
+CConditionVariable cvBlockTemplate;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
@@ -259,6 +260,14 @@ struct CNodeState {
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    //! Adaptive limit on nBlocksInFlight, derived from nDownloadRTT and nBlockServiceTime.
+    int nBlocksInFlightTarget;
+    //! Most recent round-trip time to this peer (in microseconds), or 0 if unknown.
+    int64_t nDownloadRTT;
+    //! Moving average of the time this peer needs to deliver one requested block (in microseconds), or 0 if unknown.
+    int64_t nBlockServiceTime;
+    //! When we last received a block we requested from this peer (in microseconds), or 0.
+    int64_t nLastBlockReceived;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
 
@@ -272,6 +281,10 @@ struct CNodeState {
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nBlocksInFlightTarget = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        nDownloadRTT = 0;
+        nBlockServiceTime = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
     }
 };
@@ -329,11 +342,29 @@ void FinalizeNode(NodeId nodeid) {
     mapNodeState.erase(nodeid);
 }
 
+/** Recompute a peer's in-flight limit. Peers without measurements keep the static default. */
+void UpdateBlocksInFlightTarget(CNodeState *state) {
+    if (state->nBlockServiceTime == 0 || state->nDownloadRTT == 0)
+        return;
+    state->nBlocksInFlightTarget = GetBlocksInFlightTarget(state->nDownloadRTT, state->nBlockServiceTime);
+}
+
 // Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash) {
+// nodeFrom is the peer that delivered the block, or -1 if it did not arrive over the network.
+void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (nodeFrom == itInFlight->second.first) {
+            // The time spent serving this block starts when it was requested or when the previous block from
+            // the same peer arrived, whichever is later, so pipelined requests are not counted twice.
+            int64_t nNow = GetTimeMicros();
+            int64_t nSample = nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived);
+            if (nSample > 0)
+                state->nBlockServiceTime = state->nBlockServiceTime ? (state->nBlockServiceTime * 7 + nSample) / 8 : nSample;
+            state->nLastBlockReceived = nNow;
+            UpdateBlocksInFlightTarget(state);
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
@@ -411,7 +442,7 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
  *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalled) {
     if (count == 0)
         return;
 
@@ -441,10 +472,10 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
     std::vector<CBlockIndex*> vToFetch;
     CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
-    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // Never fetch further than the best block we know the peer has, or more than its download window + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
     // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + GetBlockDownloadWindow(state->nBlocksInFlightTarget);
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
 
     LOCK(cs_vNodes);
@@ -457,6 +488,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     }
 
     NodeId waitingfor = -1;
+    CBlockIndex *pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -487,6 +519,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -497,6 +530,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -504,6 +538,17 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
 } // anon namespace
 
+int GetBlocksInFlightTarget(int64_t nDownloadRTT, int64_t nBlockServiceTime) {
+    // The bandwidth-delay product: enough blocks to keep the link busy for one round trip, plus slack
+    int64_t nTarget = nDownloadRTT / nBlockServiceTime + 2;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE, nTarget));
+}
+
+int GetBlockDownloadWindow(int nBlocksInFlightTarget) {
+    int64_t nWindow = (int64_t)BLOCK_DOWNLOAD_WINDOW * nBlocksInFlightTarget / MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    return std::max<int64_t>(MIN_BLOCK_DOWNLOAD_WINDOW, std::min<int64_t>(MAX_BLOCK_DOWNLOAD_WINDOW, nWindow));
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -952,10 +997,17 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee)
+/**
+ * The checks AcceptToMemoryPool makes before the scripts and the package
+ * limits. view must see pcoinsTip through the pool and the caller must hold
+ * pool.cs until the entry is added, so the pool cannot change in between.
+ * On success entry is set up for tx.
+ */
+static bool AcceptToMemoryPoolPreChecks(CTxMemPool& pool, CValidationState &state, const CTransaction &tx,
+                                        bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime,
+                                        bool fRejectInsaneFee, CCoinsViewCache& view, CTxMemPoolEntry& entry)
 {
-    AssertLockHeld(cs_main);
+    AssertLockHeld(pool.cs);
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -980,8 +1032,6 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         return false;
 
     // Check for conflicts with in-memory transactions
-    {
-    LOCK(pool.cs); // protect pool.mapNextTx
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -990,112 +1040,156 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             // Disable replacement feature for now
             return false;
         }
-        }
     }
 
-    {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
-
-        CAmount nValueIn = 0;
-        {
-        LOCK(pool.cs);
-        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
-        view.SetBackend(viewMemPool);
+    // do we already have it?
+    if (view.HaveCoins(hash))
+        return false;
 
-        // do we already have it?
-        if (view.HaveCoins(hash))
+    // do all inputs exist?
+    // Note that this does not check for the presence of actual outputs (see the next check for that),
+    // only helps filling in pfMissingInputs (to determine missing vs spent).
+    BOOST_FOREACH(const CTxIn txin, tx.vin) {
+        if (!view.HaveCoins(txin.prevout.hash)) {
+            if (pfMissingInputs)
+                *pfMissingInputs = true;
             return false;
-
-        // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
-        BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
-                if (pfMissingInputs)
-                    *pfMissingInputs = true;
-                return false;
-            }
         }
+    }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
-                                 REJECT_DUPLICATE, "bad-txns-inputs-spent");
+    // are the actual inputs available?
+    if (!view.HaveInputs(tx))
+        return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
+                             REJECT_DUPLICATE, "bad-txns-inputs-spent");
 
-        // Bring the best block into scope
-        view.GetBestBlock();
+    // Bring the best block into scope
+    view.GetBestBlock();
 
-        nValueIn = view.GetValueIn(tx);
+    CAmount nValueIn = view.GetValueIn(tx);
 
-        // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-        view.SetBackend(dummy);
-        }
+    // Check for non-standard pay-to-script-hash in inputs
+    if (Params().RequireStandard() && !AreInputsStandard(tx, view))
+        return error("AcceptToMemoryPool: : nonstandard transaction input");
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (Params().RequireStandard() && !AreInputsStandard(tx, view))
-            return error("AcceptToMemoryPool: : nonstandard transaction input");
+    // Check that the transaction doesn't have an excessive number of
+    // sigops, making it impossible to mine. Since the coinbase transaction
+    // itself can contain sigops MAX_TX_SIGOPS is less than
+    // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
+    // merely non-standard transaction.
+    unsigned int nSigOps = GetLegacySigOpCount(tx);
+    nSigOps += GetP2SHSigOpCount(tx, view);
+    if (nSigOps > MAX_TX_SIGOPS)
+        return state.DoS(0,
+                         error("AcceptToMemoryPool : too many sigops %s, %d > %d",
+                               hash.ToString(), nSigOps, MAX_TX_SIGOPS),
+                         REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
+
+    CAmount nValueOut = tx.GetValueOut();
+    CAmount nFees = nValueIn-nValueOut;
+    double dPriority = view.GetPriority(tx, chainActive.Height());
+
+    entry = CTxMemPoolEntry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
+    unsigned int nSize = entry.GetTxSize();
+
+    // Index coinbase spends by height, so a reorg only has to look at
+    // the ones that can become immature
+    int nCoinbaseSpendHeight = -1;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+        if (coins->IsCoinBase())
+            nCoinbaseSpendHeight = std::max(nCoinbaseSpendHeight, coins->nHeight);
+    }
+    entry.SetCoinbaseSpendHeight(nCoinbaseSpendHeight);
+
+    // Don't accept it if it can't get into a block
+    CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
+    if (fLimitFree && nFees < txMinFee)
+        return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
+                                  hash.ToString(), nFees, txMinFee),
+                         REJECT_INSUFFICIENTFEE, "insufficient fee");
+
+    // Once the pool has been full it asks for more than the relay fee
+    CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+    if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+        return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                  hash.ToString(), nFees, mempoolRejectFee),
+                         REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
+    // Require that free transactions have sufficient priority to be mined in the next block.
+    if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
+    }
+
+    // Continuously rate-limit free (really, very-low-fee) transactions
+    // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
+    // be annoying or make others' transactions take longer to confirm.
+    if (fLimitFree && nFees < ::minRelayTxFee.GetFee(nSize))
+    {
+        static CCriticalSection csFreeLimiter;
+        static double dFreeCount;
+        static int64_t nLastTime;
+        int64_t nNow = GetTime();
+
+        LOCK(csFreeLimiter);
+
+        // Use an exponentially decaying ~10-minute window:
+        dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
+        nLastTime = nNow;
+        // -limitfreerelay unit is thousand-bytes-per-minute
+        // At default rate it would take over a month to fill 1GB
+        if (dFreeCount >= GetArg("-limitfreerelay", 15)*10*1000)
+            return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
+                             REJECT_INSUFFICIENTFEE, "rate limited free transaction");
+        LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+        dFreeCount += nSize;
+    }
+
+    if (fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
+        return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
+                     hash.ToString(),
+                     nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
-        // Check that the transaction doesn't have an excessive number of
-        // sigops, making it impossible to mine. Since the coinbase transaction
-        // itself can contain sigops MAX_TX_SIGOPS is less than
-        // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
-        // merely non-standard transaction.
-        unsigned int nSigOps = GetLegacySigOpCount(tx);
-        nSigOps += GetP2SHSigOpCount(tx, view);
-        if (nSigOps > MAX_TX_SIGOPS)
-            return state.DoS(0,
-                             error("AcceptToMemoryPool : too many sigops %s, %d > %d",
-                                   hash.ToString(), nSigOps, MAX_TX_SIGOPS),
-                             REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
+    return true;
+}
 
-        CAmount nValueOut = tx.GetValueOut();
-        CAmount nFees = nValueIn-nValueOut;
-        double dPriority = view.GetPriority(tx, chainActive.Height());
+/** Collect the in-mempool ancestors of entry, failing if it would exceed the package limits */
+static bool CheckMemPoolAncestorLimits(CTxMemPool& pool, CValidationState &state, const CTxMemPoolEntry& entry,
+                                       CTxMemPool::setEntries& setAncestors)
+{
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+        return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s, %s", entry.GetTx().GetHash().ToString(), errString),
+                         REJECT_NONSTANDARD, "too-long-mempool-chain");
+    }
+    return true;
+}
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
-        unsigned int nSize = entry.GetTxSize();
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee,
+                                bool fOverrideMempoolLimit)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = tx.GetHash();
 
-        // Don't accept it if it can't get into a block
-        CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
-        if (fLimitFree && nFees < txMinFee)
-            return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
-                                      hash.ToString(), nFees, txMinFee),
-                             REJECT_INSUFFICIENTFEE, "insufficient fee");
+    {
+        // The pool must not change between the checks and addUnchecked()
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewCache view(&viewMemPool);
 
-        // Require that free transactions have sufficient priority to be mined in the next block.
-        if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
-        }
+        CTxMemPoolEntry entry;
+        if (!AcceptToMemoryPoolPreChecks(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime,
+                                         fRejectInsaneFee, view, entry))
+            return false;
 
-        // Continuously rate-limit free (really, very-low-fee) transactions
-        // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
-        // be annoying or make others' transactions take longer to confirm.
-        if (fLimitFree && nFees < ::minRelayTxFee.GetFee(nSize))
-        {
-            static CCriticalSection csFreeLimiter;
-            static double dFreeCount;
-            static int64_t nLastTime;
-            int64_t nNow = GetTime();
-
-            LOCK(csFreeLimiter);
-
-            // Use an exponentially decaying ~10-minute window:
-            dFreeCount *= pow(1.0 - 1.0/600.0, (double)(nNow - nLastTime));
-            nLastTime = nNow;
-            // -limitfreerelay unit is thousand-bytes-per-minute
-            // At default rate it would take over a month to fill 1GB
-            if (dFreeCount >= GetArg("-limitfreerelay", 15)*10*1000)
-                return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
-                                 REJECT_INSUFFICIENTFEE, "rate limited free transaction");
-            LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
-            dFreeCount += nSize;
-        }
-
-        if (fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
-            return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
-                         hash.ToString(),
-                         nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        if (!CheckMemPoolAncestorLimits(pool, state, entry, setAncestors))
+            return false;
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
@@ -1117,9 +1211,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+        // Lets CreateNewBlock skip the scripts of this transaction
+        entry.SetValidatedScriptFlags(STANDARD_SCRIPT_VERIFY_FLAGS);
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // Trim the mempool and check whether tx itself was evicted
+        if (!fOverrideMempoolLimit) {
+            pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1127,6 +1230,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(),
+                                      fRejectInsaneFee, fOverrideMempoolLimit);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1679,13 +1789,209 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/**
+ * Run the script checks of the transactions in a batch that are still
+ * passing, on the check queue if there are script threads. When any check
+ * fails they are run again one transaction at a time to find out which,
+ * and those are failed with the states CheckInputs() would have given.
+ */
+static void CheckBatchScripts(const std::vector<CTransaction>& vtx,
+                              std::vector<std::vector<CScriptCheck> >& vStandardChecks,
+                              std::vector<std::vector<CScriptCheck> >& vMandatoryChecks,
+                              std::vector<bool>& vPassed, std::vector<CValidationState>& vState)
+{
+    if (nScriptCheckThreads) {
+        // Mandatory flags second, when they are mostly signature cache hits
+        bool fAllOk = true;
+        for (int nRound = 0; nRound < 2 && fAllOk; nRound++) {
+            std::vector<std::vector<CScriptCheck> >& vChecks = nRound == 0 ? vStandardChecks : vMandatoryChecks;
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            for (unsigned int i = 0; i < vChecks.size(); i++) {
+                if (!vPassed[i])
+                    continue;
+                // The queue takes the checks it is given, keep ours for a rerun
+                std::vector<CScriptCheck> vCopy(vChecks[i]);
+                control.Add(vCopy);
+            }
+            fAllOk = control.Wait();
+        }
+        if (fAllOk)
+            return;
+    }
+
+    for (unsigned int i = 0; i < vStandardChecks.size(); i++) {
+        if (!vPassed[i])
+            continue;
+        for (unsigned int j = 0; j < vStandardChecks[i].size(); j++) {
+            if (vStandardChecks[i][j]())
+                continue;
+            CScriptCheck& check = vMandatoryChecks[i][j];
+            if (check())
+                vState[i].Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(vStandardChecks[i][j].GetScriptError())));
+            else
+                vState[i].DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+            vPassed[i] = false;
+            break;
+        }
+        if (!vPassed[i])
+            continue;
+        for (unsigned int j = 0; j < vMandatoryChecks[i].size(); j++) {
+            if (!vMandatoryChecks[i][j]()) {
+                error("AcceptToMemoryPoolBatch: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", vtx[i].GetHash().ToString());
+                vPassed[i] = false;
+                break;
+            }
+        }
+    }
+}
+
+/** Whether vtx[i] spends an output of an earlier transaction of the batch that did not make it */
+static bool SpendsFailedBatchParent(const std::vector<CTransaction>& vtx, unsigned int i,
+                                    const std::map<uint256, unsigned int>& mapBatchIndex, const std::vector<bool>& vOk)
+{
+    BOOST_FOREACH(const CTxIn& txin, vtx[i].vin) {
+        std::map<uint256, unsigned int>::const_iterator it = mapBatchIndex.find(txin.prevout.hash);
+        if (it != mapBatchIndex.end() && it->second < i && !vOk[it->second])
+            return true;
+    }
+    return false;
+}
+
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx,
+                                     std::vector<CValidationState>& vState, std::vector<bool>& vAccepted,
+                                     bool fLimitFree, bool fRejectInsaneFee)
+{
+    AssertLockHeld(cs_main);
+    vState.assign(vtx.size(), CValidationState());
+    vAccepted.assign(vtx.size(), false);
+    std::vector<bool> vTurnedAway(vtx.size(), false);
+    bool fScriptFailed;
+
+    {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewCache view(&viewMemPool);
+        int64_t nAcceptTime = GetTime();
+
+        // Everything but the scripts and the package limits, in order. Each
+        // transaction that passes is applied to the view, so later ones can
+        // spend its outputs and cannot spend its inputs again.
+        std::vector<CTxMemPoolEntry> vEntry(vtx.size());
+        std::vector<std::vector<CScriptCheck> > vStandardChecks(vtx.size()), vMandatoryChecks(vtx.size());
+        std::vector<bool> vPassed(vtx.size(), false);
+        std::map<uint256, unsigned int> mapBatchIndex;
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            mapBatchIndex.insert(std::make_pair(vtx[i].GetHash(), i));
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            const CTransaction& tx = vtx[i];
+            bool fMissingInputs;
+            if (!AcceptToMemoryPoolPreChecks(pool, vState[i], tx, fLimitFree, &fMissingInputs, nAcceptTime,
+                                             fRejectInsaneFee, view, vEntry[i])) {
+                if (fMissingInputs && SpendsFailedBatchParent(vtx, i, mapBatchIndex, vPassed))
+                    vState[i].Invalid(false, REJECT_INVALID, "bad-txns-parent-rejected");
+                vTurnedAway[i] = fMissingInputs || vState[i].GetRejectReason() == "bad-txns-inputs-spent";
+                continue;
+            }
+            if (!CheckInputs(tx, vState[i], view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vStandardChecks[i]) ||
+                !CheckInputs(tx, vState[i], view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, &vMandatoryChecks[i]))
+                continue;
+            CTxUndo undoDummy;
+            UpdateCoins(tx, vState[i], view, undoDummy, MEMPOOL_HEIGHT);
+            vPassed[i] = true;
+        }
+
+        std::vector<bool> vPassedInputs(vPassed);
+        CheckBatchScripts(vtx, vStandardChecks, vMandatoryChecks, vPassed, vState);
+        fScriptFailed = vPassed != vPassedInputs;
+
+        // Add in order, so parents from the batch are in the pool before
+        // their children; a child of a failed one has lost its inputs
+        bool fCurrentEstimate = !IsInitialBlockDownload();
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            if (!vPassed[i])
+                continue;
+            if (SpendsFailedBatchParent(vtx, i, mapBatchIndex, vAccepted)) {
+                vState[i].Invalid(false, REJECT_INVALID, "bad-txns-parent-rejected");
+                continue;
+            }
+
+            CTxMemPool::setEntries setAncestors;
+            if (!CheckMemPoolAncestorLimits(pool, vState[i], vEntry[i], setAncestors))
+                continue;
+            vEntry[i].SetValidatedScriptFlags(STANDARD_SCRIPT_VERIFY_FLAGS);
+            pool.addUnchecked(vtx[i].GetHash(), vEntry[i], setAncestors, fCurrentEstimate);
+            vAccepted[i] = true;
+        }
+
+        // Trim once for the whole batch
+        pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            if (vAccepted[i] && !pool.exists(vtx[i].GetHash())) {
+                vAccepted[i] = false;
+                vState[i].DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+            }
+        }
+    }
+
+    unsigned int nAccepted = 0;
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        if (vAccepted[i]) {
+            SyncWithWallets(vtx[i], NULL);
+            nAccepted++;
+        }
+    }
+
+    // A transaction failing its scripts had already been applied to the
+    // view, so later ones spending the same inputs, or outputs of those,
+    // may have been turned away for it. Give them another go one at a time.
+    if (fScriptFailed) {
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            if (!vTurnedAway[i])
+                continue;
+            // Still turned away, the reason found by the batch stands
+            CValidationState state;
+            if (AcceptToMemoryPoolWithTime(pool, state, vtx[i], fLimitFree, NULL, GetTime(), fRejectInsaneFee)) {
+                vState[i] = state;
+                vAccepted[i] = true;
+                nAccepted++;
+            } else if (state.IsInvalid()) {
+                vState[i] = state;
+            }
+        }
+    }
+    return nAccepted;
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+unsigned int GetBlockScriptFlags(int nVersion, int64_t nTime, const CBlockIndex* pindexPrev)
+{
+    // BIP16 didn't become active until Oct 1 2012
+    int64_t nBIP16SwitchTime = 1349049600;
+    bool fStrictPayToScriptHash = (nTime >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
+    // when 75% of the network has upgraded:
+    if (nVersion >= 3 && CBlockIndex::IsSuperMajority(3, pindexPrev, Params().EnforceBlockUpgradeMajority())) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
+    // blocks, when 75% of the network has upgraded:
+    if (nVersion >= 4 && CBlockIndex::IsSuperMajority(4, pindexPrev, Params().EnforceBlockUpgradeMajority())) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    return flags;
+}
+
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fCheckScripts)
 {
     AssertLockHeld(cs_main);
     // Check it again in case a previous version let a bad block in
@@ -1703,7 +2009,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = fCheckScripts && pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1726,23 +2032,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    // BIP16 didn't become active until Oct 1 2012
-    int64_t nBIP16SwitchTime = 1349049600;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
-    // when 75% of the network has upgraded:
-    if (block.nVersion >= 3 && CBlockIndex::IsSuperMajority(3, pindex->pprev, Params().EnforceBlockUpgradeMajority())) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
-    // blocks, when 75% of the network has upgraded:
-    if (block.nVersion >= 4 && CBlockIndex::IsSuperMajority(4, pindex->pprev, Params().EnforceBlockUpgradeMajority())) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
+    unsigned int flags = GetBlockScriptFlags(block.nVersion, pindex->GetBlockTime(), pindex->pprev);
 
     CBlockUndo blockundo;
 
@@ -1772,7 +2062,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 return state.DoS(100, error("ConnectBlock() : inputs missing/spent"),
                                  REJECT_INVALID, "bad-txns-inputs-missingorspent");
 
-            if (fStrictPayToScriptHash)
+            if (flags & SCRIPT_VERIFY_P2SH)
             {
                 // Add in sigops done by pay-to-script-hash inputs;
                 // this is to prevent a "rogue miner" from creating
@@ -1984,14 +2274,22 @@ bool static DisconnectTip(CValidationState &state) {
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
-    }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // Transactions already in the mempool may spend the ones just re-added;
+    // link them so the ancestor and descendant totals stay right.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    // The block's transactions went in regardless of -maxmempool
+    mempool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    mempool.removeCoinbaseSpends(pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
@@ -2052,7 +2350,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
-    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
+    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
@@ -2827,7 +3125,7 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDis
 
     {
         LOCK(cs_main);
-        MarkBlockAsReceived(pblock->GetHash());
+        MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         if (!checked) {
             return error("%s : CheckBlock FAILED", __func__);
         }
@@ -2849,7 +3147,7 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDis
     return true;
 }
 
-bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex * const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot)
+bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex * const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckScripts)
 {
     AssertLockHeld(cs_main);
     assert(pindexPrev == chainActive.Tip());
@@ -2866,7 +3164,7 @@ bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex
         return false;
     if (!ContextualCheckBlock(block, state, pindexPrev))
         return false;
-    if (!ConnectBlock(block, state, &indexDummy, viewNew, true))
+    if (!ConnectBlock(block, state, &indexDummy, viewNew, true, fCheckScripts))
         return false;
     assert(state.IsValid());
 
@@ -3306,6 +3604,145 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+namespace {
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("%s: Failed to open mempool file from disk. Continuing anyway.\n", __func__);
+        return false;
+    }
+
+    int64_t nCount = 0, nFailed = 0, nAlreadyThere = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("%s: Unknown mempool file version %u, ignoring it\n", __func__, nVersion);
+            return false;
+        }
+        uint64_t nTxs;
+        file >> nTxs;
+        while (nTxs--) {
+            // Let shutdown interrupt a long reload; the file is kept for next time
+            boost::this_thread::interruption_point();
+
+            CTransaction tx;
+            int64_t nTime;
+            double dPriorityDelta;
+            CAmount nFeeDelta;
+            file >> tx;
+            file >> nTime;
+            file >> dPriorityDelta;
+            file >> nFeeDelta;
+
+            uint256 hash = tx.GetHash();
+            if (dPriorityDelta != 0 || nFeeDelta != 0)
+                mempool.PrioritiseTransaction(hash, hash.ToString(), dPriorityDelta, nFeeDelta);
+
+            // Take cs_main per transaction so RPC and block processing are not held up
+            LOCK(cs_main);
+            CValidationState state;
+            if (mempool.exists(hash))
+                nAlreadyThere++;
+            else if (AcceptToMemoryPoolWithTime(mempool, state, tx, false, NULL, nTime))
+                nCount++;
+            else
+                nFailed++;
+        }
+
+        // Deltas for transactions that were not in the pool when it was dumped
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", __func__, e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i already there, in %dms\n",
+              nCount, nFailed, nAlreadyThere, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    // Copy out what is needed and write without holding the pool lock.
+    // Parents have fewer in-mempool ancestors than their children, so
+    // ordering by ancestor count lets every transaction be re-accepted.
+    std::vector<CTxMemPool::txiter> vSorted;
+    std::vector<CTransaction> vtx;
+    std::vector<int64_t> vTime;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vSorted.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vSorted.push_back(it);
+        std::sort(vSorted.begin(), vSorted.end(), CompareTxIterByAncestorCount());
+        vtx.reserve(vSorted.size());
+        vTime.reserve(vSorted.size());
+        for (unsigned int i = 0; i < vSorted.size(); i++) {
+            vtx.push_back(vSorted[i]->GetTx());
+            vTime.push_back(vSorted[i]->GetTime());
+        }
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathNew = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathNew.string().c_str(), "wb");
+        if (!filestr)
+            return error("%s: Failed to open %s", __func__, pathNew.string());
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        file << MEMPOOL_DUMP_VERSION;
+        file << (uint64_t)vtx.size();
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            uint256 hash = vtx[i].GetHash();
+            std::pair<double, CAmount> deltas(0, 0);
+            std::map<uint256, std::pair<double, CAmount> >::iterator itDelta = mapDeltas.find(hash);
+            if (itDelta != mapDeltas.end()) {
+                deltas = itDelta->second;
+                mapDeltas.erase(itDelta);
+            }
+            file << vtx[i];
+            file << vTime[i];
+            file << deltas.first;
+            file << deltas.second;
+        }
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathNew, GetDataDir() / "mempool.dat"))
+            return error("%s: Failed to rename %s", __func__, pathNew.string());
+    } catch (const std::exception& e) {
+        return error("%s: Failed to dump mempool: %s", __func__, e.what());
+    }
+
+    int64_t nLast = GetTimeMicros();
+    LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    return true;
+}
+
 void static CheckBlockIndex()
 {
     if (!fCheckBlockIndex) {
@@ -3552,6 +3989,7 @@ void static ProcessGetData(CNode* pfrom)
 
     LOCK(cs_main);
 
+    pfrom->fGetDataPaced = false;
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3581,6 +4019,26 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // Historical blocks are the only traffic the upload target holds back: they are
+                // paced through the token bucket, and are the first thing we stop serving when the
+                // target is close, so the remaining budget is kept for tip and transaction relay.
+                if (send && !pfrom->fWhitelisted && pindexBestHeader != NULL &&
+                    mi->second->GetBlockTime() < pindexBestHeader->GetBlockTime() - HISTORICAL_BLOCK_AGE)
+                {
+                    if (CNode::OutboundTargetReached(true))
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    else if (!CNode::HaveOutboundTokens())
+                    {
+                        // Leave it queued until the bucket has refilled
+                        pfrom->fGetDataPaced = true;
+                        it--;
+                        break;
+                    }
+                }
                 if (send)
                 {
                     // Send block from disk
@@ -3604,7 +4062,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -3869,7 +4327,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -3945,7 +4403,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        nodestate->nBlocksInFlight < nodestate->nBlocksInFlightTarget) {
                         vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
@@ -4080,7 +4538,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         bool fMissingInputs = false;
         CValidationState state;
 
-        mapAlreadyAskedFor.erase(inv);
+        mapAlreadyAskedFor.erase(inv.hash);
 
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
@@ -4606,7 +5064,7 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
-bool SendMessages(CNode* pto, bool fSendTrickle)
+bool SendMessages(CNode* pto)
 {
     {
         // Don't send anything until we get their version message
@@ -4653,9 +5111,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->addrKnown.clear();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -4667,15 +5125,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: addr
         //
-        if (fSendTrickle)
+        int64_t nNow = GetTimeMicros();
+        if (pto->nNextAddrSend < nNow)
         {
+            pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                if (!pto->addrKnown.contains(addr.GetKey()))
                 {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000)
@@ -4737,52 +5197,67 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
+        vector<uint256> vTxToSend;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vInv.reserve(std::min<size_t>(1000, pto->vInventoryToSend.size() + pto->setInventoryTxToSend.size()));
+
+            // Blocks are announced right away
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+            }
+            pto->vInventoryToSend.clear();
+
+            // Transactions are trickled out to protect privacy: the whole queue is
+            // flushed at once when this peer's Poisson timer fires. Outbound peers
+            // get half the delay, as there is less privacy concern for them.
+            bool fSendTrickle = pto->fWhitelisted;
+            if (pto->nNextInvSend < nNow) {
+                fSendTrickle = true;
+                pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
+            }
+            if (fSendTrickle)
+            {
+                vTxToSend.reserve(pto->setInventoryTxToSend.size());
+                BOOST_FOREACH(const uint256& hash, pto->setInventoryTxToSend)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    if (pto->filterInventoryKnown.contains(hash))
+                        continue;
+                    // Evicted, mined or conflicted since it was queued: we
+                    // could not serve it if the peer asked for it
+                    if (!mempool.exists(hash))
+                        continue;
+                    pto->filterInventoryKnown.insert(hash);
+                    vTxToSend.push_back(hash);
                 }
+                pto->setInventoryTxToSend.clear();
+            }
+        }
+        // Announce parents before their children, so the peer does not see
+        // the child as an orphan when it asks for both
+        mempool.SortByAncestorCount(vTxToSend);
+        BOOST_FOREACH(const uint256& hash, vTxToSend)
+        {
+            vInv.push_back(CInv(MSG_TX, hash));
+            if (vInv.size() >= 1000)
+            {
+                pto->PushMessage("inv", vInv);
+                vInv.clear();
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -4804,10 +5279,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (pto->nPingUsecTime > 0 && state.nDownloadRTT != pto->nPingUsecTime) {
+            state.nDownloadRTT = pto->nPingUsecTime;
+            UpdateBlocksInFlightTarget(&state);
+        }
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < state.nBlocksInFlightTarget) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex *pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInFlightTarget - state.nBlocksInFlight, vToDownload, staller, pindexStalled);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
@@ -4815,8 +5295,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState *stateStaller = State(staller);
+                if (pindexStalled && state.nBlockServiceTime && stateStaller->nBlockServiceTime > BLOCK_STALLING_SLOWDOWN_FACTOR * state.nBlockServiceTime) {
+                    // The block holding back the window sits with a peer that is much slower than us; take it over
+                    // instead of waiting for the stall timeout, and shrink the slow peer's share of the window.
+                    vGetData.push_back(CInv(MSG_BLOCK, pindexStalled->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindexStalled->GetBlockHash(), pindexStalled);
+                    stateStaller->nBlocksInFlightTarget = MIN_BLOCKS_IN_TRANSIT_PER_PEER;
+                    LogPrint("net", "Reassigning stalled block %s (%d) from peer=%d to peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                        pindexStalled->nHeight, staller, pto->id);
+                } else if (stateStaller->nStallingSince == 0) {
+                    stateStaller->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
                 }
             }
@@ -66,6 +66,18 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 1000;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -persistmempool, save the mempool on shutdown and reload it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -79,8 +91,14 @@ static const int COINBASE_MATURITY_850k = 200;
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer whose throughput is not yet known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Lower and upper bounds of the adaptive per-peer in-flight limit, derived from measured RTT and block service time. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE = 64;
+/** A stalling peer whose average block service time is this many times slower than the peer waiting on it
+ *  has its critical-path block reassigned immediately instead of waiting for BLOCK_STALLING_TIMEOUT. */
+static const int BLOCK_STALLING_SLOWDOWN_FACTOR = 4;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -89,8 +107,11 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
- *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
+ *  harder). This is the window of a peer running at MAX_BLOCKS_IN_TRANSIT_PER_PEER; each peer's window
+ *  scales with its adaptive in-flight limit, bounded by MIN_BLOCK_DOWNLOAD_WINDOW and MAX_BLOCK_DOWNLOAD_WINDOW. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const unsigned int MIN_BLOCK_DOWNLOAD_WINDOW = 128;
+static const unsigned int MAX_BLOCK_DOWNLOAD_WINDOW = 4096;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -132,6 +153,8 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
+/** Signalled (under csBestBlock) when the getblocktemplate template changes */
+extern CConditionVariable cvBlockTemplate;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
@@ -184,6 +207,10 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Write the mempool (transactions, entry times and prioritisetransaction deltas) to mempool.dat */
+bool DumpMempool();
+/** Re-submit the transactions in mempool.dat through AcceptToMemoryPool */
+bool LoadMempool();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -194,11 +221,11 @@ void UnloadBlockIndex();
 bool ProcessMessages(CNode* pfrom);
 /**
  * Send queued protocol messages to be sent to a give node.
+ * Transaction and address relay is batched per peer and flushed on Poisson timers.
  *
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
-bool SendMessages(CNode* pto, bool fSendTrickle);
+bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -215,6 +242,11 @@ CAmount GetBlockValue(int nHeight, const CAmount& nFees);
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Abort with a message */
 bool AbortNode(const std::string &msg, const std::string &userMessage="");
+/** The in-flight block limit of a peer with the given round-trip and per-block service times (in microseconds) */
+int GetBlocksInFlightTarget(int64_t nDownloadRTT, int64_t nBlockServiceTime);
+/** How far beyond the last block in common a peer with that in-flight limit may fetch. Fast peers may run
+ *  further ahead, while slow peers stay near the tip where stalls are detected. */
+int GetBlockDownloadWindow(int nBlocksInFlightTarget);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
@@ -225,7 +257,26 @@ void FlushStateToDisk();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool fOverrideMempoolLimit=false);
+
+/**
+ * Try to add a batch of transactions to the memory pool under one lock and
+ * one coins view, as AcceptToMemoryPool would one by one. Transactions may
+ * spend outputs of earlier ones in the batch. The scripts of the whole
+ * batch are checked in parallel on the script check threads. vState and
+ * vAccepted get the result for each transaction; returns the number added.
+ * Transactions spending a rejected one of the batch are rejected with
+ * "bad-txns-parent-rejected". Those turned away only because an earlier one
+ * failed its scripts are tried again one at a time.
+ */
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx,
+                                     std::vector<CValidationState>& vState, std::vector<bool>& vAccepted,
+                                     bool fLimitFree, bool fRejectInsaneFee=false);
+
+/** As AcceptToMemoryPool, with the entry time given instead of the current time */
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee=false,
+                                bool fOverrideMempoolLimit=false);
 
 
 struct CNodeStateStats {
@@ -387,8 +438,13 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
  *  of problems. Note that in any case, coins may be modified. */
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
+/** Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ *  fCheckScripts false skips script verification; only for blocks whose
+ *  scripts are known to pass, like templates built from the mempool. */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false, bool fCheckScripts = true);
+
+/** Script verification flags enforced for a block of this version and time on top of pindexPrev */
+unsigned int GetBlockScriptFlags(int nVersion, int64_t nTime, const CBlockIndex* pindexPrev);
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
@@ -399,7 +455,7 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex *pindexPrev);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
-bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex *pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex *pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckScripts = true);
 
 /** Store block on disk. If dbp is provided, the file is known to already reside on disk */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, CDiskBlockPos* dbp = NULL);
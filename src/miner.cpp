@@ -20,8 +20,11 @@
 #include "wallet.h"
 #endif
 
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
+
+#include <algorithm>
+#include <limits>
 
 using namespace std;
 
@@ -30,315 +33,791 @@ using namespace std;
 // BitcoinMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Transactions are selected in two passes. The first fills up to
+// -blockprioritysize with the highest coin-age priority transactions whose
+// in-mempool parents are already in the block. The second takes whole
+// packages (a transaction plus its not yet included ancestors) by the fee
+// rate of the package, so a parent is picked up when a child pays enough
+// for both.
 //
-class COrphan
+
+// A mempool entry whose ancestor totals no longer count the ancestors that
+// are already in the block
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
+
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+    const CTransaction& GetTx() const { return iter->GetTx(); }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
+    {
+        return entry.iter;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareTxMemPoolEntryByAncestorFee
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    void operator() (CTxMemPoolModifiedEntry &e)
     {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
     }
+
+    CTxMemPool::txiter iter;
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+// Parents (fewer ancestors) before children
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+// We want to sort transactions by coin-age priority
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+struct TxCoinAgePriorityCompare
+{
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByAncestorFee()(*(b.second), *(a.second)); //Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+/** Fills a block template from the mempool; cs_main and mempool.cs must be held */
+class CBlockAssembler
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    CBlockIndex* pindexPrev;
+    CCoinsViewCache view;
+    const int nHeight;
+    unsigned int nScriptFlags;
+
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    bool fPrintPriority;
+
+    CTxMemPool::setEntries inBlock;
+    CTxMemPool::setEntries failedTx;
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+
+    CBlockAssembler(CBlockTemplate* pblocktemplateIn, CBlockIndex* pindexPrevIn, const CScript& scriptPubKeyIn) :
+        pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), pindexPrev(pindexPrevIn),
+        view(pcoinsTip), nHeight(pindexPrevIn->nHeight + 1),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
+    {
+        // -regtest only: allow overriding block.nVersion with
+        // -blockversion=N to test forking scenarios
+        if (Params().MineBlocksOnDemand())
+            pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+
+        // Script rules the block will be connected with
+        nScriptFlags = GetBlockScriptFlags(pblock->nVersion, GetAdjustedTime(), pindexPrev);
+
+        // Create coinbase tx; its value is filled in by UpdateCoinbase()
+        CMutableTransaction txNew;
+        txNew.vin.resize(1);
+        txNew.vin[0].prevout.SetNull();
+        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        txNew.vout.resize(1);
+        txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+        pblock->vtx.push_back(txNew);
+        pblocktemplate->vTxFees.push_back(-1); // updated at end
+        pblocktemplate->vTxSigOps.push_back(GetLegacySigOpCount(pblock->vtx[0]));
+
+        // Largest block you're willing to create:
+        nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+        // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+        nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+        // How much of the block should be dedicated to high-priority transactions,
+        // included regardless of the fees they pay
+        nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+        nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+        // Minimum block size you want to create; block will be filled with free transactions
+        // until there are no more or the block reaches this size:
+        nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+        nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+        fPrintPriority = GetBoolArg("-printpriority", false);
+    }
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    CBlockIndex* GetPrev() const { return pindexPrev; }
+
+    void AddPriorityTxs();
+    void AddPackageTxs();
+
+    /**
+     * Append transactions that entered the mempool after the block was
+     * assembled, as long as their inputs are confirmed or already in the
+     * block and they pay at least the relay fee. Returns how many were added.
+     * The fee ordering is only restored by assembling a new block.
+     */
+    unsigned int AddNewTxs(const std::vector<uint256>& vHashes);
+
+    /** Pay the fees collected so far to the coinbase */
+    void UpdateCoinbase();
+    /** Complete the coinbase and header and check the result */
+    void Finish();
+
+    /**
+     * Forget the mempool entries used while assembling. Must be called
+     * before cs_main/mempool.cs are released if the assembler is kept,
+     * as the entries may be gone by the next AddNewTxs().
+     */
+    void ReleaseMempoolEntries()
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        inBlock.clear();
+        failedTx.clear();
+    }
+
+private:
+    /** Check the transaction against the chain and append it to the block */
+    bool AppendTransaction(const CTxMemPoolEntry& entry, double dPriority);
+    bool AddToBlock(CTxMemPool::txiter iter, double dPriority)
+    {
+        if (!AppendTransaction(*iter, dPriority))
+            return false;
+        inBlock.insert(iter);
+        return true;
+    }
+    bool IsStillDependent(CTxMemPool::txiter iter) const;
+    bool TestPackage(const CTxMemPool::setEntries& package, uint64_t packageSize) const;
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx) const
+    {
+        return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
     }
 };
 
-void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
+bool CBlockAssembler::AppendTransaction(const CTxMemPoolEntry& entry, double dPriority)
 {
-    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+    const CTransaction& tx = entry.GetTx();
 
-    // Updating time can change work required on testnet:
-    if (Params().AllowMinDifficultyBlocks())
-        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+    if (!view.HaveInputs(tx))
+        return false;
+
+    CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    // Scripts already verified on mempool acceptance with a superset of
+    // the block's flags are not run again; the inputs still are.
+    CValidationState state;
+    bool fCheckScripts = (entry.GetValidatedScriptFlags() & nScriptFlags) != nScriptFlags;
+    if (!CheckInputs(tx, state, view, fCheckScripts, nScriptFlags, true))
+        return false;
+
+    CTxUndo txundo;
+    UpdateCoins(tx, state, view, txundo, nHeight);
+
+    // Added
+    pblock->vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(nTxFees);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += entry.GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+
+    if (fPrintPriority)
+    {
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            dPriority, CFeeRate(entry.GetModifiedFee(), entry.GetTxSize()).ToString(), tx.GetHash().ToString());
+    }
+
+    return true;
 }
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+bool CBlockAssembler::IsStillDependent(CTxMemPool::txiter iter) const
 {
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+    {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
 
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+bool CBlockAssembler::TestPackage(const CTxMemPool::setEntries& package, uint64_t packageSize) const
+{
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
 
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    // Legacy limits on sigOps, P2SH ones are checked as each tx is added
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH(const CTxMemPool::txiter it, package)
+    {
+        if (failedTx.count(it))
+            return false;
+        if (it->GetTx().IsCoinBase() || !IsFinalTx(it->GetTx(), nHeight))
+            return false;
+        nPackageSigOps += GetLegacySigOpCount(it->GetTx());
+    }
+    if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+    return true;
+}
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+void CBlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+        indexed_modified_transaction_set &mapModifiedTx)
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded)
+    {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants)
+        {
+            if (alreadyAdded.count(desc) || inBlock.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
 
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+void CBlockAssembler::AddPriorityTxs()
+{
+    if (nBlockPrioritySize == 0)
+        return;
 
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
 
+    while (!vecPriority.empty())
     {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
+        // Take highest priority transaction off the priority queue:
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        double dPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // Past the free transaction threshold the fee pass takes over
+        if (!AllowFree(dPriority))
+            break;
+
+        // Parents not in the block yet: retry once they are
+        if (IsStillDependent(iter))
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
-                continue;
+            waitPriMap.insert(std::make_pair(iter, dPriority));
+            continue;
+        }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        const CTransaction& tx = iter->GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
+            continue;
+        if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize)
+            continue;
+        if (nBlockSigOps + GetLegacySigOpCount(tx) >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        if (!AddToBlock(iter, dPriority))
+            continue;
+
+        if (nBlockSize >= nBlockPrioritySize)
+            break;
+
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
+        {
+            waitPriIter wpiter = waitPriMap.find(child);
+            if (wpiter != waitPriMap.end())
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                waitPriMap.erase(wpiter);
+            }
+        }
+    }
+}
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+void CBlockAssembler::AddPackageTxs()
+{
+    // Entries whose ancestors are partly in the block already, scored
+    // without those ancestors
+    indexed_modified_transaction_set mapModifiedTx;
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
 
-                int nConf = nHeight - coins->nHeight;
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
+    {
+        // Skip mapTx entries that are in the block, failed, or better
+        // represented by their modified entry
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx)) {
+            ++mi;
+            continue;
+        }
 
-                dPriority += (double)nValueIn * nConf;
+        // Pick the better of the next mapTx entry and the best modified entry
+        bool fUsingModified = false;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                ++mi;
             }
-            if (fMissingInputs) continue;
+        }
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+        assert(!inBlock.count(iter));
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        uint64_t packageSize = fUsingModified ? modit->nSizeWithAncestors : iter->GetSizeWithAncestors();
+        CAmount packageFees = fUsingModified ? modit->nModFeesWithAncestors : iter->GetModFeesWithAncestors();
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+        // Skip free transactions if we're past the minimum block size;
+        // everything left has a lower fee rate
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize + packageSize >= nBlockMinSize)
+            break;
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        for (CTxMemPool::setEntries::iterator ait = ancestors.begin(); ait != ancestors.end(); ) {
+            if (inBlock.count(*ait))
+                ancestors.erase(ait++);
+            else
+                ++ait;
+        }
+        ancestors.insert(iter);
+
+        if (!TestPackage(ancestors, packageSize)) {
+            if (fUsingModified) {
+                // Always looking at the best modified entry, so drop it to
+                // get at the next one
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
             }
+            continue;
+        }
+
+        // Parents before children
+        std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+
+        CTxMemPool::setEntries added;
+        BOOST_FOREACH(CTxMemPool::txiter entry, sortedEntries)
+        {
+            mapModifiedTx.erase(entry);
+            if (!failedTx.count(entry) && AddToBlock(entry, entry->GetPriority(nHeight)))
+                added.insert(entry);
             else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+                failedTx.insert(entry); // its descendants fail TestPackage
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        UpdatePackagesForAdded(added, mapModifiedTx);
+    }
+}
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+unsigned int CBlockAssembler::AddNewTxs(const std::vector<uint256>& vHashes)
+{
+    unsigned int nAdded = 0;
+    BOOST_FOREACH(const uint256& hash, vHashes)
+    {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end())
+            continue;
+
+        // Children of transactions left out of the block, and anything
+        // already in it, have inputs the view does not have (any more)
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight) || !view.HaveInputs(tx))
+            continue;
+        if (it->GetModifiedFee() < ::minRelayTxFee.GetFee(it->GetTxSize()))
+            continue;
+        if (nBlockSize + it->GetTxSize() >= nBlockMaxSize)
+            continue;
+        if (nBlockSigOps + GetLegacySigOpCount(tx) >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        if (AppendTransaction(*it, it->GetPriority(nHeight)))
+            nAdded++;
+    }
+    if (nAdded > 0)
+        UpdateCoinbase();
+    return nAdded;
+}
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+void CBlockAssembler::UpdateCoinbase()
+{
+    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    txCoinbase.vout[0].nValue = GetBlockValue(nHeight, nFees);
+    pblock->vtx[0] = txCoinbase;
+    pblocktemplate->vTxFees[0] = -nFees;
+}
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+void CBlockAssembler::Finish()
+{
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+    UpdateCoinbase();
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    UpdateTime(pblock, pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock);
+    pblock->nNonce         = 0;
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+    CValidationState state;
+    // Every script was checked by AppendTransaction (or on mempool
+    // acceptance), so only the block-level rules are left to verify.
+    if (!TestBlockValidity(state, *pblock, pindexPrev, false, false, false))
+        throw std::runtime_error("CreateNewBlock() : TestBlockValidity failed");
+}
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
+{
+    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
 
-            if (!view.HaveInputs(tx))
-                continue;
+    // Updating time can change work required on testnet:
+    if (Params().AllowMinDifficultyBlocks())
+        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+}
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    // Create new block
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if(!pblocktemplate.get())
+        return NULL;
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+    {
+        LOCK2(cs_main, mempool.cs);
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
+        // Collect memory pool transactions into the block
+        CBlockAssembler assembler(pblocktemplate.get(), chainActive.Tip(), scriptPubKeyIn);
+        assembler.AddPriorityTxs();
+        assembler.AddPackageTxs();
+        assembler.Finish();
+    }
 
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
+    return pblocktemplate.release();
+}
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+//
+// Block template maintainer
+//
+// getblocktemplate is polled constantly by pool servers. Rather than
+// assembling a block per call, a background thread keeps one template:
+// it is rebuilt when the tip changes (and every TEMPLATE_REBUILD_INTERVAL
+// while the mempool changes, to restore the fee ordering), and transactions
+// accepted in between are appended to it as they arrive. Callers share
+// immutable snapshots of it.
+//
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
+/** Seconds between full rebuilds while new transactions keep arriving */
+static const int64_t TEMPLATE_REBUILD_INTERVAL = 30;
+/** Stop maintaining the template when getblocktemplate has not been called for this long */
+static const int64_t TEMPLATE_IDLE_TIMEOUT = 10 * 60;
+
+class CBlockTemplateMaintainer : public CValidationInterface
+{
+private:
+    // Guarded by cs_pending, which may be taken with cs_main held
+    CCriticalSection cs_pending;
+    std::vector<uint256> vPending;
+    bool fCollecting;
+
+    // Guarded by cs_main
+    auto_ptr<CBlockTemplate> pblocktemplate;
+    auto_ptr<CBlockAssembler> passembler;
+    int64_t nLastRebuild;
+    unsigned int nTransactionsUpdatedRebuild;
+
+    // Guarded by cs_snapshot
+    CCriticalSection cs_snapshot;
+    boost::shared_ptr<const CBlockTemplate> psnapshot;
+    int64_t nLastRequest;
+
+    // Guarded by csBestBlock, so longpoll waiters cannot miss a change
+    unsigned int nSequence;
+
+    void Publish()
+    {
+        boost::shared_ptr<const CBlockTemplate> pnew(new CBlockTemplate(*pblocktemplate));
+        {
+            LOCK(cs_snapshot);
+            psnapshot = pnew;
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            nSequence++;
+        }
+        // Not cvBlockChange: the miner threads only care about new tips
+        cvBlockTemplate.notify_all();
+    }
+
+    /** Append the transactions that arrived since the last pass; cs_main must be held */
+    void AppendPending()
+    {
+        AssertLockHeld(cs_main);
+        std::vector<uint256> vHashes;
+        {
+            LOCK(cs_pending);
+            vHashes.swap(vPending);
+        }
+        if (vHashes.empty())
+            return;
+
+        LOCK(mempool.cs);
+        if (passembler->AddNewTxs(vHashes) > 0)
+            Publish();
+    }
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+    {
+        // Only transactions entering the mempool
+        if (pblock != NULL)
+            return;
+        LOCK(cs_pending);
+        if (fCollecting)
+            vPending.push_back(tx.GetHash());
+    }
+
+public:
+    CBlockTemplateMaintainer() : fCollecting(false), nLastRebuild(0), nTransactionsUpdatedRebuild(0), nLastRequest(0), nSequence(0) {}
+
+    /** Assemble a new template on the current tip; cs_main must be held */
+    void Rebuild()
+    {
+        AssertLockHeld(cs_main);
+        LOCK(mempool.cs);
+
+        // Taken now, so nothing accepted while assembling is lost; appending
+        // something already in the block is a no-op
+        {
+            LOCK(cs_pending);
+            vPending.clear();
+            fCollecting = true;
+        }
+        passembler.reset();
+        pblocktemplate.reset(new CBlockTemplate());
+        nTransactionsUpdatedRebuild = mempool.GetTransactionsUpdated();
+        nLastRebuild = GetTime();
+
+        CScript scriptDummy = CScript() << OP_TRUE;
+        auto_ptr<CBlockAssembler> pnew(new CBlockAssembler(pblocktemplate.get(), chainActive.Tip(), scriptDummy));
+        pnew->AddPriorityTxs();
+        pnew->AddPackageTxs();
+        pnew->Finish();
+        pnew->ReleaseMempoolEntries();
+        passembler = pnew;
+        Publish();
+    }
+
+    /** One maintenance pass: rebuild if stale, else append what arrived */
+    void Update()
+    {
+        {
+            LOCK(cs_snapshot);
+            if (GetTime() - nLastRequest > TEMPLATE_IDLE_TIMEOUT) {
+                LOCK(cs_pending);
+                vPending.clear();
+                fCollecting = false;
+                return;
             }
+        }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            return;
+
+        if (passembler.get() == NULL || passembler->GetPrev() != chainActive.Tip() ||
+            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedRebuild &&
+             GetTime() - nLastRebuild >= TEMPLATE_REBUILD_INTERVAL)) {
+            Rebuild();
+            return;
+        }
+
+        AppendPending();
+    }
+
+    /** Current template, assembled first if missing or stale; cs_main must be held */
+    boost::shared_ptr<const CBlockTemplate> Get(unsigned int& nSequenceOut)
+    {
+        AssertLockHeld(cs_main);
+        {
+            LOCK(cs_snapshot);
+            nLastRequest = GetTime();
+        }
+        bool fWasCollecting;
+        {
+            LOCK(cs_pending);
+            fWasCollecting = fCollecting;
+        }
+        if (passembler.get() == NULL || passembler->GetPrev() != chainActive.Tip()) {
+            Rebuild();
+        } else if (!fWasCollecting) {
+            // Idle: transactions were not queued, so only a rebuild catches up
+            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedRebuild) {
+                Rebuild();
+            } else {
+                LOCK(cs_pending);
+                fCollecting = true;
             }
+        } else {
+            // Additions since the rebuild are all queued; removals without a
+            // new tip do not invalidate the template
+            AppendPending();
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+        boost::shared_ptr<const CBlockTemplate> pcurrent;
+        {
+            LOCK(cs_snapshot);
+            pcurrent = psnapshot;
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            nSequenceOut = nSequence;
+        }
+        return pcurrent;
+    }
 
-        // Compute final coinbase transaction.
-        txNew.vout[0].nValue = GetBlockValue(nHeight, nFees);
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
+    /** Only with csBestBlock held */
+    unsigned int GetSequence() const { return nSequence; }
+};
+
+static CBlockTemplateMaintainer templateMaintainer;
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        UpdateTime(pblock, pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock);
-        pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+void static ThreadBlockTemplate()
+{
+    RenameThread("bata-tmpl");
+    LogPrintf("Block template maintainer started\n");
 
-        CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
-            throw std::runtime_error("CreateNewBlock() : TestBlockValidity failed");
+    try {
+        while (true) {
+            {
+                // Woken at once by a new tip, otherwise appends twice a second
+                boost::unique_lock<boost::mutex> lock(csBestBlock);
+                cvBlockChange.timed_wait(lock, boost::posix_time::milliseconds(500));
+            }
+            boost::this_thread::interruption_point();
+            try {
+                templateMaintainer.Update();
+            } catch (const std::runtime_error &e) {
+                // Retried on the next pass; getblocktemplate reports it
+                LogPrintf("Block template maintainer runtime error: %s\n", e.what());
+            }
+        }
     }
+    catch (boost::thread_interrupted)
+    {
+        LogPrintf("Block template maintainer terminated\n");
+        throw;
+    }
+}
 
-    return pblocktemplate.release();
+void StartBlockTemplateMaintainer(boost::thread_group& threadGroup)
+{
+    RegisterValidationInterface(&templateMaintainer);
+    threadGroup.create_thread(&ThreadBlockTemplate);
+}
+
+void StopBlockTemplateMaintainer()
+{
+    UnregisterValidationInterface(&templateMaintainer);
+}
+
+boost::shared_ptr<const CBlockTemplate> GetBlockTemplate(unsigned int& nSequence)
+{
+    return templateMaintainer.Get(nSequence);
+}
+
+unsigned int GetBlockTemplateSequence()
+{
+    return templateMaintainer.GetSequence();
 }
 
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
@@ -360,6 +839,43 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
+// Guarded by csMinerWork; cvMinerWork is notified when the work changes
+static boost::mutex csMinerWork;
+static boost::condition_variable cvMinerWork;
+static boost::shared_ptr<const CMinerWork> pMinerWork;
+static unsigned int nMinerExtraNonce = 0;
+
+void SetMinerWork(boost::shared_ptr<const CMinerWork> pwork)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csMinerWork);
+        pMinerWork = pwork;
+    }
+    cvMinerWork.notify_all();
+}
+
+boost::shared_ptr<const CMinerWork> TakeMinerWork(unsigned int& nExtraNonce)
+{
+    boost::unique_lock<boost::mutex> lock(csMinerWork);
+    while (!pMinerWork)
+        cvMinerWork.wait(lock);
+    nExtraNonce = ++nMinerExtraNonce;
+    return pMinerWork;
+}
+
+CBlockHeader GetMinerWorkHeader(const CMinerWork& work, unsigned int nExtraNonce, CMutableTransaction& txCoinbase)
+{
+    const CBlock& blockTemplate = work.ptemplate->block;
+    txCoinbase = CMutableTransaction(blockTemplate.vtx[0]);
+    txCoinbase.vin[0].scriptSig = (CScript() << (work.pindexPrev->nHeight + 1) << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    CBlockHeader header = blockTemplate.GetBlockHeader();
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(CTransaction(txCoinbase).GetHash(), work.vMerkleBranch, 0);
+    header.nNonce = 0;
+    return header;
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -407,84 +923,152 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static BitcoinMiner(CWallet *pwallet)
+/**
+ * Builds the template the miner threads share: once per tip, or when the
+ * mempool changed and the current one is a minute old. Woken by
+ * cvBlockChange, so the threads switch to a new tip at once.
+ */
+void static BitcoinMinerWork(CWallet *pwallet)
 {
-    LogPrintf("BataMiner started\n");
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    RenameThread("bata-miner");
-
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    RenameThread("bata-minerwork");
 
     try {
+        unsigned int nTransactionsUpdatedLast = 0;
+        int64_t nStart = 0;
+        CBlockIndex* pindexPrev = NULL;
         while (true) {
             if (Params().MiningRequiresPeers()) {
                 // Busy-wait for the network to come online so we don't waste time mining
                 // on an obsolete chain. In regtest mode we expect to fly solo.
-                do {
-                    bool fvNodesEmpty;
-                    {
-                        LOCK(cs_vNodes);
-                        fvNodesEmpty = vNodes.empty();
-                    }
-                    if (!fvNodesEmpty && !IsInitialBlockDownload())
-                        break;
+                bool fvNodesEmpty;
+                {
+                    LOCK(cs_vNodes);
+                    fvNodesEmpty = vNodes.empty();
+                }
+                if (fvNodesEmpty || IsInitialBlockDownload()) {
+                    SetMinerWork(boost::shared_ptr<const CMinerWork>());
+                    pindexPrev = NULL;
                     MilliSleep(1000);
-                } while (true);
+                    continue;
+                }
             }
 
-            //
-            // Create new block
-            //
-            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrev = chainActive.Tip();
-
-            auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-            if (!pblocktemplate.get())
+            bool fRebuild;
             {
-                LogPrintf("Error in BataMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
-                return;
+                LOCK(cs_main);
+                fRebuild = pindexPrev != chainActive.Tip() ||
+                    (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60);
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+            if (fRebuild) {
+                boost::shared_ptr<CMinerWork> pwork(new CMinerWork());
+                nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+                // A fresh key per template; it goes back to the pool unless a block is found
+                pwork->preservekey.reset(new CReserveKey(pwallet));
+                pwork->ptemplate.reset(CreateNewBlockWithKey(*pwork->preservekey));
+                if (!pwork->ptemplate) {
+                    LogPrintf("Error in BataMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
+                    SetMinerWork(boost::shared_ptr<const CMinerWork>());
+                    return;
+                }
+                CBlock *pblock = &pwork->ptemplate->block;
+                {
+                    LOCK(cs_main);
+                    pwork->pindexPrev = mapBlockIndex[pblock->hashPrevBlock];
+                }
+                pindexPrev = pwork->pindexPrev;
+                pblock->BuildMerkleTree();
+                pwork->vMerkleBranch = pblock->GetMerkleBranch(0);
+                nStart = GetTime();
+
+                LogPrintf("Running BataMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
+                    ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+                SetMinerWork(pwork);
+            }
+
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        SetMinerWork(boost::shared_ptr<const CMinerWork>());
+        throw;
+    }
+    catch (const std::runtime_error &e)
+    {
+        LogPrintf("BataMiner runtime error: %s\n", e.what());
+        SetMinerWork(boost::shared_ptr<const CMinerWork>());
+        return;
+    }
+}
+
+void static BitcoinMiner(CWallet *pwallet)
+{
+    LogPrintf("BataMiner started\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("bata-miner");
+
+    try {
+        while (true) {
+            //
+            // Take the shared work with an extranonce of our own, so no two
+            // threads scan the same nonces
+            //
+            unsigned int nExtraNonce;
+            boost::shared_ptr<const CMinerWork> pwork = TakeMinerWork(nExtraNonce);
+            const CBlock& blockTemplate = pwork->ptemplate->block;
+            CBlockIndex* pindexPrev = pwork->pindexPrev;
 
-            LogPrintf("Running BataMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+            CMutableTransaction txCoinbase;
+            CBlockHeader header = GetMinerWorkHeader(*pwork, nExtraNonce, txCoinbase);
 
             //
             // Search
             //
-            int64_t nStart = GetTime();
-            uint256 hashTarget = uint256().SetCompact(pblock->nBits);
+            uint256 hashTarget = uint256().SetCompact(header.nBits);
             uint256 thash;
             while (true) {
                 unsigned int nHashesDone = 0;
                 char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+                bool fFound = false;
                 while(true)
                 {
-                    scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
+                    scrypt_1024_1_1_256_sp(BEGIN(header.nVersion), BEGIN(thash), scratchpad);
                     if (thash <= hashTarget)
                     {
-                        // Found a solution
-                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                        LogPrintf("BataMiner:\n");
-                        LogPrintf("proof-of-work found  \n  powhash: %s  \ntarget: %s\n", thash.GetHex(), hashTarget.GetHex());
-                        ProcessBlockFound(pblock, *pwallet, reservekey);
-                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
-
-                        // In regression test mode, stop mining after a block is found.
-                        if (Params().MineBlocksOnDemand())
-                            throw boost::thread_interrupted();
-
+                        fFound = true;
                         break;
                     }
-                    pblock->nNonce += 1;
+                    header.nNonce += 1;
                     nHashesDone += 1;
-                    if ((pblock->nNonce & 0xFF) == 0)
+                    if ((header.nNonce & 0xFF) == 0)
                         break;
                 }
 
+                if (fFound)
+                {
+                    // Found a solution
+                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                    LogPrintf("BataMiner:\n");
+                    LogPrintf("proof-of-work found  \n  powhash: %s  \ntarget: %s\n", thash.GetHex(), hashTarget.GetHex());
+                    CBlock block(header);
+                    block.vtx = blockTemplate.vtx;
+                    block.vtx[0] = txCoinbase;
+                    {
+                        // Threads share the reserved key
+                        static CCriticalSection csFound;
+                        LOCK(csFound);
+                        ProcessBlockFound(&block, *pwallet, *pwork->preservekey);
+                    }
+                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+                    // In regression test mode, stop mining after a block is found.
+                    if (Params().MineBlocksOnDemand())
+                        throw boost::thread_interrupted();
+
+                    break;
+                }
+
                 // Meter hashes/sec
                 static int64_t nHashCounter;
                 if (nHPSTimerStart == 0)
@@ -514,24 +1098,22 @@ void static BitcoinMiner(CWallet *pwallet)
                     }
                 }
 
-                // Check for stop or if block needs to be rebuilt
+                // Check for stop or if the work changed
                 boost::this_thread::interruption_point();
-                // Regtest mode doesn't require peers
-                if (vNodes.empty() && Params().MiningRequiresPeers())
-                    break;
-                if (pblock->nNonce >= 0xffff0000)
-                    break;
-                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                    break;
-                if (pindexPrev != chainActive.Tip())
+                if (header.nNonce >= 0xffff0000)
                     break;
+                {
+                    boost::unique_lock<boost::mutex> lock(csMinerWork);
+                    if (pMinerWork != pwork)
+                        break;
+                }
 
                 // Update nTime every few seconds
-                UpdateTime(pblock, pindexPrev);
+                UpdateTime(&header, pindexPrev);
                 if (Params().AllowMinDifficultyBlocks())
                 {
-                    // Changing pblock->nTime can change work required on testnet:
-                    hashTarget.SetCompact(pblock->nBits);
+                    // Changing header.nTime can change work required on testnet:
+                    hashTarget.SetCompact(header.nBits);
                 }
             }
         }
@@ -565,12 +1147,14 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
         minerThreads->interrupt_all();
         delete minerThreads;
         minerThreads = NULL;
+        SetMinerWork(boost::shared_ptr<const CMinerWork>());
     }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(boost::bind(&BitcoinMinerWork, pwallet));
     for (int i = 0; i < nThreads; i++)
         minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
 }
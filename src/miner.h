@@ -6,7 +6,12 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "uint256.h"
+
 #include <stdint.h>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
 
 class CBlock;
 class CBlockHeader;
@@ -16,14 +21,47 @@ class CScript;
 class CWallet;
 
 struct CBlockTemplate;
+struct CMutableTransaction;
+
+namespace boost {
+    class thread_group;
+} // namespace boost
 
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
+/** Keep the getblocktemplate template up to date in the background */
+void StartBlockTemplateMaintainer(boost::thread_group& threadGroup);
+/** Stop feeding accepted transactions to the template; its thread must be interrupted separately */
+void StopBlockTemplateMaintainer();
+/**
+ * Shared template for getblocktemplate (coinbase paying to OP_TRUE),
+ * assembled first if it does not build on the tip and including the
+ * transactions accepted so far. nSequence identifies
+ * it for longpolling. cs_main must be held.
+ */
+boost::shared_ptr<const CBlockTemplate> GetBlockTemplate(unsigned int& nSequence);
+/** Sequence of the latest template, bumped whenever it changes; csBestBlock must be held */
+unsigned int GetBlockTemplateSequence();
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Work shared by the miner threads; only the coinbase extranonce differs between them */
+struct CMinerWork
+{
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    boost::shared_ptr<CReserveKey> preservekey;
+    std::vector<uint256> vMerkleBranch;
+    CBlockIndex* pindexPrev;
+};
+
+/** Replace the work of the miner threads; a null pointer makes them wait */
+void SetMinerWork(boost::shared_ptr<const CMinerWork> pwork);
+/** Wait for miner work and take it with an extranonce no other thread was given */
+boost::shared_ptr<const CMinerWork> TakeMinerWork(unsigned int& nExtraNonce);
+/** Header to scan for the work with this extranonce, and the coinbase it commits to */
+CBlockHeader GetMinerWorkHeader(const CMinerWork& work, unsigned int nExtraNonce, CMutableTransaction& txCoinbase);
 /** Check mined block */
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 void UpdateTime(CBlockHeader* block, const CBlockIndex* pindexPrev);
@@ -16,9 +16,12 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "ui_interface.h"
 
+#include <cmath>
+
 #ifdef WIN32
 #include <string.h>
 #else
@@ -90,7 +93,7 @@ CCriticalSection cs_vNodes;
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -110,6 +113,11 @@ static list<CNode*> vNodesDisconnected;
 // **** Signals for message handling ****
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
+
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
 // **************************************
 
 void AddOneShot(string strDest)
@@ -353,6 +361,12 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+int64_t CNode::nOutboundTokens = 0;
+int64_t CNode::nOutboundTokensTime = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
@@ -1672,11 +1686,6 @@ void ThreadMessageHandler()
             }
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
@@ -1694,7 +1703,7 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if ((!pnode->vRecvGetData.empty() && !pnode->fGetDataPaced) || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
                             fSleep = false;
                         }
@@ -1707,7 +1716,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(pnode);
             }
             boost::this_thread::interruption_point();
         }
@@ -2027,6 +2036,127 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    UpdateOutboundCycle(GetTime());
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+    if (nMaxOutboundLimit > 0)
+        nOutboundTokens -= bytes;
+}
+
+// requires LOCK(cs_totalBytesSent)
+void CNode::UpdateOutboundCycle(uint64_t nNow)
+{
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < nNow)
+    {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+}
+
+// requires LOCK(cs_totalBytesSent)
+void CNode::RefillOutboundTokens()
+{
+    int64_t nNow = GetTimeMicros();
+    int64_t nElapsed = nNow - nOutboundTokensTime;
+    nOutboundTokensTime = nNow;
+    if (nElapsed <= 0)
+        return;
+
+    // Spread whatever is left of the budget evenly over the rest of the cycle, so a quiet
+    // morning leaves room for a busy evening but the cycle never overshoots the target.
+    UpdateOutboundCycle(nNow / 1000000);
+    uint64_t nBytesLeft = nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+    uint64_t nTimeLeft = std::max<uint64_t>(1, nMaxOutboundCycleStartTime + nMaxOutboundTimeframe - nNow / 1000000);
+    int64_t nRate = nBytesLeft / nTimeLeft;
+
+    int64_t nCapacity = std::max<int64_t>(nRate * UPLOAD_BUCKET_SECONDS, MAX_PROTOCOL_MESSAGE_LENGTH);
+    nCapacity = std::min<int64_t>(nCapacity, nBytesLeft);
+    nOutboundTokens = std::min(nCapacity, nOutboundTokens + nRate * nElapsed / 1000000);
+}
+
+bool CNode::HaveOutboundTokens()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return true;
+
+    RefillOutboundTokens();
+    return nOutboundTokens > 0;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+    nOutboundTokens = std::min<int64_t>(limit, MAX_PROTOCOL_MESSAGE_LENGTH);
+    nOutboundTokensTime = GetTimeMicros();
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+void CNode::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe)
+    {
+        // reset measure-cycle in case of changing
+        // the timeframe
+        nMaxOutboundCycleStartTime = GetTime();
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    UpdateOutboundCycle(GetTime());
+    if (historicalBlockServingLimit)
+    {
+        // keep a buffer large enough to relay one full-size block per
+        // expected block for the rest of the cycle
+        uint64_t nTimeLeft = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe - GetTime();
+        uint64_t nBuffer = nTimeLeft / Params().TargetSpacing() * MAX_BLOCK_SIZE;
+        if (nBuffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - nBuffer)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    UpdateOutboundCycle(GetTime());
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    UpdateOutboundCycle(GetTime());
+    return nMaxOutboundCycleStartTime + nMaxOutboundTimeframe - GetTime();
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -2179,7 +2309,10 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) :
+    ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+    addrKnown(ADDR_KNOWN_FILTER_SIZE, 0.001),
+    filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2194,6 +2327,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nVersion = 0;
     strSubVer = "";
     fWhitelisted = false;
+    fGetDataPaced = false;
     fOneShot = false;
     fClient = false; // set by version message
     fInbound = fInboundIn;
@@ -2209,7 +2343,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nSyncHeight = 0;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
+    nNextInvSend = 0;
+    nNextAddrSend = 0;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2218,6 +2353,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nTrafficAverage = 0;
     nTrafficRatio = 0;
     nTrafficTimestamp = 0;
+    nFirewallCheckTime = 0;
+    nFirewallCalls = 0;
     {
         LOCK(cs_nLastNodeId);
         id = nLastNodeId++;
@@ -2252,7 +2389,7 @@ void CNode::AskFor(const CInv& inv)
     // We're using mapAskFor as a priority queue,
     // the key is the earliest time the request can be sent
     int64_t nRequestTime;
-    limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
+    limitedmap<uint256, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv.hash);
     if (it != mapAlreadyAskedFor.end())
         nRequestTime = it->second;
     else
@@ -2271,7 +2408,7 @@ void CNode::AskFor(const CInv& inv)
     if (it != mapAlreadyAskedFor.end())
         mapAlreadyAskedFor.update(it, nRequestTime);
     else
-        mapAlreadyAskedFor.insert(std::make_pair(inv, nRequestTime));
+        mapAlreadyAskedFor.insert(std::make_pair(inv.hash, nRequestTime));
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
@@ -10,7 +10,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -112,6 +111,12 @@ extern double FIREWALL_FLOODINGWALLET_MAXTRAFFICAVERAGE;
 extern int FIREWALL_FLOODINGWALLET_MINCHECK;
 extern int FIREWALL_FLOODINGWALLET_MAXCHECK;
 
+/** Guards the FIREWALL_* settings above against the message handler thread */
+extern CCriticalSection cs_firewall;
+
+/** Must be called after changing any of the FIREWALL_* lists or limits above */
+void FirewallSettingsChanged();
+
 /** Time between pings automatically sent out for latency probing and keepalive (in seconds). */
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
@@ -138,6 +143,23 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Average delay between flushes of a peer's transaction relay queue (in seconds).
+ *  Outbound peers use half of it; blocks and whitelisted peers are not delayed. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Average delay between address relay flushes to a peer (in seconds). */
+static const unsigned int AVG_ADDRESS_BROADCAST_INTERVAL = 30;
+/** Number of recently announced or received inventory items remembered per peer (~54 KB at 1e-6 fp rate). */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 5000;
+/** Number of recently announced or received addresses remembered per peer (~27 KB at 0.1% fp rate). */
+static const unsigned int ADDR_KNOWN_FILTER_SIZE = 5000;
+/** The timeframe over which -maxuploadtarget is enforced (in seconds). */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** -maxuploadtarget default (in MiB per MAX_UPLOAD_TIMEFRAME), 0 = no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** Blocks this much older (in seconds) than the best header are historical; serving them stops first when the upload target is near. */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Seconds of paced upload the token bucket may save up, so historical blocks can be served in bursts. */
+static const int64_t UPLOAD_BUCKET_SECONDS = 60;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -164,7 +186,7 @@ struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
-    boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<bool (CNode*)> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
 };
@@ -172,6 +194,9 @@ struct CNodeSignals
 
 CNodeSignals& GetNodeSignals();
 
+/** Return a time in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 
 enum
 {
@@ -212,7 +237,7 @@ extern CCriticalSection cs_vNodes;
 extern std::map<CInv, CDataStream> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
+extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -315,6 +340,8 @@ public:
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    // vRecvGetData is waiting for upload tokens to serve a historical block
+    bool fGetDataPaced;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
@@ -327,6 +354,9 @@ public:
     double nTrafficAverage;
     double nTrafficRatio;
     int nTrafficTimestamp;
+    int64_t nFirewallCheckTime;
+    // FireWall() calls since the last examination
+    int nFirewallCalls;
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -374,16 +404,23 @@ public:
     int nStartingHeight;
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
+    // Set of transaction ids we still have to announce, flushed as one
+    // batch when nNextInvSend passes. Kept by hash, which hides the order in
+    // which we learned about them, and announced parents first.
+    std::set<uint256> setInventoryTxToSend;
+    // Non-transaction inventory (blocks) to announce without delay.
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
+    int64_t nNextInvSend;
+    int64_t nNextAddrSend;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
@@ -405,6 +442,17 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Outbound limit & pacing, protected by cs_totalBytesSent
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static int64_t nOutboundTokens;
+    static int64_t nOutboundTokensTime;
+
+    static void UpdateOutboundCycle(uint64_t nNow);
+    static void RefillOutboundTokens();
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -455,7 +503,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -463,7 +511,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -477,7 +525,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -485,7 +533,11 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (filterInventoryKnown.contains(inv.hash))
+                return;
+            if (inv.type == MSG_TX)
+                setInventoryTxToSend.insert(inv.hash);
+            else
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -699,6 +751,31 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //!set the max outbound target in bytes per timeframe, 0 disables the limit
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //!set the timeframe for the max outbound target
+    static void SetMaxOutboundTimeframe(uint64_t timeframe);
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //!check if the outbound target is reached
+    // if param historicalBlockServingLimit is set true, the function will
+    // return true if the remaining budget is only enough for tip and tx relay
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //!response the bytes left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //!response the time in seconds left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
+
+    //!whether the pacing token bucket allows serving another historical block right now;
+    // all outbound bytes are taken from it, but only historical blocks wait for it to refill
+    static bool HaveOutboundTokens();
 };
 
 
@@ -0,0 +1,438 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "policy/fees.h"
+
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+using namespace std;
+
+void TxConfirmStats::Initialize(const std::vector<double>& defaultBuckets,
+                                unsigned int maxConfirms, double _decay, const std::string& _dataTypeString)
+{
+    decay = _decay;
+    dataTypeString = _dataTypeString;
+    buckets.clear();
+    bucketMap.clear();
+    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
+        buckets.push_back(defaultBuckets[i]);
+        bucketMap[defaultBuckets[i]] = i;
+    }
+    confAvg.assign(maxConfirms, std::vector<double>(buckets.size()));
+    curBlockConf.assign(maxConfirms, std::vector<int>(buckets.size()));
+    unconfTxs.assign(maxConfirms, std::vector<int>(buckets.size()));
+    oldUnconfTxs.assign(buckets.size(), 0);
+    curBlockTxCt.assign(buckets.size(), 0);
+    txCtAvg.assign(buckets.size(), 0);
+    curBlockVal.assign(buckets.size(), 0);
+    avg.assign(buckets.size(), 0);
+}
+
+void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
+{
+    // Whatever entered MAX_BLOCK_CONFIRMS blocks ago and is still waiting is now old
+    std::vector<int>& unconfAged = unconfTxs[nBlockHeight % unconfTxs.size()];
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        oldUnconfTxs[j] += unconfAged[j];
+        unconfAged[j] = 0;
+        for (unsigned int i = 0; i < curBlockConf.size(); i++)
+            curBlockConf[i][j] = 0;
+        curBlockTxCt[j] = 0;
+        curBlockVal[j] = 0;
+    }
+}
+
+void TxConfirmStats::Record(int blocksToConfirm, double val)
+{
+    // blocksToConfirm is 1-based
+    if (blocksToConfirm < 1)
+        return;
+    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++)
+        curBlockConf[i - 1][bucketindex]++;
+    curBlockTxCt[bucketindex]++;
+    curBlockVal[bucketindex] += val;
+}
+
+void TxConfirmStats::UpdateMovingAverages()
+{
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        for (unsigned int i = 0; i < confAvg.size(); i++)
+            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+        avg[j] = avg[j] * decay + curBlockVal[j];
+        txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+    }
+}
+
+double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
+                                         double minSuccess, unsigned int nBlockHeight) const
+{
+    // Counters for the current range of buckets
+    double nConf = 0; // Number of tx's confirmed within the confTarget
+    double totalNum = 0; // Total number of tx's that were ever confirmed
+    int extraNum = 0;  // Number of tx's still in mempool for confTarget or longer
+
+    int maxbucketindex = buckets.size() - 1;
+    unsigned int bins = unconfTxs.size();
+
+    // We look for the lowest value such that all higher values pass, so
+    // start with the highest bucket and combine buckets until there are
+    // enough data points to test. The best range is the last one that
+    // still had a high enough confirmation rate.
+    unsigned int curNearBucket = maxbucketindex;
+    unsigned int bestNearBucket = maxbucketindex;
+    unsigned int curFarBucket = maxbucketindex;
+    unsigned int bestFarBucket = maxbucketindex;
+    bool foundAnswer = false;
+
+    for (int bucket = maxbucketindex; bucket >= 0; bucket--) {
+        curFarBucket = bucket;
+        nConf += confAvg[confTarget - 1][bucket];
+        totalNum += txCtAvg[bucket];
+        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
+            extraNum += unconfTxs[(nBlockHeight - confct) % bins][bucket];
+        extraNum += oldUnconfTxs[bucket];
+
+        // Only the confirmed data points decide whether there is enough data,
+        // so every target looks at the same bucket ranges
+        if (totalNum >= sufficientTxVal / (1 - decay)) {
+            double curPct = nConf / (totalNum + extraNum);
+            if (curPct < minSuccess)
+                break;
+
+            foundAnswer = true;
+            nConf = 0;
+            totalNum = 0;
+            extraNum = 0;
+            bestNearBucket = curNearBucket;
+            bestFarBucket = curFarBucket;
+            curNearBucket = bucket - 1;
+        }
+    }
+
+    // We can't keep every transaction, so report the average value of the
+    // bucket holding the median transaction of the best range
+    double median = -1;
+    double txSum = 0;
+    unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
+    unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
+    for (unsigned int j = minBucket; j <= maxBucket; j++)
+        txSum += txCtAvg[j];
+    if (foundAnswer && txSum != 0) {
+        txSum = txSum / 2;
+        for (unsigned int j = minBucket; j <= maxBucket; j++) {
+            if (txCtAvg[j] < txSum) {
+                txSum -= txCtAvg[j];
+            } else {
+                median = avg[j] / txCtAvg[j];
+                break;
+            }
+        }
+    }
+
+    LogPrint("estimatefee", "%3d: For conf success > %4.2f need %s >: %12.5g from buckets %8g - %8g\n",
+             confTarget, minSuccess, dataTypeString, median, buckets[minBucket], buckets[maxBucket]);
+    return median;
+}
+
+unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
+{
+    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    unconfTxs[nBlockHeight % unconfTxs.size()][bucketindex]++;
+    return bucketindex;
+}
+
+void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight, unsigned int bucketindex)
+{
+    int blocksAgo = nBestSeenHeight - entryHeight;
+    if (nBestSeenHeight == 0)  // no blocks seen yet
+        blocksAgo = 0;
+    if (blocksAgo < 0) {
+        LogPrint("estimatefee", "Blockpolicy error, blocks ago is negative for mempool tx\n");
+        return;  // This can't happen because we call this with our best seen height, no entries can have higher
+    }
+
+    if (blocksAgo >= (int)unconfTxs.size()) {
+        if (oldUnconfTxs[bucketindex] > 0)
+            oldUnconfTxs[bucketindex]--;
+        else
+            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from >25 blocks, bucketIndex=%u already\n",
+                     bucketindex);
+    } else {
+        unsigned int blockIndex = entryHeight % unconfTxs.size();
+        if (unconfTxs[blockIndex][bucketindex] > 0)
+            unconfTxs[blockIndex][bucketindex]--;
+        else
+            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
+                     blockIndex, bucketindex);
+    }
+}
+
+void TxConfirmStats::Write(CAutoFile& fileout) const
+{
+    fileout << decay;
+    fileout << buckets;
+    fileout << avg;
+    fileout << txCtAvg;
+    fileout << confAvg;
+}
+
+void TxConfirmStats::Read(CAutoFile& filein)
+{
+    // Read data file into temporary variables and do some very basic sanity checking
+    std::vector<double> fileBuckets;
+    std::vector<double> fileAvg;
+    std::vector<std::vector<double> > fileConfAvg;
+    std::vector<double> fileTxCtAvg;
+    double fileDecay;
+    size_t maxConfirms;
+    size_t numBuckets;
+
+    filein >> fileDecay;
+    if (fileDecay <= 0 || fileDecay >= 1)
+        throw runtime_error("Corrupt estimates file. Decay must be between 0 and 1 (non-inclusive)");
+    filein >> fileBuckets;
+    numBuckets = fileBuckets.size();
+    if (numBuckets <= 1 || numBuckets > 1000)
+        throw runtime_error("Corrupt estimates file. Must have between 2 and 1000 fee/pri buckets");
+    filein >> fileAvg;
+    if (fileAvg.size() != numBuckets)
+        throw runtime_error("Corrupt estimates file. Mismatch in fee/pri average bucket count");
+    filein >> fileTxCtAvg;
+    if (fileTxCtAvg.size() != numBuckets)
+        throw runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
+    filein >> fileConfAvg;
+    maxConfirms = fileConfAvg.size();
+    if (maxConfirms != GetMaxConfirms())
+        throw runtime_error("Corrupt estimates file. Mismatch in the number of confirms tracked");
+    for (unsigned int i = 0; i < maxConfirms; i++) {
+        if (fileConfAvg[i].size() != numBuckets)
+            throw runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
+    }
+
+    // Now that we've processed the entire fee estimate data file and not
+    // thrown any errors, we can copy it to our data structures
+    Initialize(fileBuckets, maxConfirms, fileDecay, dataTypeString);
+    avg = fileAvg;
+    confAvg = fileConfAvg;
+    txCtAvg = fileTxCtAvg;
+
+    LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
+             numBuckets, dataTypeString, maxConfirms);
+}
+
+CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
+    : nBestSeenHeight(0)
+{
+    minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
+    std::vector<double> vfeelist;
+    for (double bucketBoundary = minTrackedFee.GetFeePerK(); bucketBoundary <= MAX_FEERATE; bucketBoundary *= FEE_SPACING)
+        vfeelist.push_back(bucketBoundary);
+    vfeelist.push_back(INF_FEERATE);
+    feeStats.Initialize(vfeelist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY, "FeeRate");
+
+    minTrackedPriority = AllowFreeThreshold() < MIN_PRIORITY ? MIN_PRIORITY : AllowFreeThreshold();
+    std::vector<double> vprilist;
+    for (double bucketBoundary = minTrackedPriority; bucketBoundary <= MAX_PRIORITY; bucketBoundary *= PRI_SPACING)
+        vprilist.push_back(bucketBoundary);
+    vprilist.push_back(INF_PRIORITY);
+    priStats.Initialize(vprilist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY, "Priority");
+
+    feeEstimates.assign(MAX_BLOCK_CONFIRMS, CFeeRate(0));
+    priEstimates.assign(MAX_BLOCK_CONFIRMS, -1);
+}
+
+void CBlockPolicyEstimator::removeTx(const uint256& hash)
+{
+    std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
+    if (pos == mapMemPoolTxs.end())
+        return;
+    pos->second.stats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex);
+    mapMemPoolTxs.erase(pos);
+}
+
+void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
+{
+    unsigned int txHeight = entry.GetHeight();
+    uint256 hash = entry.GetTx().GetHash();
+    if (mapMemPoolTxs.count(hash)) {
+        LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n",
+                 hash.ToString().c_str());
+        return;
+    }
+
+    if (txHeight < nBestSeenHeight) {
+        // Ignore side chains and re-orgs; assuming they are random they don't
+        // affect the estimate.  We'll potentially double count transactions in 1-block reorgs.
+        return;
+    }
+
+    // Only want to be updating estimates when our blockchain is synced,
+    // otherwise we'll miscalculate how many blocks its taking to get included.
+    if (!fCurrentEstimate)
+        return;
+
+    // We need to guess why the transaction will be included in a block--
+    // either because it is high-priority or because it has sufficient fees.
+    // The priority it entered with stands in for the one it will be mined with.
+    CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
+    double dPriority = entry.GetPriority(txHeight);
+    bool fSufficientFee = feeRate > minTrackedFee;
+    bool fSufficientPriority = AllowFree(dPriority);
+
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    info.blockHeight = txHeight;
+    if (fSufficientFee && !fSufficientPriority) {
+        info.stats = &feeStats;
+        info.bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+    } else if (fSufficientPriority && !fSufficientFee) {
+        info.stats = &priStats;
+        info.bucketIndex = priStats.NewTx(txHeight, dPriority);
+    } else {
+        // Neither or both fee and priority sufficient: don't know why it would confirm
+        mapMemPoolTxs.erase(hash);
+    }
+}
+
+void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry)
+{
+    std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(entry.GetTx().GetHash());
+    if (pos == mapMemPoolTxs.end()) {
+        // This transaction wasn't being tracked for fee estimation
+        return;
+    }
+    TxConfirmStats* stats = pos->second.stats;
+    removeTx(entry.GetTx().GetHash());
+
+    // How many blocks did it take for miners to include this transaction?
+    // blocksToConfirm is 1-based, so a transaction included in the earliest
+    // possible block has confirmation count of 1
+    int blocksToConfirm = nBlockHeight - entry.GetHeight();
+    if (blocksToConfirm <= 0) {
+        // This can't happen because we don't process transactions from a block with a height
+        // lower than our greatest seen height
+        LogPrint("estimatefee", "Blockpolicy error Transaction had negative blocksToConfirm\n");
+        return;
+    }
+
+    if (stats == &feeStats)
+        feeStats.Record(blocksToConfirm, (double)CFeeRate(entry.GetFee(), entry.GetTxSize()).GetFeePerK());
+    else
+        priStats.Record(blocksToConfirm, entry.GetPriority(entry.GetHeight()));
+}
+
+void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
+                                         const std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
+{
+    if (nBlockHeight <= nBestSeenHeight) {
+        // Ignore side chains and re-orgs; assuming they are random
+        // they don't affect the estimate.
+        // And if an attacker can re-org the chain at will, then
+        // you've got much bigger problems than "attacker can influence
+        // transaction fees."
+        return;
+    }
+    nBestSeenHeight = nBlockHeight;
+
+    // Only want to be updating estimates when our blockchain is synced,
+    // otherwise we'll miscalculate how many blocks its taking to get included.
+    if (!fCurrentEstimate)
+        return;
+
+    // Clear the current block states
+    feeStats.ClearCurrent(nBlockHeight);
+    priStats.ClearCurrent(nBlockHeight);
+
+    // Repopulate the current block states
+    for (unsigned int i = 0; i < entries.size(); i++)
+        processBlockTx(nBlockHeight, entries[i]);
+
+    // Update all exponential averages with the current block states
+    feeStats.UpdateMovingAverages();
+    priStats.UpdateMovingAverages();
+
+    UpdateEstimates();
+
+    LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
+             entries.size(), mapMemPoolTxs.size());
+}
+
+void CBlockPolicyEstimator::UpdateEstimates()
+{
+    for (unsigned int i = 0; i < MAX_BLOCK_CONFIRMS; i++) {
+        double dFee = feeStats.EstimateMedianVal(i + 1, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, nBestSeenHeight);
+        feeEstimates[i] = dFee < 0 ? CFeeRate(0) : CFeeRate(dFee);
+        priEstimates[i] = priStats.EstimateMedianVal(i + 1, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, nBestSeenHeight);
+    }
+}
+
+CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget) const
+{
+    // Return failure if trying to analyze a target we're not tracking
+    if (confTarget <= 0 || (unsigned int)confTarget > feeEstimates.size())
+        return CFeeRate(0);
+    return feeEstimates[confTarget - 1];
+}
+
+CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget) const
+{
+    if (answerFoundAtTarget)
+        *answerFoundAtTarget = 0;
+    if (confTarget <= 0)
+        return CFeeRate(0);
+
+    for (unsigned int i = confTarget; i <= feeEstimates.size(); i++) {
+        if (feeEstimates[i - 1] > CFeeRate(0)) {
+            if (answerFoundAtTarget)
+                *answerFoundAtTarget = i;
+            return feeEstimates[i - 1];
+        }
+    }
+    return CFeeRate(0);
+}
+
+double CBlockPolicyEstimator::estimatePriority(int confTarget) const
+{
+    // Return failure if trying to analyze a target we're not tracking
+    if (confTarget <= 0 || (unsigned int)confTarget > priEstimates.size())
+        return -1;
+    return priEstimates[confTarget - 1];
+}
+
+double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerFoundAtTarget) const
+{
+    if (answerFoundAtTarget)
+        *answerFoundAtTarget = 0;
+    if (confTarget <= 0)
+        return -1;
+
+    for (unsigned int i = confTarget; i <= priEstimates.size(); i++) {
+        if (priEstimates[i - 1] >= 0) {
+            if (answerFoundAtTarget)
+                *answerFoundAtTarget = i;
+            return priEstimates[i - 1];
+        }
+    }
+    return -1;
+}
+
+void CBlockPolicyEstimator::Write(CAutoFile& fileout) const
+{
+    fileout << nBestSeenHeight;
+    feeStats.Write(fileout);
+    priStats.Write(fileout);
+}
+
+void CBlockPolicyEstimator::Read(CAutoFile& filein)
+{
+    int nFileBestSeenHeight;
+    filein >> nFileBestSeenHeight;
+    feeStats.Read(filein);
+    priStats.Read(filein);
+    nBestSeenHeight = nFileBestSeenHeight;
+    UpdateEstimates();
+}
@@ -0,0 +1,197 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_POLICY_FEES_H
+#define BITCOIN_POLICY_FEES_H
+
+#include "amount.h"
+#include "uint256.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class CAutoFile;
+class CTxMemPoolEntry;
+
+/**
+ * The fee (or priority) estimator buckets transactions by the fee rate (or
+ * priority) they pay when they enter the mempool. For each bucket it keeps
+ * exponentially decaying counts of how many transactions confirmed within
+ * 1, 2, ... MAX_BLOCK_CONFIRMS blocks, and exact counts of how many are still
+ * waiting, per entry height.
+ *
+ * The estimate for a target of Y blocks comes from walking the buckets from
+ * the highest fee rate down, grouping buckets until there are enough data
+ * points, for as long as at least MIN_SUCCESS_PCT of the group was confirmed
+ * within Y blocks (still unconfirmed transactions older than Y count as
+ * failures). It is the median fee rate of the cheapest group that passed.
+ *
+ * The averages are updated with O(buckets) work per block and all targets
+ * are estimated right after, so lookups only read a table.
+ */
+
+/** Track the confirmation history of transactions in one kind of bucket (fee rate or priority) */
+class TxConfirmStats
+{
+private:
+    //! Upper bound of each bucket, the last one is a catch-all
+    std::vector<double> buckets;
+    std::map<double, unsigned int> bucketMap;
+
+    //! Decayed count of transactions per bucket that were confirmed (at any depth)
+    std::vector<double> txCtAvg;
+    std::vector<int> curBlockTxCt;
+
+    //! confAvg[Y][X] is the decayed count of transactions in bucket X confirmed within Y+1 blocks
+    std::vector<std::vector<double> > confAvg;
+    std::vector<std::vector<int> > curBlockConf;
+
+    //! Decayed sum of the values in each bucket, for the average within a bucket
+    std::vector<double> avg;
+    std::vector<double> curBlockVal;
+
+    double decay;
+    std::string dataTypeString;
+
+    //! unconfTxs[H % MAX_BLOCK_CONFIRMS][X] counts transactions in bucket X that entered at height H and are unconfirmed
+    std::vector<std::vector<int> > unconfTxs;
+    //! Transactions per bucket unconfirmed for MAX_BLOCK_CONFIRMS blocks or more
+    std::vector<int> oldUnconfTxs;
+
+public:
+    /** Set up the buckets and the tracking vectors */
+    void Initialize(const std::vector<double>& defaultBuckets, unsigned int maxConfirms, double decay, const std::string& dataTypeString);
+
+    /** Start a new block: zero its counters and age out the oldest unconfirmed transactions */
+    void ClearCurrent(unsigned int nBlockHeight);
+
+    /** Record a transaction with value val confirmed after blocksToConfirm (1-based) blocks */
+    void Record(int blocksToConfirm, double val);
+
+    /** Record a new unconfirmed transaction; returns its bucket */
+    unsigned int NewTx(unsigned int nBlockHeight, double val);
+
+    /** Forget an unconfirmed transaction that entered at entryHeight */
+    void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight, unsigned int bucketIndex);
+
+    /** Decay the averages and add in the current block */
+    void UpdateMovingAverages();
+
+    /**
+     * Median value of the cheapest range of buckets in which at least
+     * minSuccess of the transactions confirmed within confTarget blocks,
+     * -1 if there is not enough data. A range needs sufficientTxVal
+     * confirmed transactions per block on average.
+     */
+    double EstimateMedianVal(int confTarget, double sufficientTxVal, double minSuccess, unsigned int nBlockHeight) const;
+
+    unsigned int GetMaxConfirms() const { return confAvg.size(); }
+
+    void Write(CAutoFile& fileout) const;
+    /** Read the averages written by Write, with their buckets; throws on corruption */
+    void Read(CAutoFile& filein);
+};
+
+/** Track confirm delays up to 25 blocks, can't estimate beyond that */
+static const unsigned int MAX_BLOCK_CONFIRMS = 25;
+
+/** Decay of .998 is a half-life of 346 blocks or about 2.4 days */
+static const double DEFAULT_DECAY = .998;
+
+/** Require greater than 95% of X feerate transactions to be confirmed within Y blocks for X to be big enough */
+static const double MIN_SUCCESS_PCT = .95;
+
+/** Require an avg of 1 tx in the combined feerate bucket per block to have stat significance */
+static const double SUFFICIENT_FEETXS = 1;
+
+/** Require only an avg of 1 tx every 5 blocks in the combined pri bucket (way less pri txs) */
+static const double SUFFICIENT_PRITXS = .2;
+
+// Minimum and Maximum values for tracking fees and priorities
+static const double MIN_FEERATE = 10;
+static const double MAX_FEERATE = 1e7;
+static const double INF_FEERATE = MAX_MONEY;
+static const double MIN_PRIORITY = 10;
+static const double MAX_PRIORITY = 1e16;
+static const double INF_PRIORITY = 1e9 * MAX_MONEY;
+
+// We have to lump transactions into buckets based on fee or priority, but we want to be able
+// to give accurate estimates over a large range of potential fees and priorities
+// Therefore it makes sense to exponentially space the buckets
+/** Spacing of FeeRate buckets */
+static const double FEE_SPACING = 1.1;
+
+/** Spacing of Priority buckets */
+static const double PRI_SPACING = 2;
+
+/** Estimates the fee rate or priority a transaction needs to confirm within a number of blocks */
+class CBlockPolicyEstimator
+{
+public:
+    /** Create new BlockPolicyEstimator and initialize stats tracking classes with default values */
+    CBlockPolicyEstimator(const CFeeRate& minRelayFee);
+
+    /** Process all the transactions that have been included in a block */
+    void processBlock(unsigned int nBlockHeight, const std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate);
+
+    /** Process a transaction accepted to the mempool */
+    void processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate);
+
+    /** Stop tracking a transaction that left the mempool without being mined */
+    void removeTx(const uint256& hash);
+
+    /** Fee rate needed to confirm within confTarget blocks, 0 if unknown */
+    CFeeRate estimateFee(int confTarget) const;
+
+    /**
+     * As estimateFee, but if there is no estimate for confTarget try longer
+     * targets; answerFoundAtTarget is set to the target used (0 if none).
+     */
+    CFeeRate estimateSmartFee(int confTarget, int *answerFoundAtTarget) const;
+
+    /** Priority needed to confirm within confTarget blocks, -1 if unknown */
+    double estimatePriority(int confTarget) const;
+
+    /** As estimatePriority, trying longer targets like estimateSmartFee */
+    double estimateSmartPriority(int confTarget, int *answerFoundAtTarget) const;
+
+    /** Write estimation data to a file */
+    void Write(CAutoFile& fileout) const;
+
+    /** Read estimation data from a file; throws on corruption */
+    void Read(CAutoFile& filein);
+
+private:
+    CFeeRate minTrackedFee; //! Passed to constructor to avoid dependency on main
+    double minTrackedPriority; //! Set to AllowFreeThreshold
+    unsigned int nBestSeenHeight;
+
+    struct TxStatsInfo
+    {
+        TxConfirmStats *stats;
+        unsigned int blockHeight;
+        unsigned int bucketIndex;
+        TxStatsInfo() : stats(NULL), blockHeight(0), bucketIndex(0) {}
+    };
+
+    //! Map of txids to information about that transaction
+    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
+
+    //! Classes to track historical data on transaction confirmations
+    TxConfirmStats feeStats, priStats;
+
+    //! Estimates for targets 1..MAX_BLOCK_CONFIRMS, refreshed once per block
+    std::vector<CFeeRate> feeEstimates;
+    std::vector<double> priEstimates;
+
+    /** Process a transaction confirmed in a block */
+    void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry);
+
+    /** Recompute the estimate tables from the stats */
+    void UpdateEstimates();
+};
+
+#endif // BITCOIN_POLICY_FEES_H
@@ -14,9 +14,11 @@
 #include "wallet.h"
 
 #include <fstream>
+#include <limits>
 #include <stdint.h>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/assign/list_of.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "json/json_spirit_value.h"
@@ -69,6 +71,58 @@ std::string DecodeDumpString(const std::string &str) {
     return ret.str();
 }
 
+/**
+ * Add a private key to the wallet with its label, and nCreateTime as its
+ * birth time (1 if unknown). Returns false if the wallet already had it.
+ */
+static bool ImportPrivKey(const CKey& key, const string& strLabel, int64_t nCreateTime)
+{
+    CPubKey pubkey = key.GetPubKey();
+    assert(key.VerifyPubKey(pubkey));
+    CKeyID vchAddress = pubkey.GetID();
+
+    pwalletMain->MarkDirty();
+    pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
+
+    // Don't throw error in case a key is already there
+    if (pwalletMain->HaveKey(vchAddress))
+        return false;
+
+    pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = nCreateTime;
+
+    if (!pwalletMain->AddKeyPubKey(key, pubkey))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+
+    // rescans must now reach back to the new key's birth time
+    if (!pwalletMain->nTimeFirstKey || nCreateTime < pwalletMain->nTimeFirstKey)
+        pwalletMain->nTimeFirstKey = nCreateTime;
+
+    return true;
+}
+
+/**
+ * First block up to pindexTip that can hold transactions to keys created at
+ * nTimeBegin, allowing for 2 hours of block time variability. The blocks
+ * in between are only walked through in the index, not read.
+ */
+CBlockIndex* GetRescanStart(CBlockIndex* pindexTip, int64_t nTimeBegin)
+{
+    CBlockIndex *pindex = pindexTip;
+    while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+static void RescanFromTime(int64_t nTimeBegin, bool fUpdate)
+{
+    CBlockIndex *pindex = GetRescanStart(chainActive.Tip(), nTimeBegin);
+    if (!pindex)
+        return;
+
+    LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
+    pwalletMain->ScanForWalletTransactions(pindex, fUpdate);
+}
+
 Value importprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 3)
@@ -111,29 +165,99 @@ Value importprivkey(const Array& params, bool fHelp)
     CKey key = vchSecret.GetKey();
     if (!key.IsValid()) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Private key outside allowed range");
 
-    CPubKey pubkey = key.GetPubKey();
-    assert(key.VerifyPubKey(pubkey));
-    CKeyID vchAddress = pubkey.GetID();
+    // the key's birth time is unknown, so we need to scan the whole chain
+    if (ImportPrivKey(key, strLabel, 1) && fRescan)
+        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+
+    return Value::null;
+}
+
+Value importprivkeys(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "importprivkeys [{\"privkey\":\"bataprivkey\",\"label\":\"label\",\"timestamp\":n},...] ( rescan )\n"
+            "\nAdds private keys (as returned by dumpprivkey) to your wallet, with a single rescan\n"
+            "from the earliest key birth time.\n"
+            "\nArguments:\n"
+            "1. \"keys\"             (string, required) A json array of json objects\n"
+            "     [\n"
+            "       {\n"
+            "         \"privkey\":\"key\",   (string, required) The private key (see dumpprivkey)\n"
+            "         \"label\":\"label\",   (string, optional, default=\"\") An optional label\n"
+            "         \"timestamp\":n      (numeric, optional) Creation time of the key in seconds since epoch (Jan 1 1970 GMT).\n"
+            "                                Blocks more than 2 hours older are not rescanned. Without it the whole chain is.\n"
+            "       }\n"
+            "       ,...\n"
+            "     ]\n"
+            "2. rescan               (boolean, optional, default=true) Rescan the wallet for transactions\n"
+            "\nNote: This call can take minutes to complete if rescan is true.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("importprivkeys", "\"[{\\\"privkey\\\":\\\"mykey\\\",\\\"timestamp\\\":1425000000}]\"") +
+            "\nAs a JSON-RPC call\n"
+            + HelpExampleRpc("importprivkeys", "[{\"privkey\":\"mykey\",\"label\":\"testing\"}], false")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(array_type)(bool_type));
+
+    EnsureWalletIsUnlocked();
+
+    const Array& keys = params[0].get_array();
+
+    // Whether to perform rescan after import
+    bool fRescan = true;
+    if (params.size() > 1)
+        fRescan = params[1].get_bool();
+
+    // Check everything before adding anything
+    std::vector<std::pair<CKey, std::pair<string, int64_t> > > vImport;
+    BOOST_FOREACH(const Value& entry, keys)
     {
-        pwalletMain->MarkDirty();
-        pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
+        if (entry.type() != obj_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected an object for each key");
+        const Object& o = entry.get_obj();
 
-        // Don't throw error in case a key is already there
-        if (pwalletMain->HaveKey(vchAddress))
-            return Value::null;
+        const Value& privkey = find_value(o, "privkey");
+        if (privkey.type() != str_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing privkey");
+        RPCTypeCheck(o, boost::assign::map_list_of("label", str_type)("timestamp", int_type), true);
 
-        pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = 1;
+        CBitcoinSecret vchSecret;
+        if (!vchSecret.SetString(privkey.get_str()))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
+        CKey key = vchSecret.GetKey();
+        if (!key.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Private key outside allowed range");
 
-        if (!pwalletMain->AddKeyPubKey(key, pubkey))
-            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+        string strLabel = "";
+        const Value& label = find_value(o, "label");
+        if (label.type() != null_type)
+            strLabel = label.get_str();
 
-        // whenever a key is imported, we need to scan the whole chain
-        pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+        int64_t nCreateTime = 1;
+        const Value& timestamp = find_value(o, "timestamp");
+        if (timestamp.type() != null_type)
+            nCreateTime = std::max((int64_t)1, timestamp.get_int64());
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        vImport.push_back(std::make_pair(key, std::make_pair(strLabel, nCreateTime)));
+    }
+
+    bool fAnyNew = false;
+    int64_t nTimeBegin = std::numeric_limits<int64_t>::max();
+    pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
+    for (unsigned int i = 0; i < vImport.size(); i++)
+    {
+        pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(i * 100 / vImport.size()))));
+        if (ImportPrivKey(vImport[i].first, vImport[i].second.first, vImport[i].second.second))
+        {
+            fAnyNew = true;
+            nTimeBegin = std::min(nTimeBegin, vImport[i].second.second);
         }
     }
+    pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
+
+    if (fAnyNew && fRescan)
+        RescanFromTime(nTimeBegin, true);
 
     return Value::null;
 }
@@ -288,15 +412,10 @@ Value importwallet(const Array& params, bool fHelp)
     file.close();
     pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
 
-    CBlockIndex *pindex = chainActive.Tip();
-    while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
-        pindex = pindex->pprev;
-
     if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
         pwalletMain->nTimeFirstKey = nTimeBegin;
 
-    LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+    RescanFromTime(nTimeBegin, false);
     pwalletMain->MarkDirty();
 
     if (!fGood)
@@ -364,7 +364,16 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\":\n"
+            "  {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -375,6 +384,15 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
 
@@ -474,6 +492,7 @@ Value firewallstatus(const Array& params, bool fHelp)
                             "\nGet the status of Bitcoin Firewall.\n"
                             );
 
+    LOCK(cs_firewall);
 
     Object result;
     result.push_back(Pair("enabled", BoolToString(FIREWALL_ENABLED)));
@@ -526,6 +545,8 @@ Value firewallenabled(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallenabled", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -564,6 +585,8 @@ Value firewallclearblacklist(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallclearblacklist", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -601,6 +624,8 @@ Value firewallclearbanlist(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallclearbanlist", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -638,6 +663,8 @@ Value firewalldebug(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebug", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -674,6 +701,8 @@ Value firewalldebugexam(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebugexam", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -711,6 +740,8 @@ Value firewalldebugbans(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebugbans", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -747,6 +778,8 @@ Value firewalldebugblacklist(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebugblacklist", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -784,6 +817,8 @@ Value firewalldebugdisconnect(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebugdisconnect", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -821,6 +856,8 @@ Value firewalldebugbandwidthabuse(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebugbandwidthabuse", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -858,6 +895,8 @@ Value firewalldebugnofalsepositivebandwidthabuse(const Array& params, bool fHelp
                             + HelpExampleCli("firewalldebugnofalsepositivebandwidthabuse", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -895,6 +934,8 @@ Value firewalldebuginvalidwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebuginvalidwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -932,6 +973,8 @@ Value firewalldebugforkedwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebugforkedwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -968,6 +1011,8 @@ Value firewalldebugfloodingwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldebugfloodingwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1003,6 +1048,8 @@ Value firewallaveragetolerance(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallaveragetolerance", "0.1")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_AVERAGE_TOLERANCE = strtod(params[0].get_str().c_str(), NULL);
@@ -1028,6 +1075,8 @@ Value firewallaveragerange(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallaveragerange", "50")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_AVERAGE_RANGE = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1053,6 +1102,8 @@ Value firewalltraffictolerance(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalltraffictolerance", "0.1")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_TRAFFIC_TOLERANCE = strtod(params[0].get_str().c_str(), NULL);
@@ -1078,6 +1129,8 @@ Value firewalltrafficzone(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalltrafficzone", "50.50")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_TRAFFIC_ZONE = strtod(params[0].get_str().c_str(), NULL);
@@ -1106,11 +1159,14 @@ Value firewalladdtowhitelist(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalladdtowhitelist", "127.0.0.1")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         if (CountStringArray(FIREWALL_WHITELIST) < 256)
         {
             FIREWALL_WHITELIST[CountStringArray(FIREWALL_WHITELIST)] = params[0].get_str();
+            FirewallSettingsChanged();
             MSG = CountStringArray(FIREWALL_WHITELIST);
         }
         else
@@ -1142,11 +1198,14 @@ Value firewalladdtoblacklist(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalladdtoblacklist", "127.0.0.1")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         if (CountStringArray(FIREWALL_BLACKLIST) < 256)
         {
             FIREWALL_BLACKLIST[CountStringArray(FIREWALL_BLACKLIST)] = params[0].get_str();
+            FirewallSettingsChanged();
             MSG = CountStringArray(FIREWALL_BLACKLIST);
         }
         else
@@ -1176,6 +1235,8 @@ Value firewalldetectbandwidthabuse(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldetectbandwidthabuse", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1211,6 +1272,8 @@ Value firewallblacklistbandwidthabuse(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallblacklistbandwidthabuse", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1246,6 +1309,8 @@ Value firewallbanbandwidthabuse(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbanbandwidthabuse", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1281,6 +1346,8 @@ Value firewallnofalsepositivebandwidthabuse(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallnofalsepositivebandwidthabuse", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1317,6 +1384,8 @@ Value firewallbantimebandwidthabuse(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbantimebandwidthabuse", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_BANTIME_BANDWIDTHABUSE = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1344,6 +1413,8 @@ Value firewallbandwidthabusemaxcheck(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbandwidthabusemaxcheck", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_BANDWIDTHABUSE_MAXCHECK = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1370,6 +1441,8 @@ Value firewallbandwidthabuseminattack(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbandwidthabuseminattack", "17.005")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_BANDWIDTHABUSE_MINATTACK = strtod(params[0].get_str().c_str(), NULL);
@@ -1396,6 +1469,8 @@ Value firewallbandwidthabusemaxattack(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbandwidthabusemaxattack", "18.004")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_BANDWIDTHABUSE_MAXATTACK = strtod(params[0].get_str().c_str(), NULL);
@@ -1423,6 +1498,8 @@ Value firewalldetectinvalidwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldetectinvalidwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1459,6 +1536,8 @@ Value firewallblacklistinvalidwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallblacklistinvalidwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1495,6 +1574,8 @@ Value firewallbaninvalidwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbaninvalidwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1531,6 +1612,8 @@ Value firewallbantimeinvalidwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbantimeinvalidwallet", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_BANTIME_INVALIDWALLET = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1557,6 +1640,8 @@ Value firewallinvalidwalletminprotocol(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallinvalidwalletminprotocol", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_MINIMUM_PROTOCOL = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1583,6 +1668,8 @@ Value firewallinvalidwalletmaxcheck(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallinvalidwalletmaxcheck", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_INVALIDWALLET_MAXCHECK = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1609,6 +1696,8 @@ Value firewalldetectforkedwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldetectforkedwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1645,6 +1734,8 @@ Value firewallblacklistforkedwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallblacklistforkedwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1681,6 +1772,8 @@ Value firewallbanforkedwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbanforkedwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1717,6 +1810,8 @@ Value firewallbantimeforkedwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbantimeinvalidwallet", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
          FIREWALL_BANTIME_FORKEDWALLET = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1745,11 +1840,14 @@ Value firewallforkedwalletnodeheight(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallforkedwalletnodeheight", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         if (CountIntArray(FIREWALL_FORKED_NODEHEIGHT) < 256)
         {
             FIREWALL_FORKED_NODEHEIGHT[CountIntArray(FIREWALL_FORKED_NODEHEIGHT)] = (int)strtod(params[0].get_str().c_str(), NULL);
+            FirewallSettingsChanged();
             MSG = CountIntArray(FIREWALL_FORKED_NODEHEIGHT);
         }
         else
@@ -1779,6 +1877,8 @@ Value firewalldetectfloodingwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewalldetectfloodingwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1815,6 +1915,8 @@ Value firewallblacklistfloodingwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallblacklistfloodingwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1851,6 +1953,8 @@ Value firewallbanfloodingwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbanfloodingwallet", "false")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         strCommand = params[0].get_str();
@@ -1887,6 +1991,8 @@ Value firewallbantimefloodingwallet(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallbantimefloodingwallet", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_BANTIME_FLOODINGWALLET = (int)strtod(params[0].get_str().c_str(), NULL);
@@ -1913,9 +2019,12 @@ Value firewallfloodingwalletminbytes(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallfloodingwalletminbytes", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_FLOODINGWALLET_MINBYTES = (int)strtod(params[0].get_str().c_str(), NULL);
+        FirewallSettingsChanged();
     }
 
     Object result;
@@ -1939,9 +2048,12 @@ Value firewallfloodingwalletmaxbytes(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallfloodingwalletmaxbytes", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_FLOODINGWALLET_MAXBYTES = (int)strtod(params[0].get_str().c_str(), NULL);
+        FirewallSettingsChanged();
     }
 
     Object result;
@@ -1967,11 +2079,14 @@ Value firewallfloodingwalletattackpatternadd(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallfloodingwalletattackpatternadd", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         if (CountStringArray(FIREWALL_FLOODPATTERNS) < 256)
         {
             FIREWALL_FLOODPATTERNS[CountStringArray(FIREWALL_FLOODPATTERNS)] = params[0].get_str().c_str();
+            FirewallSettingsChanged();
             MSG = CountStringArray(FIREWALL_FLOODPATTERNS);
         }
         else
@@ -2004,6 +2119,8 @@ Value firewallfloodingwalletattackpatternremove(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallfloodingwalletattackpatternremove", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         string WARNING;
@@ -2019,6 +2136,7 @@ Value firewallfloodingwalletattackpatternremove(const Array& params, bool fHelp)
             {
                 MSG = FIREWALL_FLOODPATTERNS[i];
                 FIREWALL_FLOODPATTERNS[i] = "";
+                FirewallSettingsChanged();
             }
 
         }
@@ -2046,6 +2164,8 @@ Value firewallfloodingwalletmintrafficavg(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallfloodingwalletmintrafficav", "12000.014")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_FLOODINGWALLET_MINTRAFFICAVERAGE = strtod(params[0].get_str().c_str(), NULL);
@@ -2072,6 +2192,8 @@ Value firewallfloodingwalletmaxtrafficavg(const Array& params, bool fHelp)
                             + HelpExampleCli("ffirewallfloodingwalletmaxtrafficavg", "10.8")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_FLOODINGWALLET_MAXTRAFFICAVERAGE = strtod(params[0].get_str().c_str(), NULL);;
@@ -2098,9 +2220,12 @@ Value firewallfloodingwalletmincheck(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallfloodingwalletmincheck", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_FLOODINGWALLET_MINCHECK = (int)strtod(params[0].get_str().c_str(), NULL);
+        FirewallSettingsChanged();
     }
 
     Object result;
@@ -2124,9 +2249,12 @@ Value firewallfloodingwalletmaxcheck(const Array& params, bool fHelp)
                             + HelpExampleCli("firewallfloodingwalletmaxcheck", "10000000")
                             );
 
+    LOCK(cs_firewall);
+
     if (params.size() == 1)
     {
         FIREWALL_FLOODINGWALLET_MAXCHECK = (int)strtod(params[0].get_str().c_str(), NULL);
+        FirewallSettingsChanged();
     }
 
     Object result;
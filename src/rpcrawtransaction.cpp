@@ -256,44 +256,30 @@ Value listunspent(const Array& params, bool fHelp)
     }
 
     Array results;
-    vector<COutput> vecOutputs;
     assert(pwalletMain != NULL);
-    pwalletMain->AvailableCoins(vecOutputs, false);
-    BOOST_FOREACH(const COutput& out, vecOutputs) {
+    boost::shared_ptr<const CWalletUnspentSnapshot> snapshot = pwalletMain->GetUnspentSnapshot();
+    BOOST_FOREACH(const CWalletUnspentSnapshot::CUnspent& out, snapshot->vUnspent) {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
             continue;
 
         if (setAddress.size()) {
-            CTxDestination address;
-            if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-                continue;
-
-            if (!setAddress.count(address))
+            if (out.strAddress.empty() || !setAddress.count(out.address))
                 continue;
         }
 
-        CAmount nValue = out.tx->vout[out.i].nValue;
-        const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+        const CScript& pk = out.scriptPubKey;
         Object entry;
-        entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
-        entry.push_back(Pair("vout", out.i));
-        CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address)) {
-            entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address].name));
+        entry.push_back(Pair("txid", out.txid.GetHex()));
+        entry.push_back(Pair("vout", (int)out.n));
+        if (!out.strAddress.empty()) {
+            entry.push_back(Pair("address", out.strAddress));
+            if (out.fHaveAccount)
+                entry.push_back(Pair("account", out.strAccount));
         }
         entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
-        if (pk.IsPayToScriptHash()) {
-            CTxDestination address;
-            if (ExtractDestination(pk, address)) {
-                const CScriptID& hash = boost::get<CScriptID>(address);
-                CScript redeemScript;
-                if (pwalletMain->GetCScript(hash, redeemScript))
-                    entry.push_back(Pair("redeemScript", HexStr(redeemScript.begin(), redeemScript.end())));
-            }
-        }
-        entry.push_back(Pair("amount",ValueFromAmount(nValue)));
+        if (!out.redeemScript.empty())
+            entry.push_back(Pair("redeemScript", HexStr(out.redeemScript.begin(), out.redeemScript.end())));
+        entry.push_back(Pair("amount",ValueFromAmount(out.nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
         entry.push_back(Pair("spendable", out.fSpendable));
         results.push_back(entry);
@@ -756,3 +742,87 @@ Value sendrawtransaction(const Array& params, bool fHelp)
 
     return hashTx.GetHex();
 }
+
+Value sendrawtransactions(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "sendrawtransactions [\"hexstring\",...] ( allowhighfees )\n"
+            "\nSubmits a batch of raw transactions (serialized, hex-encoded) to local node and network.\n"
+            "Transactions may spend outputs of earlier ones in the list. The batch is checked under one\n"
+            "lock and the signatures of all transactions are verified in parallel.\n"
+            "\nArguments:\n"
+            "1. [\"hexstring\",...]  (array, required) The hex strings of the raw transactions\n"
+            "2. allowhighfees      (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txid\" : \"hex\",   (string) The transaction hash in hex\n"
+            "    \"error\" : \"msg\"   (string, only if rejected) Why the transaction was rejected\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendrawtransactions", "\"[\\\"signedhex1\\\",\\\"signedhex2\\\"]\"")
+            + HelpExampleRpc("sendrawtransactions", "[\"signedhex1\",\"signedhex2\"]")
+        );
+
+    RPCTypeCheck(params, list_of(array_type)(bool_type));
+
+    const Array& hexTxs = params[0].get_array();
+    bool fOverrideFees = false;
+    if (params.size() > 1)
+        fOverrideFees = params[1].get_bool();
+
+    std::vector<CTransaction> vtx(hexTxs.size());
+    for (unsigned int i = 0; i < hexTxs.size(); i++) {
+        if (hexTxs[i].type() != str_type || !DecodeHexTx(vtx[i], hexTxs[i].get_str()))
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("TX decode failed for transaction %u", i));
+    }
+
+    // Transactions already in the pool are only relayed again, as with sendrawtransaction
+    std::vector<std::string> vError(vtx.size());
+    std::vector<bool> vRelay(vtx.size(), false);
+    std::vector<CTransaction> vtxSubmit;
+    std::vector<unsigned int> vSubmitIndex;
+    CCoinsViewCache &view = *pcoinsTip;
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        uint256 hashTx = vtx[i].GetHash();
+        const CCoins* existingCoins = view.AccessCoins(hashTx);
+        if (existingCoins && existingCoins->nHeight < 1000000000) {
+            vError[i] = "transaction already in block chain";
+        } else if (mempool.exists(hashTx)) {
+            vRelay[i] = true;
+        } else {
+            vtxSubmit.push_back(vtx[i]);
+            vSubmitIndex.push_back(i);
+        }
+    }
+
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted;
+    AcceptToMemoryPoolBatch(mempool, vtxSubmit, vState, vAccepted, false, !fOverrideFees);
+    for (unsigned int i = 0; i < vtxSubmit.size(); i++) {
+        const CValidationState& state = vState[i];
+        if (vAccepted[i])
+            vRelay[vSubmitIndex[i]] = true;
+        else if (state.IsInvalid())
+            vError[vSubmitIndex[i]] = strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason());
+        else if (!state.GetRejectReason().empty())
+            vError[vSubmitIndex[i]] = state.GetRejectReason();
+        else
+            vError[vSubmitIndex[i]] = "missing inputs or conflicting with the memory pool";
+    }
+
+    Array result;
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        if (vRelay[i])
+            RelayTransaction(vtx[i]);
+        Object entry;
+        entry.push_back(Pair("txid", vtx[i].GetHash().GetHex()));
+        if (!vError[i].empty())
+            entry.push_back(Pair("error", vError[i]));
+        result.push_back(entry);
+    }
+    return result;
+}
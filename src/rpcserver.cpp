@@ -328,6 +328,7 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "getdifficulty",          &getdifficulty,          true,      false,      false },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,      true,       false },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true,      false,      false },
+    { "blockchain",         "savemempool",            &savemempool,            true,      true,       false },
     { "blockchain",         "gettxout",               &gettxout,               true,      false,      false },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
     { "blockchain",         "verifychain",            &verifychain,            true,      false,      false },
@@ -354,6 +355,7 @@ static const CRPCCommand vRPCCommands[] =
     { "rawtransactions",    "decodescript",           &decodescript,           true,      false,      false },
     { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,      false,      false },
     { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
+    { "rawtransactions",    "sendrawtransactions",    &sendrawtransactions,    false,     false,      false },
     { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false,     false,      false }, /* uses wallet if enabled */
 
     /* Utility functions */
@@ -362,6 +364,8 @@ static const CRPCCommand vRPCCommands[] =
     { "util",               "verifymessage",          &verifymessage,          true,      false,      false },
     { "util",               "estimatefee",            &estimatefee,            true,      true,       false },
     { "util",               "estimatepriority",       &estimatepriority,       true,      true,       false },
+    { "util",               "estimatesmartfee",       &estimatesmartfee,       true,      true,       false },
+    { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true,      true,       false },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        true,      true,       false },
@@ -378,15 +382,16 @@ static const CRPCCommand vRPCCommands[] =
     { "wallet",             "getaccountaddress",      &getaccountaddress,      true,      false,      true },
     { "wallet",             "getaccount",             &getaccount,             true,      false,      true },
     { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,      true },
-    { "wallet",             "getbalance",             &getbalance,             false,     false,      true },
+    { "wallet",             "getbalance",             &getbalance,             false,     true,       true },
     { "wallet",             "getnewaddress",          &getnewaddress,          true,      false,      true },
     { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true,      false,      true },
     { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,      true },
     { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,      true },
     { "wallet",             "gettransaction",         &gettransaction,         false,     false,      true },
-    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
-    { "wallet",             "getwalletinfo",          &getwalletinfo,          false,     false,      true },
+    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,     true,       true },
+    { "wallet",             "getwalletinfo",          &getwalletinfo,          false,     true,       true },
     { "wallet",             "importprivkey",          &importprivkey,          true,      false,      true },
+    { "wallet",             "importprivkeys",         &importprivkeys,         true,      false,      true },
     { "wallet",             "importwallet",           &importwallet,           true,      false,      true },
     { "wallet",             "importaddress",          &importaddress,          true,      false,      true },
     { "wallet",             "keypoolrefill",          &keypoolrefill,          true,      false,      true },
@@ -397,7 +402,7 @@ static const CRPCCommand vRPCCommands[] =
     { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,      true },
     { "wallet",             "listsinceblock",         &listsinceblock,         false,     false,      true },
     { "wallet",             "listtransactions",       &listtransactions,       false,     false,      true },
-    { "wallet",             "listunspent",            &listunspent,            false,     false,      true },
+    { "wallet",             "listunspent",            &listunspent,            false,     true,       true },
     { "wallet",             "lockunspent",            &lockunspent,            true,      false,      true },
     { "wallet",             "move",                   &movecmd,                false,     false,      true },
     { "wallet",             "sendfrom",               &sendfrom,               false,     false,      true },
@@ -800,6 +805,7 @@ void StopRPCThreads()
 
     rpc_io_service->stop();
     cvBlockChange.notify_all();
+    cvBlockTemplate.notify_all();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
     delete rpc_dummy_work; rpc_dummy_work = NULL;
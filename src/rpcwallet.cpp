@@ -99,9 +99,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
@@ -193,9 +190,6 @@ Value getrawchangeaddress(const Array& params, bool fHelp)
             + HelpExampleRpc("getrawchangeaddress", "")
        );
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     CReserveKey reservekey(pwalletMain);
     CPubKey vchPubKey;
     if (!reservekey.GetReservedKey(vchPubKey))
@@ -523,9 +517,9 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
     // Tally
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const CWalletTx* pwtx, pwalletMain->GetTxsByDestination(address.Get()))
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = *pwtx;
         if (wtx.IsCoinBase() || !IsFinalTx(wtx))
             continue;
 
@@ -572,18 +566,24 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const CTxDestination& dest, setAddress)
     {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+        if (!IsMine(*pwalletMain, dest))
             continue;
 
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        BOOST_FOREACH(const CWalletTx* pwtx, pwalletMain->GetTxsByDestination(dest))
         {
-            CTxDestination address;
-            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
+            const CWalletTx& wtx = *pwtx;
+            if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+                continue;
+
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                CTxDestination address;
+                if (ExtractDestination(txout.scriptPubKey, address) && address == dest)
+                    if (wtx.GetDepthInMainChain() >= nMinDepth)
+                        nAmount += txout.nValue;
+            }
         }
     }
 
@@ -652,7 +652,9 @@ Value getbalance(const Array& params, bool fHelp)
         );
 
     if (params.size() == 0)
-        return  ValueFromAmount(pwalletMain->GetBalance());
+        return  ValueFromAmount(pwalletMain->GetSnapshot()->nBalance);
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
 
     int nMinDepth = 1;
     if (params.size() > 1)
@@ -703,7 +705,7 @@ Value getunconfirmedbalance(const Array &params, bool fHelp)
         throw runtime_error(
                 "getunconfirmedbalance\n"
                 "Returns the server's total unconfirmed balance\n");
-    return ValueFromAmount(pwalletMain->GetUnconfirmedBalance());
+    return ValueFromAmount(pwalletMain->GetSnapshot()->nUnconfirmedBalance);
 }
 
 
@@ -753,7 +755,8 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    if (!walletdb.WriteAccountingEntry(debit))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     // Credit
     CAccountingEntry credit;
@@ -763,11 +766,16 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    if (!walletdb.WriteAccountingEntry(credit))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    // Only listed once both entries are on disk; an aborted move leaves no trace
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -988,35 +996,39 @@ Value ListReceived(const Array& params, bool fByAccounts)
         if(params[2].get_bool())
             filter = filter | ISMINE_WATCH_ONLY;
 
-    // Tally
+    // Tally, only the address book entries are reported
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, CAddressBookData)& entry, pwalletMain->mapAddressBook)
     {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
-            continue;
-
-        int nDepth = wtx.GetDepthInMainChain();
-        if (nDepth < nMinDepth)
+        const CTxDestination& dest = entry.first;
+        isminefilter mine = IsMine(*pwalletMain, dest);
+        if(!(mine & filter))
             continue;
 
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        BOOST_FOREACH(const CWalletTx* pwtx, pwalletMain->GetTxsByDestination(dest))
         {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address))
+            const CWalletTx& wtx = *pwtx;
+
+            if (wtx.IsCoinBase() || !IsFinalTx(wtx))
                 continue;
 
-            isminefilter mine = IsMine(*pwalletMain, address);
-            if(!(mine & filter))
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < nMinDepth)
                 continue;
 
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
-            item.txids.push_back(wtx.GetHash());
-            if (mine & ISMINE_WATCH_ONLY)
-                item.fIsWatchonly = true;
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                CTxDestination address;
+                if (!ExtractDestination(txout.scriptPubKey, address) || !(address == dest))
+                    continue;
+
+                tallyitem& item = mapTally[address];
+                item.nAmount += txout.nValue;
+                item.nConf = min(item.nConf, nDepth);
+                item.txids.push_back(wtx.GetHash());
+                if (mine & ISMINE_WATCH_ONLY)
+                    item.fIsWatchonly = true;
+            }
         }
     }
 
@@ -1324,11 +1336,10 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1501,12 +1512,19 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (pindex)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        // Only transactions in blocks above pindex or not in the main chain can qualify
+        BOOST_FOREACH(const CWalletTx* pwtx, pwalletMain->GetTxsSinceHeight(pindex->nHeight))
+        {
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions, filter);
+        }
+    }
+    else
+    {
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions, filter);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -1688,8 +1706,13 @@ Value walletpassphrase(const Array& params, bool fHelp)
 
     if (strWalletPass.length() > 0)
     {
-        if (!pwalletMain->Unlock(strWalletPass))
+        bool fCorrupted;
+        if (!pwalletMain->Unlock(strWalletPass, &fCorrupted))
+        {
+            if (fCorrupted)
+                throw JSONRPCError(RPC_WALLET_ERROR, "Error: The wallet is probably corrupted: some keys decrypt but not all.");
             throw JSONRPCError(RPC_WALLET_PASSPHRASE_INCORRECT, "Error: The wallet passphrase entered was incorrect.");
+        }
     }
     else
         throw runtime_error(
@@ -2001,13 +2024,17 @@ Value getwalletinfo(const Array& params, bool fHelp)
             + HelpExampleRpc("getwalletinfo", "")
         );
 
+    boost::shared_ptr<const CWalletSnapshot> snapshot = pwalletMain->GetSnapshot();
     Object obj;
-    obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
-    obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
-    obj.push_back(Pair("txcount",       (int)pwalletMain->mapWallet.size()));
-    obj.push_back(Pair("keypoololdest", pwalletMain->GetOldestKeyPoolTime()));
-    obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
-    if (pwalletMain->IsCrypted())
+    obj.push_back(Pair("walletversion", snapshot->nWalletVersion));
+    obj.push_back(Pair("balance",       ValueFromAmount(snapshot->nBalance)));
+    obj.push_back(Pair("txcount",       (int)snapshot->nTxCount));
+    obj.push_back(Pair("keypoololdest", snapshot->nKeyPoolOldest));
+    obj.push_back(Pair("keypoolsize",   (int)snapshot->nKeyPoolSize));
+    if (snapshot->fCrypted)
+    {
+        LOCK(cs_nWalletUnlockTime);
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+    }
     return obj;
 }
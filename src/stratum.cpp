@@ -0,0 +1,738 @@
+// Copyright (c) 2015 The Bata developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "main.h"
+#include "miner.h"
+#include "netbase.h"
+#include "primitives/block.h"
+#include "rpcserver.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "sync.h"
+#include "timedata.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <map>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace json_spirit;
+using namespace std;
+
+namespace asio = boost::asio;
+using boost::asio::ip::tcp;
+
+/** Longest request line accepted before the connection is dropped */
+static const size_t MAX_STRATUM_LINE = 16 * 1024;
+/** Replies queued for a client that does not read before it is dropped */
+static const size_t MAX_STRATUM_SEND_QUEUE = 64;
+/** Jobs on the current tip kept for shares that arrive late */
+static const unsigned int MAX_STRATUM_JOBS = 16;
+/** Minimum seconds between jobs for template improvements on the same tip */
+static const int64_t STRATUM_JOB_INTERVAL = 5;
+/** Seconds after which a job is replaced even if the template did not change */
+static const int64_t STRATUM_JOB_REFRESH = 60;
+
+class CStratumSession;
+
+static asio::io_service* stratum_io_service = NULL;
+static std::vector<boost::shared_ptr<tcp::acceptor> > stratum_acceptors;
+static boost::thread_group* stratum_worker_group = NULL;
+static std::vector<CSubNet> stratum_allow_subnets;
+static CScript scriptStratumPayout;
+static double dStratumDifficulty = DEFAULT_STRATUM_DIFFICULTY;
+static uint256 hashStratumShareTarget;
+
+static CCriticalSection cs_stratum;
+static std::map<unsigned int, boost::shared_ptr<CStratumJob> > mapStratumJobs;
+static boost::shared_ptr<CStratumJob> pStratumJob;
+static std::vector<boost::weak_ptr<CStratumSession> > vStratumSessions;
+static unsigned int nStratumJobId = 0;
+static unsigned int nStratumExtraNonce1 = 0;
+
+uint256 GetStratumShareTarget(double dDifficulty)
+{
+    // Three decimals are kept so CPU miners on test networks can go below 1
+    uint64_t nScaled = 1;
+    if (dDifficulty * 1000 >= (double)std::numeric_limits<uint64_t>::max())
+        nScaled = std::numeric_limits<uint64_t>::max();
+    else if (dDifficulty * 1000 > 1)
+        nScaled = (uint64_t)(dDifficulty * 1000);
+
+    uint256 hashTarget = uint256(0xffff) << 224;
+    hashTarget *= 1000;
+    hashTarget /= uint256(nScaled);
+    return hashTarget;
+}
+
+std::string StratumPrevHash(const uint256& hash)
+{
+    std::vector<unsigned char> v(hash.begin(), hash.end());
+    for (size_t i = 0; i < v.size(); i += 4)
+        std::reverse(v.begin() + i, v.begin() + i + 4);
+    return HexStr(v);
+}
+
+boost::shared_ptr<CStratumJob> BuildStratumJob(boost::shared_ptr<const CBlockTemplate> ptemplate, const CBlockHeader& header, int nHeight, const CScript& scriptPayout)
+{
+    boost::shared_ptr<CStratumJob> job(new CStratumJob());
+    job->nId = 0;
+    job->ptemplate = ptemplate;
+    job->header = header;
+
+    // Pay to -stratumaddress, leaving room for both extranonces right after the height
+    CMutableTransaction txCoinbase(ptemplate->block.vtx[0]);
+    CScript scriptHeight = CScript() << nHeight;
+    std::vector<unsigned char> vPlaceholder(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    txCoinbase.vin[0].scriptSig = (CScript(scriptHeight) << vPlaceholder) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+    txCoinbase.vout[0].scriptPubKey = scriptPayout;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CTransaction(txCoinbase);
+    std::vector<unsigned char> vCoinbase(ss.begin(), ss.end());
+
+    // nVersion, input count, prevout, script length, height, placeholder push opcode
+    size_t nOffset = 4 + 1 + 36 + GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + scriptHeight.size() + 1;
+    assert(nOffset + vPlaceholder.size() <= vCoinbase.size());
+    job->vCoinbase1.assign(vCoinbase.begin(), vCoinbase.begin() + nOffset);
+    job->vCoinbase2.assign(vCoinbase.begin() + nOffset + vPlaceholder.size(), vCoinbase.end());
+
+    // The branch of the coinbase does not depend on the coinbase itself
+    CBlock block(ptemplate->block);
+    block.BuildMerkleTree();
+    job->vMerkleBranch = block.GetMerkleBranch(0);
+    return job;
+}
+
+void AddStratumJob(boost::shared_ptr<CStratumJob> job)
+{
+    LOCK(cs_stratum);
+    job->nId = ++nStratumJobId;
+    // Jobs on an older tip can only produce stale shares
+    if (pStratumJob && pStratumJob->header.hashPrevBlock != job->header.hashPrevBlock)
+        mapStratumJobs.clear();
+    mapStratumJobs[job->nId] = job;
+    while (mapStratumJobs.size() > MAX_STRATUM_JOBS)
+        mapStratumJobs.erase(mapStratumJobs.begin());
+    pStratumJob = job;
+}
+
+boost::shared_ptr<CStratumJob> FindStratumJob(unsigned int nId)
+{
+    LOCK(cs_stratum);
+    std::map<unsigned int, boost::shared_ptr<CStratumJob> >::iterator it = mapStratumJobs.find(nId);
+    if (it == mapStratumJobs.end())
+        return boost::shared_ptr<CStratumJob>();
+    return it->second;
+}
+
+CBlockHeader GetStratumShareHeader(const CStratumJob& job, const std::vector<unsigned char>& vExtraNonce1, const std::vector<unsigned char>& vExtraNonce2, uint32_t nTime, uint32_t nNonce, CTransaction& txCoinbase)
+{
+    std::vector<unsigned char> vCoinbase(job.vCoinbase1);
+    vCoinbase.insert(vCoinbase.end(), vExtraNonce1.begin(), vExtraNonce1.end());
+    vCoinbase.insert(vCoinbase.end(), vExtraNonce2.begin(), vExtraNonce2.end());
+    vCoinbase.insert(vCoinbase.end(), job.vCoinbase2.begin(), job.vCoinbase2.end());
+    CDataStream ss(vCoinbase, SER_NETWORK, PROTOCOL_VERSION);
+    ss >> txCoinbase;
+
+    CBlockHeader header = job.header;
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), job.vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+    return header;
+}
+
+StratumShareResult CheckStratumShare(CStratumJob& job, const CBlockHeader& header, const uint256& hashShareTarget)
+{
+    // The scrypt hash is what makes shares expensive; this runs on one
+    // of the -stratumthreads and only blocks this miner's strand
+    uint256 hashPoW = header.GetPoWHash();
+    uint256 hashTarget;
+    hashTarget.SetCompact(header.nBits);
+    if (hashPoW > hashShareTarget && hashPoW > hashTarget)
+        return STRATUM_SHARE_LOW_DIFFICULTY;
+
+    // Only remembered once it passed, so rejected shares cannot fill the set
+    {
+        LOCK(cs_stratum);
+        if (!job.setShares.insert(header.GetHash()).second)
+            return STRATUM_SHARE_DUPLICATE;
+    }
+    return hashPoW > hashTarget ? STRATUM_SHARE_VALID : STRATUM_SHARE_BLOCK;
+}
+
+/** Build a job from the current template; NULL while the chain is still syncing */
+static boost::shared_ptr<CStratumJob> CreateStratumJob()
+{
+    boost::shared_ptr<const CBlockTemplate> ptemplate;
+    CBlockHeader header;
+    int nHeight;
+    {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            return boost::shared_ptr<CStratumJob>();
+        unsigned int nSequence;
+        ptemplate = GetBlockTemplate(nSequence);
+        if (!ptemplate)
+            return boost::shared_ptr<CStratumJob>();
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        header = ptemplate->block.GetBlockHeader();
+        UpdateTime(&header, pindexPrev);
+        nHeight = pindexPrev->nHeight + 1;
+    }
+
+    boost::shared_ptr<CStratumJob> job = BuildStratumJob(ptemplate, header, nHeight, scriptStratumPayout);
+    AddStratumJob(job);
+    LogPrint("stratum", "StratumServer: job %x at height %d with %u transactions\n", job->nId, nHeight, ptemplate->block.vtx.size());
+    return job;
+}
+
+class CStratumError
+{
+public:
+    int nCode;
+    std::string strMessage;
+    CStratumError(int nCodeIn, const std::string& strMessageIn) : nCode(nCodeIn), strMessage(strMessageIn) {}
+};
+
+/**
+ * One miner connection. Everything touching the socket or the session
+ * state runs on the session's strand, so a connection is served by one
+ * thread at a time while shares of different miners are checked in parallel.
+ */
+class CStratumSession : public boost::enable_shared_from_this<CStratumSession>
+{
+public:
+    tcp::socket socket;
+
+    CStratumSession(asio::io_service& io_service) :
+        socket(io_service), strand(io_service), buf(MAX_STRATUM_LINE),
+        fSubscribed(false), fAuthorized(false), fSentDifficulty(false)
+    {
+        LOCK(cs_stratum);
+        unsigned int nExtraNonce1 = ++nStratumExtraNonce1;
+        for (unsigned int i = 0; i < STRATUM_EXTRANONCE1_SIZE; i++)
+            vExtraNonce1.push_back((nExtraNonce1 >> (8 * (STRATUM_EXTRANONCE1_SIZE - 1 - i))) & 0xff);
+    }
+
+    void Start(const std::string& strPeerIn)
+    {
+        strPeer = strPeerIn;
+        {
+            LOCK(cs_stratum);
+            vStratumSessions.push_back(shared_from_this());
+        }
+        LogPrint("stratum", "StratumServer: connection from %s\n", strPeer);
+        strand.dispatch(boost::bind(&CStratumSession::Read, shared_from_this()));
+    }
+
+    /** Queue a job for this miner; safe from any thread */
+    void PostJob(boost::shared_ptr<CStratumJob> job, bool fClean)
+    {
+        strand.post(boost::bind(&CStratumSession::SendJob, shared_from_this(), job, fClean));
+    }
+
+    void PostClose()
+    {
+        strand.post(boost::bind(&CStratumSession::Close, shared_from_this()));
+    }
+
+private:
+    asio::io_service::strand strand;
+    asio::streambuf buf;
+    std::deque<std::string> vSend;
+    std::vector<unsigned char> vExtraNonce1;
+    std::string strPeer;
+    std::string strWorker;
+    bool fSubscribed;
+    bool fAuthorized;
+    bool fSentDifficulty;
+
+    void Read()
+    {
+        asio::async_read_until(socket, buf, '\n',
+            strand.wrap(boost::bind(&CStratumSession::HandleRead, shared_from_this(),
+                                    asio::placeholders::error, asio::placeholders::bytes_transferred)));
+    }
+
+    void HandleRead(const boost::system::error_code& error, size_t nBytes)
+    {
+        if (error) {
+            Close();
+            return;
+        }
+        std::istream is(&buf);
+        std::string strLine;
+        std::getline(is, strLine);
+        if (!ProcessLine(strLine)) {
+            LogPrint("stratum", "StratumServer: malformed request from %s\n", strPeer);
+            Close();
+            return;
+        }
+        Read();
+    }
+
+    void Close()
+    {
+        boost::system::error_code ec;
+        if (socket.is_open()) {
+            LogPrint("stratum", "StratumServer: disconnecting %s\n", strPeer);
+            socket.close(ec);
+        }
+    }
+
+    void Send(const Object& msg)
+    {
+        if (!socket.is_open())
+            return;
+        if (vSend.size() >= MAX_STRATUM_SEND_QUEUE) {
+            Close();
+            return;
+        }
+        vSend.push_back(write_string(Value(msg), false) + "\n");
+        if (vSend.size() == 1)
+            Write();
+    }
+
+    void Write()
+    {
+        asio::async_write(socket, asio::buffer(vSend.front()),
+            strand.wrap(boost::bind(&CStratumSession::HandleWrite, shared_from_this(), asio::placeholders::error)));
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        if (error) {
+            Close();
+            return;
+        }
+        if (vSend.empty())
+            return;
+        vSend.pop_front();
+        if (!vSend.empty())
+            Write();
+    }
+
+    void SendJob(boost::shared_ptr<CStratumJob> job, bool fClean)
+    {
+        if (!fSubscribed || !job)
+            return;
+
+        if (!fSentDifficulty) {
+            Array params;
+            params.push_back(dStratumDifficulty);
+            Object msg;
+            msg.push_back(Pair("id", Value::null));
+            msg.push_back(Pair("method", "mining.set_difficulty"));
+            msg.push_back(Pair("params", params));
+            Send(msg);
+            fSentDifficulty = true;
+        }
+
+        Array branch;
+        BOOST_FOREACH(const uint256& hash, job->vMerkleBranch)
+            branch.push_back(HexStr(hash.begin(), hash.end()));
+
+        Array params;
+        params.push_back(strprintf("%x", job->nId));
+        params.push_back(StratumPrevHash(job->header.hashPrevBlock));
+        params.push_back(HexStr(job->vCoinbase1));
+        params.push_back(HexStr(job->vCoinbase2));
+        params.push_back(branch);
+        params.push_back(strprintf("%08x", job->header.nVersion));
+        params.push_back(strprintf("%08x", job->header.nBits));
+        params.push_back(strprintf("%08x", job->header.nTime));
+        params.push_back(fClean);
+        Object msg;
+        msg.push_back(Pair("id", Value::null));
+        msg.push_back(Pair("method", "mining.notify"));
+        msg.push_back(Pair("params", params));
+        Send(msg);
+    }
+
+    /** Returns false if the line is not a stratum request at all */
+    bool ProcessLine(std::string strLine)
+    {
+        boost::trim(strLine);
+        if (strLine.empty())
+            return true;
+
+        Value valRequest;
+        if (!read_string(strLine, valRequest) || valRequest.type() != obj_type)
+            return false;
+        const Object& request = valRequest.get_obj();
+        const Value& valMethod = find_value(request, "method");
+        if (valMethod.type() != str_type)
+            return false;
+        const Value& valParams = find_value(request, "params");
+        Array params;
+        if (valParams.type() == array_type)
+            params = valParams.get_array();
+
+        bool fSubscribing = !fSubscribed && valMethod.get_str() == "mining.subscribe";
+
+        Object reply;
+        reply.push_back(Pair("id", find_value(request, "id")));
+        try {
+            Value result = HandleRequest(valMethod.get_str(), params);
+            reply.push_back(Pair("result", result));
+            reply.push_back(Pair("error", Value::null));
+        } catch (const CStratumError& e) {
+            Array error;
+            error.push_back(e.nCode);
+            error.push_back(e.strMessage);
+            error.push_back(Value::null);
+            reply.push_back(Pair("result", Value::null));
+            reply.push_back(Pair("error", error));
+        } catch (const std::exception& e) {
+            // Wrong parameter types
+            Array error;
+            error.push_back(20);
+            error.push_back(std::string(e.what()));
+            error.push_back(Value::null);
+            reply.push_back(Pair("result", Value::null));
+            reply.push_back(Pair("error", error));
+        }
+        Send(reply);
+
+        // Work follows the subscription reply
+        if (fSubscribing && fSubscribed) {
+            boost::shared_ptr<CStratumJob> job;
+            {
+                LOCK(cs_stratum);
+                job = pStratumJob;
+            }
+            if (!job)
+                job = CreateStratumJob();
+            SendJob(job, true);
+        }
+        return true;
+    }
+
+    Value HandleRequest(const std::string& strMethod, const Array& params)
+    {
+        if (strMethod == "mining.subscribe") {
+            fSubscribed = true;
+            Array notify;
+            notify.push_back("mining.notify");
+            notify.push_back(HexStr(vExtraNonce1));
+            Array subscriptions;
+            subscriptions.push_back(notify);
+            Array result;
+            result.push_back(subscriptions);
+            result.push_back(HexStr(vExtraNonce1));
+            result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+            return result;
+        }
+        if (strMethod == "mining.authorize") {
+            if (params.size() < 1)
+                throw CStratumError(20, "Missing worker name");
+            strWorker = params[0].get_str();
+            fAuthorized = true;
+            LogPrint("stratum", "StratumServer: %s authorized as %s\n", strPeer, strWorker);
+            return true;
+        }
+        if (strMethod == "mining.submit")
+            return SubmitShare(params);
+        if (strMethod == "mining.extranonce.subscribe")
+            return false;
+        throw CStratumError(20, "Method not found");
+    }
+
+    Value SubmitShare(const Array& params)
+    {
+        if (!fSubscribed)
+            throw CStratumError(25, "Not subscribed");
+        if (!fAuthorized)
+            throw CStratumError(24, "Unauthorized worker");
+        if (params.size() < 5)
+            throw CStratumError(20, "Invalid parameters");
+
+        const std::string& strJobId = params[1].get_str();
+        const std::string& strExtraNonce2 = params[2].get_str();
+        const std::string& strTime = params[3].get_str();
+        const std::string& strNonce = params[4].get_str();
+        if (strExtraNonce2.size() != 2 * STRATUM_EXTRANONCE2_SIZE || !IsHex(strExtraNonce2) ||
+            strTime.size() != 8 || !IsHex(strTime) || strNonce.size() != 8 || !IsHex(strNonce))
+            throw CStratumError(20, "Invalid parameters");
+
+        // Jobs of an older tip are gone
+        boost::shared_ptr<CStratumJob> job = FindStratumJob(strtoul(strJobId.c_str(), NULL, 16));
+        if (!job)
+            throw CStratumError(21, "Job not found");
+
+        CTransaction txCoinbase;
+        CBlockHeader header = GetStratumShareHeader(*job, vExtraNonce1, ParseHex(strExtraNonce2),
+                                                    strtoul(strTime.c_str(), NULL, 16), strtoul(strNonce.c_str(), NULL, 16), txCoinbase);
+        if (header.nTime < job->header.nTime || header.nTime > GetAdjustedTime() + 2 * 60 * 60)
+            throw CStratumError(20, "Time out of range");
+
+        switch (CheckStratumShare(*job, header, hashStratumShareTarget)) {
+        case STRATUM_SHARE_LOW_DIFFICULTY:
+            throw CStratumError(23, "Low difficulty share");
+        case STRATUM_SHARE_DUPLICATE:
+            throw CStratumError(22, "Duplicate share");
+        case STRATUM_SHARE_VALID:
+            return true;
+        case STRATUM_SHARE_BLOCK:
+            break;
+        }
+
+        CBlock block(header);
+        block.vtx = job->ptemplate->block.vtx;
+        block.vtx[0] = txCoinbase;
+        LogPrintf("StratumServer: block %s found by %s (%s)\n", block.GetHash().ToString(), strWorker, strPeer);
+
+        CValidationState state;
+        if (!ProcessNewBlock(state, NULL, &block) || !state.IsValid())
+            throw CStratumError(20, "Block rejected: " + state.GetRejectReason());
+        return true;
+    }
+};
+
+/** Hand a job to every subscribed miner; returns false if none are connected */
+static bool BroadcastStratumJob(boost::shared_ptr<CStratumJob> job, bool fClean)
+{
+    std::vector<boost::shared_ptr<CStratumSession> > vSessions;
+    {
+        LOCK(cs_stratum);
+        std::vector<boost::weak_ptr<CStratumSession> >::iterator it = vStratumSessions.begin();
+        while (it != vStratumSessions.end()) {
+            boost::shared_ptr<CStratumSession> session = it->lock();
+            if (session) {
+                vSessions.push_back(session);
+                ++it;
+            } else {
+                it = vStratumSessions.erase(it);
+            }
+        }
+    }
+    if (job) {
+        BOOST_FOREACH(boost::shared_ptr<CStratumSession>& session, vSessions)
+            session->PostJob(job, fClean);
+    }
+    return !vSessions.empty();
+}
+
+static bool StratumClientAllowed(const asio::ip::address& address)
+{
+    CNetAddr netaddr = BoostAsioToCNetAddr(address);
+    BOOST_FOREACH(const CSubNet& subnet, stratum_allow_subnets)
+        if (subnet.Match(netaddr))
+            return true;
+    return false;
+}
+
+static void StratumAcceptHandler(boost::shared_ptr<tcp::acceptor> acceptor,
+                                 boost::shared_ptr<CStratumSession> session,
+                                 const boost::system::error_code& error);
+
+static void StratumListen(boost::shared_ptr<tcp::acceptor> acceptor)
+{
+    boost::shared_ptr<CStratumSession> session(new CStratumSession(*stratum_io_service));
+    acceptor->async_accept(session->socket,
+        boost::bind(&StratumAcceptHandler, acceptor, session, asio::placeholders::error));
+}
+
+static void StratumAcceptHandler(boost::shared_ptr<tcp::acceptor> acceptor,
+                                 boost::shared_ptr<CStratumSession> session,
+                                 const boost::system::error_code& error)
+{
+    // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
+    if (error != asio::error::operation_aborted && acceptor->is_open())
+        StratumListen(acceptor);
+    if (error)
+        return;
+
+    boost::system::error_code ec;
+    tcp::endpoint peer = session->socket.remote_endpoint(ec);
+    if (ec || !StratumClientAllowed(peer.address())) {
+        if (!ec)
+            LogPrint("stratum", "StratumServer: refused connection from %s\n", peer.address().to_string());
+        session->socket.close(ec);
+        return;
+    }
+    session->Start(peer.address().to_string());
+}
+
+void static ThreadStratumNotify()
+{
+    RenameThread("bata-stratum");
+
+    uint256 hashPrev;
+    unsigned int nSequence = 0;
+    int64_t nLastJob = 0;
+    while (true) {
+        bool fTemplateChanged;
+        {
+            // Woken at once by a new template (rebuilt on a new tip), otherwise twice a second
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            cvBlockTemplate.timed_wait(lock, boost::posix_time::milliseconds(500));
+            fTemplateChanged = GetBlockTemplateSequence() != nSequence;
+            nSequence = GetBlockTemplateSequence();
+        }
+        boost::this_thread::interruption_point();
+
+        // Without miners the template maintainer is left to go idle
+        if (!BroadcastStratumJob(boost::shared_ptr<CStratumJob>(), false)) {
+            LOCK(cs_stratum);
+            mapStratumJobs.clear();
+            pStratumJob.reset();
+            hashPrev = 0;
+            continue;
+        }
+
+        bool fNewTip;
+        {
+            LOCK(cs_main);
+            fNewTip = chainActive.Tip()->GetBlockHash() != hashPrev;
+        }
+        int64_t nNow = GetTime();
+        if (!fNewTip && !(fTemplateChanged && nNow - nLastJob >= STRATUM_JOB_INTERVAL) &&
+            nNow - nLastJob < STRATUM_JOB_REFRESH)
+            continue;
+
+        try {
+            boost::shared_ptr<CStratumJob> job = CreateStratumJob();
+            if (!job)
+                continue;
+            bool fClean = job->header.hashPrevBlock != hashPrev;
+            hashPrev = job->header.hashPrevBlock;
+            nLastJob = nNow;
+            BroadcastStratumJob(job, fClean);
+        } catch (const std::runtime_error& e) {
+            // Retried on the next pass
+            LogPrintf("StratumServer: runtime error: %s\n", e.what());
+        }
+    }
+}
+
+bool StartStratumServer(std::string& strError)
+{
+    if (!GetBoolArg("-stratum", false))
+        return true;
+
+    CBitcoinAddress address(GetArg("-stratumaddress", ""));
+    if (!address.IsValid()) {
+        strError = _("-stratum requires a valid -stratumaddress to pay found blocks to");
+        return false;
+    }
+    scriptStratumPayout = GetScriptForDestination(address.Get());
+
+    dStratumDifficulty = atof(GetArg("-stratumdifficulty", strprintf("%u", DEFAULT_STRATUM_DIFFICULTY)).c_str());
+    if (dStratumDifficulty <= 0) {
+        strError = strprintf(_("Invalid -stratumdifficulty: '%s'"), mapArgs["-stratumdifficulty"]);
+        return false;
+    }
+    hashStratumShareTarget = GetStratumShareTarget(dStratumDifficulty);
+
+    stratum_allow_subnets.clear();
+    stratum_allow_subnets.push_back(CSubNet("127.0.0.0/8")); // always allow IPv4 local subnet
+    stratum_allow_subnets.push_back(CSubNet("::1")); // always allow IPv6 localhost
+    if (mapMultiArgs.count("-stratumallowip")) {
+        BOOST_FOREACH(const std::string& strAllow, mapMultiArgs["-stratumallowip"]) {
+            CSubNet subnet(strAllow);
+            if (!subnet.IsValid()) {
+                strError = strprintf(_("Invalid -stratumallowip subnet specification: %s"), strAllow);
+                return false;
+            }
+            stratum_allow_subnets.push_back(subnet);
+        }
+    }
+
+    // Only listen beyond loopback when other hosts are allowed in
+    std::vector<tcp::endpoint> vEndpoints;
+    int nPort = GetArg("-stratumport", DEFAULT_STRATUM_PORT);
+    if (mapArgs.count("-stratumallowip")) {
+        vEndpoints.push_back(tcp::endpoint(asio::ip::address_v6::any(), nPort));
+        vEndpoints.push_back(tcp::endpoint(asio::ip::address_v4::any(), nPort));
+    } else {
+        vEndpoints.push_back(tcp::endpoint(asio::ip::address_v6::loopback(), nPort));
+        vEndpoints.push_back(tcp::endpoint(asio::ip::address_v4::loopback(), nPort));
+    }
+
+    assert(stratum_io_service == NULL);
+    stratum_io_service = new asio::io_service();
+
+    BOOST_FOREACH(const tcp::endpoint& endpoint, vEndpoints) {
+        try {
+            boost::shared_ptr<tcp::acceptor> acceptor(new tcp::acceptor(*stratum_io_service));
+            acceptor->open(endpoint.protocol());
+            acceptor->set_option(tcp::acceptor::reuse_address(true));
+            // Keep the IPv6 socket from also claiming the IPv4 port
+            boost::system::error_code v6_only_error;
+            acceptor->set_option(asio::ip::v6_only(true), v6_only_error);
+            acceptor->bind(endpoint);
+            acceptor->listen(asio::socket_base::max_connections);
+            StratumListen(acceptor);
+            stratum_acceptors.push_back(acceptor);
+            LogPrintf("Stratum server listening on %s port %d\n", endpoint.address().to_string(), nPort);
+        } catch (const boost::system::system_error& e) {
+            LogPrintf("ERROR: Binding stratum on address %s port %i failed: %s\n", endpoint.address().to_string(), nPort, e.what());
+        }
+    }
+    if (stratum_acceptors.empty()) {
+        delete stratum_io_service;
+        stratum_io_service = NULL;
+        strError = strprintf(_("Unable to bind the stratum server to port %d"), nPort);
+        return false;
+    }
+
+    stratum_worker_group = new boost::thread_group();
+    int nThreads = std::max((int)GetArg("-stratumthreads", DEFAULT_STRATUM_THREADS), 1);
+    for (int i = 0; i < nThreads; i++)
+        stratum_worker_group->create_thread(boost::bind(&asio::io_service::run, stratum_io_service));
+    stratum_worker_group->create_thread(&ThreadStratumNotify);
+    return true;
+}
+
+void StopStratumServer()
+{
+    if (stratum_io_service == NULL)
+        return;
+
+    boost::system::error_code ec;
+    BOOST_FOREACH(const boost::shared_ptr<tcp::acceptor>& acceptor, stratum_acceptors)
+        acceptor->close(ec);
+    stratum_acceptors.clear();
+    {
+        LOCK(cs_stratum);
+        BOOST_FOREACH(const boost::weak_ptr<CStratumSession>& weak, vStratumSessions) {
+            boost::shared_ptr<CStratumSession> session = weak.lock();
+            if (session)
+                session->PostClose();
+        }
+    }
+
+    stratum_worker_group->interrupt_all();
+    stratum_io_service->stop();
+    stratum_worker_group->join_all();
+    delete stratum_worker_group; stratum_worker_group = NULL;
+    delete stratum_io_service; stratum_io_service = NULL;
+
+    LOCK(cs_stratum);
+    vStratumSessions.clear();
+    mapStratumJobs.clear();
+    pStratumJob.reset();
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2015 The Bata developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include "primitives/block.h"
+#include "uint256.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+class CScript;
+struct CBlockTemplate;
+
+/** Default port for -stratumport */
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+/** Default share difficulty for -stratumdifficulty */
+static const unsigned int DEFAULT_STRATUM_DIFFICULTY = 256;
+/** Default number of threads checking shares for -stratumthreads */
+static const int DEFAULT_STRATUM_THREADS = 2;
+/** Coinbase extranonce bytes set by the server, unique per connection */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+/** Coinbase extranonce bytes left to the miner */
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+
+/** Work handed to miners: a block template with the coinbase split around the extranonces */
+struct CStratumJob
+{
+    unsigned int nId;
+    boost::shared_ptr<const CBlockTemplate> ptemplate;
+    CBlockHeader header;
+    std::vector<unsigned char> vCoinbase1;
+    std::vector<unsigned char> vCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+
+    // Guarded by cs_stratum
+    std::set<uint256> setShares;
+};
+
+enum StratumShareResult
+{
+    STRATUM_SHARE_VALID,
+    STRATUM_SHARE_BLOCK,
+    STRATUM_SHARE_DUPLICATE,
+    STRATUM_SHARE_LOW_DIFFICULTY,
+};
+
+/**
+ * Start the stratum work server if -stratum is set. Jobs are built from
+ * the shared block template and pushed to miners on new tips and template
+ * improvements; solved blocks are handed to ProcessNewBlock.
+ * Returns false and sets strError on a configuration error.
+ */
+bool StartStratumServer(std::string& strError);
+void StopStratumServer();
+
+/** Share target for a stratum difficulty, where 1 is 0x0000ffff << 224 as for scrypt pools */
+uint256 GetStratumShareTarget(double dDifficulty);
+
+/** Previous block hash as stratum sends it: internal byte order with each 32-bit word swapped */
+std::string StratumPrevHash(const uint256& hash);
+
+/** Cut a job paying scriptPayout out of a template for height nHeight; its id is set by AddStratumJob */
+boost::shared_ptr<CStratumJob> BuildStratumJob(boost::shared_ptr<const CBlockTemplate> ptemplate, const CBlockHeader& header, int nHeight, const CScript& scriptPayout);
+/** Make job the current one, dropping the jobs of an older tip */
+void AddStratumJob(boost::shared_ptr<CStratumJob> job);
+/** Job a share refers to; NULL if unknown or stale */
+boost::shared_ptr<CStratumJob> FindStratumJob(unsigned int nId);
+
+/** Header (and coinbase) a mining.submit for job describes */
+CBlockHeader GetStratumShareHeader(const CStratumJob& job, const std::vector<unsigned char>& vExtraNonce1, const std::vector<unsigned char>& vExtraNonce2, uint32_t nTime, uint32_t nNonce, CTransaction& txCoinbase);
+/** Check the proof of work of a share and remember it if it passes */
+StratumShareResult CheckStratumShare(CStratumJob& job, const CBlockHeader& header, const uint256& hashShareTarget);
+
+#endif // BITCOIN_STRATUM_H
@@ -134,6 +134,15 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     BOOST_CHECK(results[4].strComment.empty());
     BOOST_CHECK(results[5].nTime == 1333333334);
     BOOST_CHECK(6 == vpwtx[1]->nOrderPos);
+
+    // The activity log follows the new order
+    BOOST_CHECK(pwalletMain->wtxOrdered.size() == pwalletMain->mapWallet.size() + pwalletMain->laccentries.size());
+    BOOST_FOREACH(const CWallet::TxItems::value_type& item, pwalletMain->wtxOrdered)
+    {
+        const CWalletTx* pwtx = item.second.first;
+        const CAccountingEntry* pacentry = item.second.second;
+        BOOST_CHECK(item.first == (pwtx ? pwtx->nOrderPos : pacentry->nOrderPos));
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
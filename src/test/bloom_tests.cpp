@@ -8,6 +8,8 @@
 #include "clientversion.h"
 #include "key.h"
 #include "merkleblock.h"
+#include "net.h"
+#include "random.h"
 #include "serialize.h"
 #include "streams.h"
 #include "uint256.h"
@@ -459,4 +461,115 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+static std::vector<unsigned char> RandomData()
+{
+    uint256 r = GetRandHash();
+    return std::vector<unsigned char>(r.begin(), r.end());
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CRollingBloomFilter rb1(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE=399;
+    std::vector<unsigned char> data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomData();
+        rb1.insert(data[i]);
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = 299; i < DATASIZE; i++) {
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // false positive rate is 1%, so we should get about 100 hits if
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when the current generation is just about to be rolled over.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb1.contains(RandomData()))
+            ++nHits;
+    }
+    // Run test_bata with --log_level=message to see BOOST_TEST_MESSAGEs:
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+
+    // Insanely unlikely to get a fp count outside this range:
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+
+    BOOST_CHECK(rb1.contains(data[DATASIZE-1]));
+    rb1.clear();
+    BOOST_CHECK(!rb1.contains(data[DATASIZE-1]));
+
+    // Now roll through data, make sure last 100 entries
+    // are always remembered:
+    for (int i = 0; i < DATASIZE; i++) {
+        if (i >= 100)
+            BOOST_CHECK(rb1.contains(data[i-100]));
+        rb1.insert(data[i]);
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // Insert 999 more random entries:
+    for (int i = 0; i < 999; i++) {
+        std::vector<unsigned char> d = RandomData();
+        rb1.insert(d);
+        BOOST_CHECK(rb1.contains(d));
+    }
+    // Sanity check to make sure the filter isn't just filling up:
+    nHits = 0;
+    for (int i = 0; i < DATASIZE; i++) {
+        if (rb1.contains(data[i]))
+            ++nHits;
+    }
+    // Expect about 5 false positives, more than 100 means
+    // something is definitely broken.
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~5 expected)");
+    BOOST_CHECK(nHits < 100);
+
+    // last-1000-entry, 0.1% false positive:
+    CRollingBloomFilter rb2(1000, 0.001);
+    for (int i = 0; i < DATASIZE; i++) {
+        rb2.insert(data[i]);
+    }
+    // ... room for all of them:
+    for (int i = 0; i < DATASIZE; i++) {
+        BOOST_CHECK(rb2.contains(data[i]));
+    }
+}
+
+// False positive rate and memory use of the per-peer filters at their production sizes
+BOOST_AUTO_TEST_CASE(rolling_bloom_peer_filters)
+{
+    CRollingBloomFilter filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001);
+    CRollingBloomFilter addrKnown(ADDR_KNOWN_FILTER_SIZE, 0.001);
+
+    // Tens of kilobytes per peer, independent of what is inserted
+    BOOST_TEST_MESSAGE("filterInventoryKnown uses " << filterInventoryKnown.DynamicMemoryUsage() << " bytes");
+    BOOST_TEST_MESSAGE("addrKnown uses " << addrKnown.DynamicMemoryUsage() << " bytes");
+    BOOST_CHECK(filterInventoryKnown.DynamicMemoryUsage() < 64 * 1024);
+    BOOST_CHECK(addrKnown.DynamicMemoryUsage() < 32 * 1024);
+
+    // Fill to just before a generation rollover, when the filters are fullest
+    for (unsigned int i = 0; i < INVENTORY_KNOWN_FILTER_SIZE * 3 / 2 - 1; i++)
+        filterInventoryKnown.insert(GetRandHash());
+    for (unsigned int i = 0; i < ADDR_KNOWN_FILTER_SIZE * 3 / 2 - 1; i++)
+        addrKnown.insert(RandomData());
+
+    unsigned int nInvHits = 0, nAddrHits = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (filterInventoryKnown.contains(GetRandHash()))
+            ++nInvHits;
+        if (addrKnown.contains(RandomData()))
+            ++nAddrHits;
+    }
+    BOOST_TEST_MESSAGE("filterInventoryKnown got " << nInvHits << " false positives out of 100000 (~0.1 expected)");
+    BOOST_TEST_MESSAGE("addrKnown got " << nAddrHits << " false positives out of 100000 (~100 expected)");
+    BOOST_CHECK(nInvHits < 10);
+    BOOST_CHECK(nAddrHits < 200);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
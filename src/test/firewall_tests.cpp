@@ -0,0 +1,130 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "firewall.h"
+#include "net.h"
+#include "netbase.h"
+#include "util.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+extern bool Firewall_FirstRun;
+extern std::set<int> Firewall_ForkedHeights;
+extern void UpdateFirewallCache();
+extern void ParseFirewallAddress(const string& strEntry, std::set<CNetAddr>& setAddr, std::vector<CSubNet>& vSubNet, std::set<string>& setName);
+extern bool MatchFirewallAddress(const CNode* pnode, const std::set<CNetAddr>& setAddr, const std::vector<CSubNet>& vSubNet, const std::set<string>& setName);
+
+BOOST_AUTO_TEST_SUITE(firewall_tests)
+
+BOOST_AUTO_TEST_CASE(firewall_list_entries)
+{
+    std::set<CNetAddr> setAddr;
+    std::vector<CSubNet> vSubNet;
+    std::set<string> setName;
+
+    ParseFirewallAddress("10.0.0.1", setAddr, vSubNet, setName);
+    ParseFirewallAddress("10.0.0.2:33813", setAddr, vSubNet, setName);
+    ParseFirewallAddress("192.168.0.0/16", setAddr, vSubNet, setName);
+    ParseFirewallAddress("192.168.0.0/99", setAddr, vSubNet, setName);
+    ParseFirewallAddress("seed.example.com", setAddr, vSubNet, setName);
+    ParseFirewallAddress("node.example.com:33813", setAddr, vSubNet, setName);
+    BOOST_CHECK_EQUAL(setAddr.size(), 2U);
+    BOOST_CHECK_EQUAL(vSubNet.size(), 1U);
+    BOOST_CHECK_EQUAL(setName.size(), 2U);
+
+    CNode nodeIP(INVALID_SOCKET, CAddress(CService("10.0.0.2", 33813)), "", true);
+    BOOST_CHECK(MatchFirewallAddress(&nodeIP, setAddr, vSubNet, setName));
+
+    CNode nodeSubNet(INVALID_SOCKET, CAddress(CService("192.168.4.5", 33813)), "", true);
+    BOOST_CHECK(MatchFirewallAddress(&nodeSubNet, setAddr, vSubNet, setName));
+
+    CNode nodeOther(INVALID_SOCKET, CAddress(CService("10.0.0.3", 33813)), "", true);
+    BOOST_CHECK(!MatchFirewallAddress(&nodeOther, setAddr, vSubNet, setName));
+
+    // Host names match the name the peer was connected by, with or without the port
+    CNode nodeSeed(INVALID_SOCKET, CAddress(CService("10.0.0.4", 33813)), "seed.example.com:33813", false);
+    BOOST_CHECK(MatchFirewallAddress(&nodeSeed, setAddr, vSubNet, setName));
+
+    CNode nodeName(INVALID_SOCKET, CAddress(CService("10.0.0.5", 33813)), "node.example.com:33813", false);
+    BOOST_CHECK(MatchFirewallAddress(&nodeName, setAddr, vSubNet, setName));
+
+    CNode nodeOtherName(INVALID_SOCKET, CAddress(CService("10.0.0.6", 33813)), "other.example.com:33813", false);
+    BOOST_CHECK(!MatchFirewallAddress(&nodeOtherName, setAddr, vSubNet, setName));
+}
+
+BOOST_AUTO_TEST_CASE(firewall_traffic_average)
+{
+    bool fEnabled = FIREWALL_ENABLED;
+    bool fDetectBandwidth = FIREWALL_DETECT_BANDWIDTHABUSE;
+    bool fDetectInvalid = FIREWALL_DETECT_INVALIDWALLET;
+    bool fDetectForked = FIREWALL_DETECT_FORKEDWALLET;
+    bool fDetectFlooding = FIREWALL_DETECT_FLOODINGWALLET;
+    bool fFirstRun = Firewall_FirstRun;
+    Firewall_FirstRun = true;
+    FIREWALL_ENABLED = true;
+    FIREWALL_DETECT_BANDWIDTHABUSE = false;
+    FIREWALL_DETECT_INVALIDWALLET = false;
+    FIREWALL_DETECT_FORKEDWALLET = false;
+    FIREWALL_DETECT_FLOODINGWALLET = false;
+
+    int64_t nTime = GetTime();
+    SetMockTime(nTime);
+
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService("10.0.1.1", 33813)), "", true);
+    pnode->nSendBytes = 100;
+    pnode->nRecvBytes = 100;
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+
+    // Six messages, only two of which get examined, weigh like six
+    for (int i = 0; i < 5; i++)
+        BOOST_CHECK(!FireWall(pnode, "test"));
+    BOOST_CHECK_EQUAL(pnode->nTrafficAverage, 0.5);
+    BOOST_CHECK_EQUAL(pnode->nFirewallCalls, 4);
+
+    SetMockTime(nTime + 1);
+    BOOST_CHECK(!FireWall(pnode, "test"));
+    BOOST_CHECK_EQUAL(pnode->nTrafficAverage, 3.0);
+    BOOST_CHECK_EQUAL(pnode->nFirewallCalls, 0);
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.clear();
+    }
+    delete pnode;
+
+    SetMockTime(0);
+    Firewall_FirstRun = fFirstRun;
+    FIREWALL_ENABLED = fEnabled;
+    FIREWALL_DETECT_BANDWIDTHABUSE = fDetectBandwidth;
+    FIREWALL_DETECT_INVALIDWALLET = fDetectInvalid;
+    FIREWALL_DETECT_FORKEDWALLET = fDetectForked;
+    FIREWALL_DETECT_FLOODINGWALLET = fDetectFlooding;
+}
+
+BOOST_AUTO_TEST_CASE(firewall_forked_heights)
+{
+    // The last two entries of the forked height list are not checked
+    FIREWALL_FORKED_NODEHEIGHT[0] = 100;
+    FIREWALL_FORKED_NODEHEIGHT[1] = 200;
+    FIREWALL_FORKED_NODEHEIGHT[2] = 300;
+    LOCK(cs_firewall);
+    UpdateFirewallCache();
+    BOOST_CHECK_EQUAL(Firewall_ForkedHeights.size(), 1U);
+    BOOST_CHECK(Firewall_ForkedHeights.count(100));
+
+    FIREWALL_FORKED_NODEHEIGHT[0] = 0;
+    FIREWALL_FORKED_NODEHEIGHT[1] = 0;
+    FIREWALL_FORKED_NODEHEIGHT[2] = 0;
+    UpdateFirewallCache();
+    BOOST_CHECK(Firewall_ForkedHeights.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -21,4 +21,24 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 8399999990760000ULL);
 }
 
+
+BOOST_AUTO_TEST_CASE(block_download_window)
+{
+    // A peer at the static default keeps the old window
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER), (int)BLOCK_DOWNLOAD_WINDOW);
+
+    // The in-flight limit covers one round trip of blocks, plus two
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(200000, 20000), 12);
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(200000, 200000), 3);
+    // and stays within its bounds
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(1000, 1000000), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInFlightTarget(10000000, 1000), MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE);
+
+    // Faster peers run further ahead, within the window bounds
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(8), (int)BLOCK_DOWNLOAD_WINDOW / 2);
+    BOOST_CHECK(GetBlockDownloadWindow(32) > GetBlockDownloadWindow(16));
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(MIN_BLOCKS_IN_TRANSIT_PER_PEER), (int)MIN_BLOCK_DOWNLOAD_WINDOW);
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE), (int)MAX_BLOCK_DOWNLOAD_WINDOW);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,11 +2,19 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "coins.h"
+#include "key.h"
+#include "keystore.h"
 #include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
+#include <algorithm>
 #include <list>
 
 BOOST_AUTO_TEST_SUITE(mempool_tests)
@@ -99,4 +107,348 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    // Chain parent -> child -> grandchild, plus an unrelated transaction
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL * (4 - i);
+        if (i > 0 && i < 3)
+            tx[i].vin[0].prevout.hash = tx[i-1].GetHash();
+    }
+    tx[3].vin[0].prevout.n = 1;
+
+    CTxMemPool pool(CFeeRate(0));
+    // The parent pays nothing, its child a lot; the unrelated one in between
+    CAmount nFees[4] = { 0, 30000LL, 1000LL, 10000LL };
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFees[i], 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    uint64_t nSize[4];
+    CTxMemPool::txiter it[4];
+    for (int i = 0; i < 4; i++)
+    {
+        it[i] = pool.mapTx.find(tx[i].GetHash());
+        BOOST_CHECK(it[i] != pool.mapTx.end());
+        nSize[i] = it[i]->GetTxSize();
+    }
+
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it[0]->GetSizeWithDescendants(), nSize[0] + nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 31000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetSizeWithAncestors(), nSize[0] + nSize[1] + nSize[2]);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 31000LL);
+    BOOST_CHECK_EQUAL(it[3]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[3]->GetCountWithDescendants(), 1);
+
+    // Relay order puts every parent before its child, unknown txids last
+    std::vector<uint256> vHashes;
+    vHashes.push_back(uint256(1));
+    for (int i = 3; i >= 0; i--)
+        vHashes.push_back(tx[i].GetHash());
+    pool.SortByAncestorCount(vHashes);
+    BOOST_CHECK(std::find(vHashes.begin(), vHashes.end(), tx[0].GetHash()) < std::find(vHashes.begin(), vHashes.end(), tx[1].GetHash()));
+    BOOST_CHECK(std::find(vHashes.begin(), vHashes.end(), tx[1].GetHash()) < std::find(vHashes.begin(), vHashes.end(), tx[2].GetHash()));
+    BOOST_CHECK(vHashes.back() == uint256(1));
+
+    CTxMemPool::setEntries setDescendants;
+    pool.CalculateDescendants(it[1], setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 2);
+    BOOST_CHECK(setDescendants.count(it[2]));
+
+    // The child pays for its parent: the parent+child package is the best
+    // by ancestor fee rate, ahead of the unrelated transaction
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ai = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(ai->GetTx().GetHash() == tx[1].GetHash());
+
+    // Prioritising the parent shows up in every descendant's ancestor fees
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 5000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 36000LL);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 36000LL);
+
+    // Removing the grandchild updates the totals of what is left
+    std::list<CTransaction> removed;
+    pool.remove(tx[2], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it[0]->GetSizeWithDescendants(), nSize[0] + nSize[1]);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 35000LL);
+
+    // Removing the parent non-recursively (it was mined) leaves the child
+    // without ancestors
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx[0]);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[1]->GetSizeWithAncestors(), nSize[1]);
+    BOOST_CHECK_EQUAL(it[1]->GetModFeesWithAncestors(), 30000LL);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // Two unrelated transactions, the second paying twice the fee rate
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    CMutableTransaction tx2 = tx1;
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+
+    SetMockTime(42);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+    uint64_t nUsageOne = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsageOne > 0);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 20000LL, 0, 0.0, 1));
+    BOOST_CHECK(pool.DynamicMemoryUsage() > nUsageOne);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    // Room for everything: nothing goes
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+
+    // One short: the lower fee rate package is evicted and sets the floor
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    unsigned int nSize1 = ::GetSerializeSize(tx1, SER_NETWORK, PROTOCOL_VERSION);
+    CAmount nFloor = CFeeRate(10000LL, nSize1).GetFeePerK() + 1000;
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(nFloor));
+
+    // No decay until a block has been connected
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(nFloor));
+
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    SetMockTime(42 + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(nFloor / 2));
+
+    // Decays to zero once below half the relay fee
+    SetMockTime(42 + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolCoinbaseSpendsTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Three transactions spending coinbases from heights 100, 150 and 200,
+    // the last one with an in-mempool child
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.n = i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+        CTxMemPoolEntry entry(tx[i], 0, 0, 0.0, 1);
+        entry.SetCoinbaseSpendHeight(100 + 50 * i);
+        pool.addUnchecked(tx[i].GetHash(), entry);
+    }
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(tx[2].GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // Everything is mature at this height
+    pool.removeCoinbaseSpends(200 + COINBASE_MATURITY);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // The spend of the height 200 coinbase becomes immature, with its child
+    pool.removeCoinbaseSpends(199 + COINBASE_MATURITY);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+
+    // A deeper reorg takes out both of the others
+    pool.removeCoinbaseSpends(99 + COINBASE_MATURITY);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+/** Pay nValue from output n of txFrom to scriptPubKey, signed with keystore */
+static CMutableTransaction SpendOutput(const CKeyStore& keystore, const CTransaction& txFrom, unsigned int n,
+                                       CAmount nValue, const CScript& scriptPubKey)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txFrom.GetHash(), n);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[0].nValue = nValue;
+    BOOST_CHECK(SignSignature(keystore, txFrom, tx, 0));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolBatchAcceptTest)
+{
+    LOCK(cs_main);
+
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Confirmed outputs to spend
+    CMutableTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vin[0].scriptSig = CScript() << OP_1;
+    txFunding.vout.resize(5);
+    for (unsigned int i = 0; i < txFunding.vout.size(); i++) {
+        txFunding.vout[i].scriptPubKey = scriptPubKey;
+        txFunding.vout[i].nValue = COIN;
+    }
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, chainActive.Height());
+
+    std::vector<CTransaction> vtx;
+    // Parent and child
+    CTransaction txParent = SpendOutput(keystore, txFunding, 0, COIN - 1000000, scriptPubKey);
+    vtx.push_back(txParent);
+    vtx.push_back(SpendOutput(keystore, txParent, 0, COIN - 2000000, scriptPubKey));
+    // Double spend
+    vtx.push_back(SpendOutput(keystore, txFunding, 1, COIN - 1000000, scriptPubKey));
+    vtx.push_back(SpendOutput(keystore, txFunding, 1, COIN - 2000000, scriptPubKey));
+    // Invalid signature, and a child of it
+    CMutableTransaction txBadParent = SpendOutput(keystore, txFunding, 2, COIN - 1000000, scriptPubKey);
+    txBadParent.vout[0].nValue -= 1;
+    vtx.push_back(txBadParent);
+    vtx.push_back(SpendOutput(keystore, txBadParent, 0, COIN - 3000000, scriptPubKey));
+    // Unrelated, checked in the same (failing) script round
+    vtx.push_back(SpendOutput(keystore, txFunding, 3, COIN - 1000000, scriptPubKey));
+
+    CTxMemPool poolBatch(CFeeRate(0));
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted;
+    BOOST_CHECK_EQUAL(AcceptToMemoryPoolBatch(poolBatch, vtx, vState, vAccepted, false), 4U);
+    BOOST_REQUIRE_EQUAL(vAccepted.size(), vtx.size());
+    BOOST_CHECK(vAccepted[0] && vAccepted[1]);
+    BOOST_CHECK(vAccepted[2] && !vAccepted[3]);
+    BOOST_CHECK_EQUAL(vState[3].GetRejectReason(), "bad-txns-inputs-spent");
+    BOOST_CHECK(!vAccepted[4] && !vAccepted[5]);
+    BOOST_CHECK_EQUAL(vState[4].GetRejectReason().find("mandatory-script-verify-flag-failed"), 0U);
+    BOOST_CHECK_EQUAL(vState[5].GetRejectReason(), "bad-txns-parent-rejected");
+    BOOST_CHECK(vAccepted[6]);
+    BOOST_CHECK_EQUAL(poolBatch.size(), 4U);
+    BOOST_CHECK(poolBatch.exists(vtx[1].GetHash()));
+
+    // Same result as one at a time
+    CTxMemPool poolSerial(CFeeRate(0));
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        CValidationState state;
+        bool fMissingInputs;
+        BOOST_CHECK_EQUAL(AcceptToMemoryPool(poolSerial, state, vtx[i], false, &fMissingInputs), vAccepted[i]);
+        if (state.IsInvalid()) {
+            BOOST_CHECK_EQUAL(state.GetRejectCode(), vState[i].GetRejectCode());
+            BOOST_CHECK_EQUAL(state.GetRejectReason(), vState[i].GetRejectReason());
+        }
+    }
+    BOOST_CHECK_EQUAL(poolSerial.size(), poolBatch.size());
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        BOOST_CHECK_EQUAL(poolSerial.exists(vtx[i].GetHash()), poolBatch.exists(vtx[i].GetHash()));
+
+    // A valid double spend of a transaction failing its scripts, and its
+    // child, are accepted as they would be one at a time
+    std::vector<CTransaction> vtxConflict;
+    CMutableTransaction txBadSpend = SpendOutput(keystore, txFunding, 4, COIN - 1000000, scriptPubKey);
+    txBadSpend.vout[0].nValue -= 1;
+    vtxConflict.push_back(txBadSpend);
+    CTransaction txGoodSpend = SpendOutput(keystore, txFunding, 4, COIN - 2000000, scriptPubKey);
+    vtxConflict.push_back(txGoodSpend);
+    vtxConflict.push_back(SpendOutput(keystore, txGoodSpend, 0, COIN - 3000000, scriptPubKey));
+    CTxMemPool poolConflict(CFeeRate(0));
+    BOOST_CHECK_EQUAL(AcceptToMemoryPoolBatch(poolConflict, vtxConflict, vState, vAccepted, false), 2U);
+    BOOST_REQUIRE_EQUAL(vAccepted.size(), vtxConflict.size());
+    BOOST_CHECK(!vAccepted[0]);
+    BOOST_CHECK_EQUAL(vState[0].GetRejectReason().find("mandatory-script-verify-flag-failed"), 0U);
+    BOOST_CHECK(vAccepted[1] && vAccepted[2]);
+    BOOST_CHECK(vState[1].IsValid() && vState[2].IsValid());
+    BOOST_CHECK(poolConflict.exists(vtxConflict[1].GetHash()));
+    BOOST_CHECK(poolConflict.exists(vtxConflict[2].GetHash()));
+
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->Clear();
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDumpLoadTest)
+{
+    LOCK(cs_main);
+
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CMutableTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vin[0].scriptSig = CScript() << OP_1;
+    txFunding.vout.resize(2);
+    for (unsigned int i = 0; i < txFunding.vout.size(); i++) {
+        txFunding.vout[i].scriptPubKey = scriptPubKey;
+        txFunding.vout[i].nValue = COIN;
+    }
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, chainActive.Height());
+
+    std::vector<CTransaction> vtx;
+    CTransaction txParent = SpendOutput(keystore, txFunding, 0, COIN - 1000000, scriptPubKey);
+    vtx.push_back(txParent);
+    vtx.push_back(SpendOutput(keystore, txParent, 0, COIN - 2000000, scriptPubKey));
+    vtx.push_back(SpendOutput(keystore, txFunding, 1, COIN - 1000000, scriptPubKey));
+    std::vector<int64_t> vTime;
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        CValidationState state;
+        BOOST_REQUIRE(AcceptToMemoryPoolWithTime(mempool, state, vtx[i], false, NULL, 1000 + i));
+        vTime.push_back(1000 + i);
+    }
+    mempool.PrioritiseTransaction(vtx[2].GetHash(), vtx[2].GetHash().ToString(), 0, 12345);
+    // A delta for a transaction the pool does not have is kept too
+    uint256 hashAbsent = GetRandHash();
+    mempool.PrioritiseTransaction(hashAbsent, hashAbsent.ToString(), 1.5, 54321);
+
+    BOOST_CHECK(DumpMempool());
+    mempool.clear();
+    mempool.mapDeltas.clear();
+
+    // Children are written after their parents, so all of them come back
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        CTxMemPool::txiter it = mempool.mapTx.find(vtx[i].GetHash());
+        BOOST_REQUIRE(it != mempool.mapTx.end());
+        BOOST_CHECK_EQUAL(it->GetTime(), vTime[i]);
+    }
+    CTxMemPool::txiter it = mempool.mapTx.find(vtx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetModifiedFee(), it->GetFee() + 12345);
+    BOOST_REQUIRE(mempool.mapDeltas.count(hashAbsent));
+    BOOST_CHECK_EQUAL(mempool.mapDeltas[hashAbsent].first, 1.5);
+    BOOST_CHECK_EQUAL(mempool.mapDeltas[hashAbsent].second, 54321);
+
+    mempool.clear();
+    mempool.mapDeltas.clear();
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->Clear();
+    boost::filesystem::remove(GetDataDir() / "mempool.dat");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,10 +5,13 @@
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_AUTO_TEST_SUITE(miner_tests)
 
@@ -263,4 +266,185 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     Checkpoints::fEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(block_template_maintainer)
+{
+    boost::thread_group threadGroup;
+    StartBlockTemplateMaintainer(threadGroup);
+
+    CMutableTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vin[0].scriptSig = CScript() << OP_11;
+    txFunding.vout.resize(1);
+    txFunding.vout[0].nValue = 50 * COIN;
+    txFunding.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, chainActive.Height());
+
+        // The shared getblocktemplate template builds on the tip and is reused
+        unsigned int nSequence1, nSequence2;
+        boost::shared_ptr<const CBlockTemplate> ptemplate1 = GetBlockTemplate(nSequence1);
+        boost::shared_ptr<const CBlockTemplate> ptemplate2 = GetBlockTemplate(nSequence2);
+        BOOST_CHECK(ptemplate1->block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+        BOOST_CHECK(ptemplate1 == ptemplate2);
+        BOOST_CHECK_EQUAL(nSequence1, nSequence2);
+
+        // A transaction accepted afterwards is in the next one
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 49 * COIN;
+        tx.vout[0].scriptPubKey = CScript() << OP_1;
+        uint256 hash = tx.GetHash();
+        mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 1 * COIN, GetTime(), 111.0, chainActive.Height()));
+        SyncWithWallets(tx, NULL);
+
+        unsigned int nSequence3;
+        boost::shared_ptr<const CBlockTemplate> ptemplate3 = GetBlockTemplate(nSequence3);
+        BOOST_CHECK(nSequence3 != nSequence1);
+        BOOST_REQUIRE_EQUAL(ptemplate3->block.vtx.size(), 2);
+        BOOST_CHECK(ptemplate3->block.vtx[1].GetHash() == hash);
+
+        mempool.clear();
+        pcoinsTip->ModifyCoins(txFunding.GetHash())->Clear();
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    StopBlockTemplateMaintainer();
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_script_flags)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    Checkpoints::fEnabled = false;
+
+    // Its output can never be spent, so only skipped script checks let it in
+    CMutableTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vin[0].scriptSig = CScript() << OP_11;
+    txFunding.vout.resize(1);
+    txFunding.vout[0].nValue = 50 * COIN;
+    txFunding.vout[0].scriptPubKey = CScript() << OP_FALSE;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 49 * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    uint256 hash = tx.GetHash();
+
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, chainActive.Height());
+    }
+
+    // Not verified on acceptance: the scripts run and fail
+    CTxMemPoolEntry entry(tx, 1 * COIN, GetTime(), 111.0, chainActive.Height());
+    mempool.addUnchecked(hash, entry);
+    CBlockTemplate *pblocktemplate;
+    BOOST_REQUIRE(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    delete pblocktemplate;
+    mempool.clear();
+
+    // Verified with a superset of the block's flags: the scripts are not run again
+    entry.SetValidatedScriptFlags(STANDARD_SCRIPT_VERIFY_FLAGS);
+    mempool.addUnchecked(hash, entry);
+    BOOST_REQUIRE(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == hash);
+
+    // and the final TestBlockValidity does not run them either
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(TestBlockValidity(state, pblocktemplate->block, chainActive.Tip(), false, false, false));
+        BOOST_CHECK(!TestBlockValidity(state, pblocktemplate->block, chainActive.Tip(), false, false, true));
+        BOOST_CHECK(state.IsInvalid());
+    }
+    delete pblocktemplate;
+    mempool.clear();
+
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFunding.GetHash())->Clear();
+    }
+    Checkpoints::fEnabled = true;
+}
+
+BOOST_AUTO_TEST_CASE(miner_work_extranonce)
+{
+    Checkpoints::fEnabled = false;
+
+    CMutableTransaction txFunding;
+    txFunding.vin.resize(1);
+    txFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFunding.vin[0].scriptSig = CScript() << OP_11;
+    txFunding.vout.resize(1);
+    txFunding.vout[0].nValue = 50 * COIN;
+    txFunding.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 49 * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, chainActive.Height());
+    }
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1 * COIN, GetTime(), 111.0, chainActive.Height()));
+
+    boost::shared_ptr<CMinerWork> pwork(new CMinerWork());
+    pwork->ptemplate.reset(CreateNewBlock(CScript() << OP_TRUE));
+    BOOST_REQUIRE(pwork->ptemplate);
+    CBlock& block = pwork->ptemplate->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), 2);
+    pwork->pindexPrev = chainActive.Tip();
+    block.BuildMerkleTree();
+    pwork->vMerkleBranch = block.GetMerkleBranch(0);
+    SetMinerWork(pwork);
+
+    // Every thread shares the work under an extranonce of its own
+    unsigned int nExtraNonce1, nExtraNonce2;
+    boost::shared_ptr<const CMinerWork> pwork1 = TakeMinerWork(nExtraNonce1);
+    boost::shared_ptr<const CMinerWork> pwork2 = TakeMinerWork(nExtraNonce2);
+    BOOST_CHECK(pwork1 == pwork);
+    BOOST_CHECK(pwork2 == pwork);
+    BOOST_CHECK(nExtraNonce1 != nExtraNonce2);
+
+    // so the headers they scan differ, and each commits to its own coinbase
+    CMutableTransaction txCoinbase1, txCoinbase2;
+    CBlockHeader header1 = GetMinerWorkHeader(*pwork1, nExtraNonce1, txCoinbase1);
+    CBlockHeader header2 = GetMinerWorkHeader(*pwork2, nExtraNonce2, txCoinbase2);
+    BOOST_CHECK(header1.hashMerkleRoot != header2.hashMerkleRoot);
+    BOOST_CHECK(header1.hashPrevBlock == block.hashPrevBlock);
+
+    CBlock block1(header1);
+    block1.vtx = block.vtx;
+    block1.vtx[0] = txCoinbase1;
+    BOOST_CHECK(block1.BuildMerkleTree() == header1.hashMerkleRoot);
+    CBlock block2(header2);
+    block2.vtx = block.vtx;
+    block2.vtx[0] = txCoinbase2;
+    BOOST_CHECK(block2.BuildMerkleTree() == header2.hashMerkleRoot);
+
+    SetMinerWork(boost::shared_ptr<const CMinerWork>());
+    mempool.clear();
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFunding.GetHash())->Clear();
+    }
+    Checkpoints::fEnabled = true;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
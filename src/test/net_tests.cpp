@@ -0,0 +1,167 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "protocol.h"
+#include "random.h"
+#include "serialize.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "utiltime.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#ifndef WIN32
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+#ifndef WIN32
+/** Hand pnode a message as if it had come in over the network */
+static void ReceiveMessage(CNode& node, const char* pszCommand, const CDataStream& payload)
+{
+    CMessageHeader hdr(pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss += payload;
+    BOOST_CHECK(node.ReceiveMsgBytes(&ss[0], ss.size()));
+}
+
+/** The messages that arrived on hSocket, as command and payload */
+static std::vector<std::pair<std::string, CDataStream> > ReadMessages(SOCKET hSocket)
+{
+    std::vector<char> vData;
+    char buf[4096];
+    int nBytes;
+    while ((nBytes = recv(hSocket, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        vData.insert(vData.end(), buf, buf + nBytes);
+
+    std::vector<std::pair<std::string, CDataStream> > vMessages;
+    size_t nPos = 0;
+    while (nPos + CMessageHeader::HEADER_SIZE <= vData.size())
+    {
+        CDataStream ss(&vData[nPos], &vData[nPos] + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr;
+        ss >> hdr;
+        nPos += CMessageHeader::HEADER_SIZE;
+        CDataStream payload(&vData[0] + nPos, &vData[0] + nPos + hdr.nMessageSize, SER_NETWORK, PROTOCOL_VERSION);
+        vMessages.push_back(std::make_pair(hdr.GetCommand(), payload));
+        nPos += hdr.nMessageSize;
+    }
+    return vMessages;
+}
+
+/** Commands of the messages that arrived on hSocket */
+static std::vector<std::string> ReadCommands(SOCKET hSocket)
+{
+    std::vector<std::pair<std::string, CDataStream> > vMessages = ReadMessages(hSocket);
+    std::vector<std::string> vCommands;
+    for (unsigned int i = 0; i < vMessages.size(); i++)
+        vCommands.push_back(vMessages[i].first);
+    return vCommands;
+}
+
+BOOST_AUTO_TEST_CASE(maxuploadtarget_keeps_relay)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    CAddress addr(CService("10.0.0.1", Params().GetDefaultPort()));
+    CNode* pnode = new CNode(fds[0], addr, "", true);
+    pnode->nVersion = PROTOCOL_VERSION;
+
+    // Spend the whole budget for this cycle
+    CNode::SetMaxOutboundTarget(1024 * 1024);
+    CNode::RecordBytesSent(2 * 1024 * 1024);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+
+    // Pings are still answered
+    CDataStream ping(SER_NETWORK, PROTOCOL_VERSION);
+    ping << (uint64_t)42;
+    ReceiveMessage(*pnode, "ping", ping);
+    BOOST_CHECK(ProcessMessages(pnode));
+    std::vector<std::string> vCommands = ReadCommands(fds[1]);
+    BOOST_REQUIRE_EQUAL(vCommands.size(), 1U);
+    BOOST_CHECK_EQUAL(vCommands[0], "pong");
+
+    // and the tip block is still served
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+    pnode->vRecvGetData.push_back(CInv(MSG_BLOCK, hashTip));
+    BOOST_CHECK(ProcessMessages(pnode));
+    BOOST_CHECK(!pnode->fDisconnect);
+    BOOST_CHECK(pnode->vRecvGetData.empty());
+    vCommands = ReadCommands(fds[1]);
+    BOOST_REQUIRE_EQUAL(vCommands.size(), 1U);
+    BOOST_CHECK_EQUAL(vCommands[0], "block");
+
+    CNode::SetMaxOutboundTarget(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+
+    delete pnode;
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(tx_relay_skips_missing)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    CAddress addr(CService("10.0.0.2", Params().GetDefaultPort()));
+    CNode* pnode = new CNode(fds[0], addr, "", true);
+    pnode->nVersion = PROTOCOL_VERSION;
+    // Whitelisted peers get their queue without waiting for the timer
+    pnode->fWhitelisted = true;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[0].nValue = COIN;
+    uint256 hashKept = tx.GetHash();
+    mempool.addUnchecked(hashKept, CTxMemPoolEntry(tx, 0, GetTime(), 0.0, 1));
+
+    // A transaction that left the mempool after it was queued is not announced
+    uint256 hashGone = GetRandHash();
+    pnode->PushInventory(CInv(MSG_TX, hashKept));
+    pnode->PushInventory(CInv(MSG_TX, hashGone));
+    BOOST_CHECK(SendMessages(pnode));
+
+    std::vector<CInv> vInv;
+    std::vector<std::pair<std::string, CDataStream> > vMessages = ReadMessages(fds[1]);
+    for (unsigned int i = 0; i < vMessages.size(); i++) {
+        if (vMessages[i].first != "inv")
+            continue;
+        std::vector<CInv> v;
+        vMessages[i].second >> v;
+        vInv.insert(vInv.end(), v.begin(), v.end());
+    }
+    BOOST_REQUIRE_EQUAL(vInv.size(), 1U);
+    BOOST_CHECK_EQUAL(vInv[0].type, MSG_TX);
+    BOOST_CHECK(vInv[0].hash == hashKept);
+
+    mempool.clear();
+    delete pnode;
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,150 @@
+// Copyright (c) 2011-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "policy/fees.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "uint256.h"
+#include "util.h"
+#include "version.h"
+
+#include <list>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(policyestimator_tests)
+
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    CAmount basefee(2000);
+    CFeeRate feeV[10];
+    for (int j = 0; j < 10; j++)
+        feeV[j] = CFeeRate(basefee * (j + 1) * 10);
+
+    // Transactions paying fee level j are mined 10 - j blocks after they are
+    // seen, so the best fee level confirms in the next block
+    std::vector<uint256> txHashes[10][10];
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = 0LL;
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    unsigned int blocknum = 0;
+    std::list<CTransaction> dummyConflicted;
+    for (; blocknum < 200; blocknum++) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000 * blocknum + 100 * j + k;
+                uint256 hash = tx.GetHash();
+                mpool.addUnchecked(hash, CTxMemPoolEntry(tx, feeV[j].GetFeePerK() * nTxSize / 1000, GetTime(), 0.0, blocknum));
+                txHashes[(blocknum + 10 - j) % 10][j].push_back(hash);
+            }
+        }
+
+        std::vector<CTransaction> block;
+        for (int j = 0; j < 10; j++) {
+            BOOST_FOREACH(const uint256& hash, txHashes[(blocknum + 1) % 10][j]) {
+                CTransaction btx;
+                if (mpool.lookup(hash, btx))
+                    block.push_back(btx);
+            }
+            txHashes[(blocknum + 1) % 10][j].clear();
+        }
+        mpool.removeForBlock(block, blocknum + 1, dummyConflicted);
+    }
+
+    // Higher fee rates are needed for faster confirmation, and each target
+    // lands on the fee level that was mined within it
+    for (int i = 1; i < 10; i++) {
+        CFeeRate est = mpool.estimateFee(i);
+        BOOST_CHECK(est > CFeeRate(0));
+        BOOST_CHECK(est >= mpool.estimateFee(i + 1));
+        BOOST_CHECK(est.GetFeePerK() <= feeV[10 - i].GetFeePerK() * 1.1);
+        BOOST_CHECK(est.GetFeePerK() >= feeV[10 - i].GetFeePerK() / 1.1);
+    }
+
+    // Targets past what is tracked have no estimate
+    BOOST_CHECK(mpool.estimateFee(0) == CFeeRate(0));
+    BOOST_CHECK(mpool.estimateFee(MAX_BLOCK_CONFIRMS + 1) == CFeeRate(0));
+
+    // No zero-fee transactions were seen, so there is no priority estimate
+    BOOST_CHECK(mpool.estimatePriority(1) == -1);
+
+    int answerFound;
+    BOOST_CHECK(mpool.estimateSmartFee(1, &answerFound) == mpool.estimateFee(1));
+    BOOST_CHECK_EQUAL(answerFound, 1);
+    BOOST_CHECK(mpool.estimateSmartFee(MAX_BLOCK_CONFIRMS + 1, &answerFound) == CFeeRate(0));
+    BOOST_CHECK_EQUAL(answerFound, 0);
+
+    // Stop mining: transactions waiting longer than a target count against
+    // it, so the estimates for short targets drop out or move up
+    CFeeRate origFeeEst = mpool.estimateFee(1);
+    std::vector<CTransaction> emptyBlock;
+    for (int i = 0; i < 10; i++, blocknum++) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 10; k++) {
+                tx.vin[0].prevout.n = 10000 * blocknum + 100 * j + k;
+                mpool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, feeV[j].GetFeePerK() * nTxSize / 1000, GetTime(), 0.0, blocknum));
+            }
+        }
+        mpool.removeForBlock(emptyBlock, blocknum + 1, dummyConflicted);
+    }
+    CFeeRate stuckEst = mpool.estimateFee(1);
+    BOOST_CHECK(stuckEst == CFeeRate(0) || stuckEst > origFeeEst);
+}
+
+BOOST_AUTO_TEST_CASE(FeeEstimatesFile)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = 0LL;
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Everything is mined in the next block, so nothing unconfirmed (which
+    // is not written) is left to count against the estimates
+    std::list<CTransaction> dummyConflicted;
+    for (unsigned int blocknum = 0; blocknum < 50; blocknum++) {
+        std::vector<CTransaction> block;
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000 * blocknum + 100 * j + k;
+                mpool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 20000 * (j + 1) * nTxSize / 1000, GetTime(), 0.0, blocknum));
+                block.push_back(tx);
+            }
+        }
+        mpool.removeForBlock(block, blocknum + 1, dummyConflicted);
+    }
+    BOOST_CHECK(mpool.estimateFee(1) > CFeeRate(0));
+
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    BOOST_CHECK(mpool.WriteFeeEstimates(file));
+    rewind(file.Get());
+    CTxMemPool mpoolRead(CFeeRate(1000));
+    BOOST_CHECK(mpoolRead.ReadFeeEstimates(file));
+    for (unsigned int i = 1; i <= MAX_BLOCK_CONFIRMS; i++)
+        BOOST_CHECK(mpoolRead.estimateFee(i) == mpool.estimateFee(i));
+    file.fclose();
+
+    // A file of another format is not read
+    CAutoFile fileOld(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!fileOld.IsNull());
+    fileOld << 99900 << CLIENT_VERSION;
+    rewind(fileOld.Get());
+    BOOST_CHECK(!mpoolRead.ReadFeeEstimates(fileOld));
+    fileOld.fclose();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,9 +6,15 @@
 #include "rpcclient.h"
 
 #include "base58.h"
+#include "random.h"
+#include "txmempool.h"
+#include "utiltime.h"
 #include "wallet.h"
 
+#include <list>
+
 #include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -18,6 +24,7 @@ extern Array createArgs(int nRequired, const char* address1 = NULL, const char*
 extern Value CallRPC(string args);
 
 extern CWallet* pwalletMain;
+extern CBlockIndex* GetRescanStart(CBlockIndex* pindexTip, int64_t nTimeBegin);
 
 BOOST_AUTO_TEST_SUITE(rpc_wallet_tests)
 
@@ -104,6 +111,21 @@ BOOST_AUTO_TEST_CASE(rpc_wallet)
     BOOST_CHECK_NO_THROW(r = CallRPC("listunspent 0 1 []"));
     BOOST_CHECK(r.get_array().empty());
 
+    /*********************************
+     * 	getbalance, getwalletinfo
+     *********************************/
+    BOOST_CHECK_NO_THROW(CallRPC("getbalance"));
+    BOOST_CHECK_NO_THROW(CallRPC("getunconfirmedbalance"));
+    BOOST_CHECK_THROW(CallRPC("getunconfirmedbalance extra"), runtime_error);
+    BOOST_CHECK_NO_THROW(r = CallRPC("getwalletinfo"));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "keypoolsize").get_int(), (int)pwalletMain->GetKeyPoolSize());
+
+    // They read a snapshot that is shared until the wallet changes
+    boost::shared_ptr<const CWalletSnapshot> snapshot = pwalletMain->GetSnapshot();
+    BOOST_CHECK(pwalletMain->GetSnapshot() == snapshot);
+    pwalletMain->SetAddressBook(setaccountDemoPubkey.GetID(), "snapshotaccount", strPurpose);
+    BOOST_CHECK(pwalletMain->GetSnapshot() != snapshot);
+
     /*********************************
      * 		listreceivedbyaddress
      *********************************/
@@ -179,5 +201,132 @@ BOOST_AUTO_TEST_CASE(rpc_wallet)
     BOOST_CHECK(CBitcoinAddress(arr[0].get_str()).Get() == demoAddress.Get());
 }
 
+/** Balance returned by an RPC call; AmountFromValue refuses zero */
+static CAmount BalanceFromRPC(const std::string& strMethod)
+{
+    return (CAmount)(CallRPC(strMethod).get_real() * COIN + 0.5);
+}
+
+/** Whether listunspent with minconf 0 reports output n of hash */
+static bool ListsUnspent(const uint256& hash, int n)
+{
+    Array arr = CallRPC("listunspent 0").get_array();
+    BOOST_FOREACH(const Value& v, arr) {
+        const Object& o = v.get_obj();
+        if (find_value(o, "txid").get_str() == hash.GetHex() && find_value(o, "vout").get_int() == n)
+            return true;
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_wallet_snapshot)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CScript scriptMine = GetScriptForDestination(pwalletMain->GenerateNewKey().GetID());
+    CScript scriptOther = CScript() << OP_1 << OP_EQUAL;
+
+    CAmount nBalance = BalanceFromRPC("getbalance");
+    CAmount nUnconfirmed = BalanceFromRPC("getunconfirmedbalance");
+
+    // A payment to us entering the mempool
+    CMutableTransaction txReceive;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txReceive.vout.resize(1);
+    txReceive.vout[0].scriptPubKey = scriptMine;
+    txReceive.vout[0].nValue = 10 * COIN;
+    CTransaction receive(txReceive);
+    mempool.addUnchecked(receive.GetHash(), CTxMemPoolEntry(receive, 0, GetTime(), 0.0, chainActive.Height()));
+    pwalletMain->SyncTransaction(receive, NULL);
+
+    BOOST_CHECK_EQUAL(BalanceFromRPC("getbalance"), nBalance);
+    BOOST_CHECK_EQUAL(BalanceFromRPC("getunconfirmedbalance"), nUnconfirmed + 10 * COIN);
+    BOOST_CHECK(ListsUnspent(receive.GetHash(), 0));
+
+    // Spending it with change back to us
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(receive.GetHash(), 0);
+    txSpend.vout.resize(2);
+    txSpend.vout[0].scriptPubKey = scriptMine;
+    txSpend.vout[0].nValue = 4 * COIN;
+    txSpend.vout[1].scriptPubKey = scriptOther;
+    txSpend.vout[1].nValue = 6 * COIN;
+    CTransaction spend(txSpend);
+    mempool.addUnchecked(spend.GetHash(), CTxMemPoolEntry(spend, 0, GetTime(), 0.0, chainActive.Height()));
+    pwalletMain->SyncTransaction(spend, NULL);
+
+    BOOST_CHECK_EQUAL(BalanceFromRPC("getbalance"), nBalance + 4 * COIN);
+    BOOST_CHECK_EQUAL(BalanceFromRPC("getunconfirmedbalance"), nUnconfirmed);
+    BOOST_CHECK(ListsUnspent(spend.GetHash(), 0));
+    BOOST_CHECK(!ListsUnspent(receive.GetHash(), 0));
+
+    // A mempool change the wallet is not told about is still picked up
+    std::list<CTransaction> removed;
+    mempool.remove(spend, removed);
+    BOOST_CHECK_EQUAL(BalanceFromRPC("getbalance"), nBalance);
+    BOOST_CHECK_EQUAL(BalanceFromRPC("getunconfirmedbalance"), nUnconfirmed + 10 * COIN);
+    BOOST_CHECK(ListsUnspent(receive.GetHash(), 0));
+    BOOST_CHECK(!ListsUnspent(spend.GetHash(), 0));
+
+    mempool.clear();
+    BOOST_CHECK_EQUAL(BalanceFromRPC("getunconfirmedbalance"), nUnconfirmed);
+}
+
+
+BOOST_AUTO_TEST_CASE(rpc_importprivkeys)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CKey key[3];
+    CKeyID keyID[3];
+    string strSecret[3];
+    for (int i = 0; i < 3; i++) {
+        key[i].MakeNewKey(true);
+        keyID[i] = key[i].GetPubKey().GetID();
+        strSecret[i] = CBitcoinSecret(key[i]).ToString();
+    }
+
+    // Malformed entries are rejected before anything is imported
+    try {
+        CallRPC("importprivkeys [{\"label\":\"nokey\"}] false");
+        BOOST_ERROR("missing privkey accepted");
+    } catch (const runtime_error& e) {
+        BOOST_CHECK(string(e.what()).find("privkey") != string::npos);
+    }
+    BOOST_CHECK_THROW(CallRPC("importprivkeys [\"" + strSecret[0] + "\"] false"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("importprivkeys [{\"privkey\":\"" + strSecret[0] + "\",\"timestamp\":\"now\"}] false"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("importprivkeys [{\"privkey\":\"" + strSecret[0] + "\"},{\"privkey\":\"notakey\"}] false"), runtime_error);
+    BOOST_CHECK(!pwalletMain->HaveKey(keyID[0]));
+
+    // One batch, each key with its own label and birth time
+    BOOST_CHECK_NO_THROW(CallRPC("importprivkeys [{\"privkey\":\"" + strSecret[0] + "\",\"label\":\"first\",\"timestamp\":1500000000},"
+                                 "{\"privkey\":\"" + strSecret[1] + "\",\"timestamp\":1400000000}] true"));
+    BOOST_CHECK(pwalletMain->HaveKey(keyID[0]) && pwalletMain->HaveKey(keyID[1]));
+    BOOST_CHECK_EQUAL(pwalletMain->mapAddressBook[keyID[0]].name, "first");
+    BOOST_CHECK_EQUAL(pwalletMain->mapKeyMetadata[keyID[0]].nCreateTime, 1500000000);
+    BOOST_CHECK_EQUAL(pwalletMain->mapKeyMetadata[keyID[1]].nCreateTime, 1400000000);
+    BOOST_CHECK(pwalletMain->nTimeFirstKey <= 1400000000);
+
+    // Without a timestamp the key may be anywhere in the chain
+    BOOST_CHECK_NO_THROW(CallRPC("importprivkeys [{\"privkey\":\"" + strSecret[2] + "\"}] true"));
+    BOOST_CHECK(pwalletMain->HaveKey(keyID[2]));
+    BOOST_CHECK_EQUAL(pwalletMain->mapKeyMetadata[keyID[2]].nCreateTime, 1);
+    BOOST_CHECK_EQUAL(pwalletMain->nTimeFirstKey, 1);
+
+    // The rescan starts two hours before the earliest birth time, so at
+    // genesis for a key without one
+    std::vector<CBlockIndex> vBlocks(10);
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nTime = 1400000000 + i * 3600;
+    }
+    CBlockIndex* pindexTip = &vBlocks.back();
+    BOOST_CHECK(GetRescanStart(pindexTip, 1) == &vBlocks[0]);
+    BOOST_CHECK(GetRescanStart(pindexTip, 1400000000 + 5 * 3600) == &vBlocks[3]);
+    BOOST_CHECK(GetRescanStart(pindexTip, 1400000000 + 20 * 3600) == pindexTip);
+    BOOST_CHECK(GetRescanStart(NULL, 1) == NULL);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,143 @@
+// Copyright (c) 2015 The Bata developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "main.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "utilstrencodings.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+BOOST_AUTO_TEST_CASE(stratum_share_target)
+{
+    uint256 hashDiff1 = uint256(0xffff) << 224;
+    BOOST_CHECK(GetStratumShareTarget(1) == hashDiff1);
+    BOOST_CHECK(GetStratumShareTarget(2) == hashDiff1 / 2);
+    BOOST_CHECK(GetStratumShareTarget(256) == hashDiff1 / 256);
+    BOOST_CHECK(GetStratumShareTarget(0.5) == hashDiff1 * 2);
+
+    // Harder shares never get a larger target
+    BOOST_CHECK(GetStratumShareTarget(1.5) < GetStratumShareTarget(1));
+    BOOST_CHECK(GetStratumShareTarget(1e30) <= GetStratumShareTarget(1e20));
+    // Below the kept precision the target stops growing
+    BOOST_CHECK(GetStratumShareTarget(0) == GetStratumShareTarget(0.001));
+}
+
+/** A template with a coinbase and two other transactions, whose header can never be a block */
+static boost::shared_ptr<const CBlockTemplate> MakeTemplate(const uint256& hashPrevBlock)
+{
+    CBlockTemplate* ptemplate = new CBlockTemplate();
+    CBlock& block = ptemplate->block;
+    block.nVersion = 2;
+    block.hashPrevBlock = hashPrevBlock;
+    block.nTime = 1500000000;
+    block.nBits = 0x03000001;
+
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(txCoinbase);
+    for (int i = 1; i <= 2; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = uint256(i);
+        tx.vin[0].prevout.n = 0;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i * COIN;
+        block.vtx.push_back(tx);
+    }
+    return boost::shared_ptr<const CBlockTemplate>(ptemplate);
+}
+
+BOOST_AUTO_TEST_CASE(stratum_prevhash)
+{
+    uint256 hash;
+    for (unsigned int i = 0; i < 32; i++)
+        *(hash.begin() + i) = i;
+    BOOST_CHECK_EQUAL(StratumPrevHash(hash),
+                      "03020100070605040b0a09080f0e0d0c13121110171615141b1a19181f1e1d1c");
+}
+
+BOOST_AUTO_TEST_CASE(stratum_job)
+{
+    boost::shared_ptr<const CBlockTemplate> ptemplate = MakeTemplate(uint256(1));
+    CScript scriptPayout = CScript() << OP_TRUE;
+    int nHeight = 1000;
+    boost::shared_ptr<CStratumJob> job = BuildStratumJob(ptemplate, ptemplate->block.GetBlockHeader(), nHeight, scriptPayout);
+
+    // coinbase1 ends right before the extranonces, after the height
+    CScript scriptHeight = CScript() << nHeight;
+    unsigned int nScriptSize = scriptHeight.size() + 1 + STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE + COINBASE_FLAGS.size();
+    BOOST_CHECK_EQUAL(job->vCoinbase1.size(), 4 + 1 + 36 + GetSizeOfCompactSize(nScriptSize) + scriptHeight.size() + 1);
+    BOOST_CHECK_EQUAL((unsigned int)job->vCoinbase1.back(), STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE);
+
+    // The branch proves the coinbase position in the template
+    BOOST_CHECK_EQUAL(job->vMerkleBranch.size(), 2U);
+    CBlock block(ptemplate->block);
+    block.BuildMerkleTree();
+    BOOST_CHECK(job->vMerkleBranch == block.GetMerkleBranch(0));
+
+    // Rebuild the header of a mining.submit
+    std::vector<unsigned char> vExtraNonce1 = ParseHex("01020304");
+    std::vector<unsigned char> vExtraNonce2 = ParseHex("05060708");
+    CTransaction txCoinbase;
+    CBlockHeader header = GetStratumShareHeader(*job, vExtraNonce1, vExtraNonce2, 1500000100, 42, txCoinbase);
+
+    std::vector<unsigned char> vExtraNonce(vExtraNonce1);
+    vExtraNonce.insert(vExtraNonce.end(), vExtraNonce2.begin(), vExtraNonce2.end());
+    BOOST_CHECK(txCoinbase.vin[0].scriptSig == (CScript() << nHeight << vExtraNonce) + COINBASE_FLAGS);
+    BOOST_CHECK(txCoinbase.vout[0].scriptPubKey == scriptPayout);
+    BOOST_CHECK_EQUAL(txCoinbase.vout[0].nValue, 50 * COIN);
+
+    block.vtx[0] = txCoinbase;
+    BOOST_CHECK(header.hashMerkleRoot == block.BuildMerkleTree());
+    BOOST_CHECK(header.hashPrevBlock == uint256(1));
+    BOOST_CHECK_EQUAL(header.nVersion, 2);
+    BOOST_CHECK_EQUAL(header.nBits, 0x03000001U);
+    BOOST_CHECK_EQUAL(header.nTime, 1500000100U);
+    BOOST_CHECK_EQUAL(header.nNonce, 42U);
+}
+
+BOOST_AUTO_TEST_CASE(stratum_submit_rejects)
+{
+    boost::shared_ptr<const CBlockTemplate> ptemplate = MakeTemplate(uint256(1));
+    CScript scriptPayout = CScript() << OP_TRUE;
+    boost::shared_ptr<CStratumJob> job = BuildStratumJob(ptemplate, ptemplate->block.GetBlockHeader(), 1000, scriptPayout);
+
+    std::vector<unsigned char> vExtraNonce1 = ParseHex("01020304");
+    std::vector<unsigned char> vExtraNonce2 = ParseHex("05060708");
+    CTransaction txCoinbase;
+    CBlockHeader header = GetStratumShareHeader(*job, vExtraNonce1, vExtraNonce2, 1500000100, 1, txCoinbase);
+    CBlockHeader header2 = GetStratumShareHeader(*job, vExtraNonce1, vExtraNonce2, 1500000100, 2, txCoinbase);
+
+    // Low difficulty, which does not count as seen
+    BOOST_CHECK_EQUAL(CheckStratumShare(*job, header, uint256(1)), STRATUM_SHARE_LOW_DIFFICULTY);
+    BOOST_CHECK_EQUAL(CheckStratumShare(*job, header, ~uint256(0)), STRATUM_SHARE_VALID);
+
+    // Duplicate
+    BOOST_CHECK_EQUAL(CheckStratumShare(*job, header, ~uint256(0)), STRATUM_SHARE_DUPLICATE);
+    BOOST_CHECK_EQUAL(CheckStratumShare(*job, header2, ~uint256(0)), STRATUM_SHARE_VALID);
+
+    // Stale: jobs of the previous tip are dropped with the first job on a new one
+    AddStratumJob(job);
+    BOOST_CHECK(FindStratumJob(job->nId) == job);
+    boost::shared_ptr<CStratumJob> jobSameTip = BuildStratumJob(ptemplate, ptemplate->block.GetBlockHeader(), 1000, scriptPayout);
+    AddStratumJob(jobSameTip);
+    BOOST_CHECK(FindStratumJob(job->nId) == job);
+
+    boost::shared_ptr<const CBlockTemplate> ptemplateNext = MakeTemplate(uint256(2));
+    boost::shared_ptr<CStratumJob> jobNext = BuildStratumJob(ptemplateNext, ptemplateNext->block.GetBlockHeader(), 1001, scriptPayout);
+    AddStratumJob(jobNext);
+    BOOST_CHECK(!FindStratumJob(job->nId));
+    BOOST_CHECK(!FindStratumJob(jobSameTip->nId));
+    BOOST_CHECK(FindStratumJob(jobNext->nId) == jobNext);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,12 @@
 
 #include "wallet.h"
 
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+#include "walletdb.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -11,6 +17,7 @@
 
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -21,6 +28,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -305,4 +314,320 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_large_wallet)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    // Synthetic wallet of 100000 coins of 0.01 to 10 coins each, all whole
+    // cents. Run test_bata with --log_level=message to see the timings.
+    empty_wallet();
+    for (int i = 0; i < 100000; i++)
+        add_coin((GetRand(1000) + 1) * CENT, 1 + GetRand(6*24));
+
+    // An exact match is there to be found
+    CAmount nExact = vCoins[10].tx->vout[0].nValue + vCoins[20000].tx->vout[0].nValue + vCoins[90000].tx->vout[0].nValue;
+    int64_t nStart = GetTimeMicros();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(nExact, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_TEST_MESSAGE("Exact match from 100000 coins took " << (GetTimeMicros() - nStart) << "us");
+    BOOST_CHECK_EQUAL(nValueRet, nExact);
+
+    // Nothing can add up to a target that is not whole cents, so this falls
+    // back to the stochastic approximation
+    nStart = GetTimeMicros();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(5000 * COIN + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_TEST_MESSAGE("Approximate match from 100000 coins took " << (GetTimeMicros() - nStart) << "us");
+    BOOST_CHECK(nValueRet > 5000 * COIN);
+    BOOST_CHECK(nValueRet < 5001 * COIN);
+
+    // More than the wallet holds
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(100000 * 1000 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+
+    empty_wallet();
+}
+
+static bool HasCoin(const vector<COutput>& vAvailable, const uint256& hash, unsigned int n)
+{
+    BOOST_FOREACH(const COutput& out, vAvailable)
+        if (out.tx->GetHash() == hash && out.i == (int)n)
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_balance_tests)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKeyID keyMine = pwalletMain->GenerateNewKey().GetID();
+    CScript scriptMine = GetScriptForDestination(keyMine);
+    CScript scriptOther = CScript() << OP_1 << OP_EQUAL;
+
+    CAmount nBalance = pwalletMain->GetBalance();
+    CAmount nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+    vector<COutput> vAvailable;
+
+    // Payment to us sitting in the mempool
+    CMutableTransaction txReceive;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txReceive.vout.resize(1);
+    txReceive.vout[0].scriptPubKey = scriptMine;
+    txReceive.vout[0].nValue = 10 * COIN;
+    CTransaction receive(txReceive);
+    mempool.addUnchecked(receive.GetHash(), CTxMemPoolEntry(receive, 0, GetTime(), 0.0, chainActive.Height()));
+    pwalletMain->AddToWallet(CWalletTx(pwalletMain, receive));
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 10 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK(HasCoin(vAvailable, receive.GetHash(), 0));
+    pwalletMain->AvailableCoins(vAvailable, true);
+    BOOST_CHECK(!HasCoin(vAvailable, receive.GetHash(), 0));
+
+    // Spend it with change back to us: the change is trusted
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(receive.GetHash(), 0);
+    txSpend.vout.resize(2);
+    txSpend.vout[0].scriptPubKey = scriptMine;
+    txSpend.vout[0].nValue = 4 * COIN;
+    txSpend.vout[1].scriptPubKey = scriptOther;
+    txSpend.vout[1].nValue = 6 * COIN;
+    CTransaction spend(txSpend);
+    mempool.addUnchecked(spend.GetHash(), CTxMemPoolEntry(spend, 0, GetTime(), 0.0, chainActive.Height()));
+    pwalletMain->AddToWallet(CWalletTx(pwalletMain, spend));
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance + 4 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    pwalletMain->AvailableCoins(vAvailable, true);
+    BOOST_CHECK(HasCoin(vAvailable, spend.GetHash(), 0));
+    BOOST_CHECK(!HasCoin(vAvailable, spend.GetHash(), 1));
+    BOOST_CHECK(!HasCoin(vAvailable, receive.GetHash(), 0));
+
+    // Both pay to our key, in txid order
+    vector<const CWalletTx*> vByDest = pwalletMain->GetTxsByDestination(keyMine);
+    BOOST_CHECK_EQUAL(vByDest.size(), 2U);
+    if (vByDest.size() == 2)
+        BOOST_CHECK(vByDest[0]->GetHash() < vByDest[1]->GetHash());
+
+    // The spend leaving the mempool without the wallet being told makes
+    // the received output available again
+    std::list<CTransaction> removed;
+    mempool.remove(spend, removed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 10 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK(HasCoin(vAvailable, receive.GetHash(), 0));
+    BOOST_CHECK(!HasCoin(vAvailable, spend.GetHash(), 0));
+
+    // A rebuilt index gives the same answers
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 10 * COIN);
+
+    mempool.clear();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+}
+
+/** Key store with Unlock, which CWallet calls with the decrypted master key, reachable */
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn, bool* pfCorrupted = NULL) { return CCryptoKeyStore::Unlock(vMasterKeyIn, pfCorrupted); }
+};
+
+/**
+ * Load 2 * UNLOCK_CHECK_SAMPLE + 8 encrypted keys as from a wallet file,
+ * the second of which (in key order, so not in the sample an unlock
+ * checks) holds a secret that decrypts fine but does not match its public key.
+ */
+static void MakeCorruptedKeyStore(CTestCryptoKeyStore& keystore, const CKeyingMaterial& vMasterKey, std::vector<CKeyID>& vKeyIDs)
+{
+    std::map<CKeyID, CKey> mapKeys;
+    for (unsigned int i = 0; i < 2 * UNLOCK_CHECK_SAMPLE + 8; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        mapKeys[key.GetPubKey().GetID()] = key;
+    }
+    vKeyIDs.clear();
+    for (std::map<CKeyID, CKey>::const_iterator it = mapKeys.begin(); it != mapKeys.end(); ++it) {
+        CPubKey pubkey = it->second.GetPubKey();
+        CKey keySecret = it->second;
+        if (vKeyIDs.size() == 1)
+            keySecret.MakeNewKey(true);
+        CKeyingMaterial vchSecret(keySecret.begin(), keySecret.end());
+        std::vector<unsigned char> vchCryptedSecret;
+        BOOST_CHECK(EncryptSecret(vMasterKey, vchSecret, pubkey.GetHash(), vchCryptedSecret));
+        BOOST_CHECK(keystore.AddCryptedKey(pubkey, vchCryptedSecret));
+        vKeyIDs.push_back(it->first);
+    }
+    BOOST_CHECK(keystore.IsLocked());
+}
+
+BOOST_AUTO_TEST_CASE(crypted_key_check)
+{
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vMasterKey[0], WALLET_CRYPTO_KEY_SIZE);
+    CKeyingMaterial vWrongKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vWrongKey[0], WALLET_CRYPTO_KEY_SIZE);
+
+    // A sample is checked at unlock, the other keys on first use
+    {
+        CTestCryptoKeyStore keystore;
+        std::vector<CKeyID> vKeyIDs;
+        MakeCorruptedKeyStore(keystore, vMasterKey, vKeyIDs);
+
+        bool fCorrupted;
+        BOOST_CHECK(!keystore.Unlock(vWrongKey, &fCorrupted));
+        BOOST_CHECK(!fCorrupted);
+        BOOST_CHECK(keystore.Unlock(vMasterKey, &fCorrupted));
+        BOOST_CHECK(!fCorrupted);
+        BOOST_CHECK(!keystore.IsLocked());
+
+        CKey key;
+        BOOST_CHECK(!keystore.GetKey(vKeyIDs[1], key));
+        for (unsigned int i = 0; i < vKeyIDs.size(); i++) {
+            if (i == 1)
+                continue;
+            BOOST_CHECK(keystore.GetKey(vKeyIDs[i], key));
+            BOOST_CHECK(key.GetPubKey().GetID() == vKeyIDs[i]);
+        }
+        // and it stays unusable
+        BOOST_CHECK(!keystore.GetKey(vKeyIDs[1], key));
+    }
+
+    // With -unlockthreads every key is checked at the first unlock
+    nUnlockThreads = 4;
+    {
+        CTestCryptoKeyStore keystore;
+        std::vector<CKeyID> vKeyIDs;
+        MakeCorruptedKeyStore(keystore, vMasterKey, vKeyIDs);
+
+        // which is told apart from a wrong passphrase
+        bool fCorrupted;
+        BOOST_CHECK(!keystore.Unlock(vWrongKey, &fCorrupted));
+        BOOST_CHECK(!fCorrupted);
+        BOOST_CHECK(!keystore.Unlock(vMasterKey, &fCorrupted));
+        BOOST_CHECK(fCorrupted);
+        BOOST_CHECK(keystore.IsLocked());
+    }
+    nUnlockThreads = 0;
+}
+
+
+static unsigned int KeyPoolSize()
+{
+    LOCK(pwalletMain->cs_wallet);
+    return pwalletMain->GetKeyPoolSize();
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup)
+{
+    // A top-up larger than one batch is written in several transactions,
+    // and every key in the pool can be read back
+    mapArgs["-keypool"] = "250";
+    BOOST_CHECK(pwalletMain->TopUpKeyPool());
+    BOOST_CHECK_EQUAL(KeyPoolSize(), 251U);
+    std::set<CKeyID> setReserveKeys;
+    pwalletMain->GetAllReserveKeys(setReserveKeys);
+    BOOST_CHECK_EQUAL(setReserveKeys.size(), 251U);
+
+    // With the key pool thread running, keys are handed out without
+    // generating new ones until the pool drops below the low water mark
+    mapArgs["-keypool"] = "20";
+    boost::thread_group threadGroup;
+    pwalletMain->StartKeyPoolThread(threadGroup);
+    CPubKey pubkey;
+    unsigned int nSize = KeyPoolSize();
+    while (nSize > 20 * KEYPOOL_LOW_WATER_PERCENT / 100)
+    {
+        BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey));
+        BOOST_CHECK_EQUAL(KeyPoolSize(), --nSize);
+    }
+
+    // and then the thread refills it
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey));
+    for (int i = 0; i < 100 && KeyPoolSize() < 21; i++)
+        MilliSleep(100);
+    BOOST_CHECK_EQUAL(KeyPoolSize(), 21U);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    // Without it, key requests top up the pool themselves
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey));
+    BOOST_CHECK_EQUAL(KeyPoolSize(), 20U);
+
+    mapArgs.erase("-keypool");
+}
+
+/** Looks wallet records up in wallet.dat itself, past the wallet's queue */
+class CWalletDBReader : public CWalletDB
+{
+public:
+    CWalletDBReader(const std::string& strFilename) : CWalletDB(strFilename) {}
+
+    bool HaveTx(const uint256& hash)
+    {
+        return Exists(std::make_pair(std::string("tx"), hash));
+    }
+};
+
+static CWalletTx QueueTestTx()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    CWalletTx wtx(pwalletMain, tx);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx, false, true));
+    return wtx;
+}
+
+BOOST_AUTO_TEST_CASE(queued_tx_writes)
+{
+    // Queued records are not written straight away, and stay queued
+    // across a flush of the database environment
+    CWalletTx wtx1 = QueueTestTx();
+    BOOST_CHECK(!CWalletDBReader(pwalletMain->strWalletFile).HaveTx(wtx1.GetHash()));
+    bitdb.Flush(false);
+    BOOST_CHECK(!CWalletDBReader(pwalletMain->strWalletFile).HaveTx(wtx1.GetHash()));
+    BOOST_CHECK(pwalletMain->FlushQueuedTxs());
+    BOOST_CHECK(CWalletDBReader(pwalletMain->strWalletFile).HaveTx(wtx1.GetHash()));
+
+    // The best block is written together with the records queued before it
+    CWalletTx wtx2 = QueueTestTx();
+    std::vector<uint256> vHave(1, GetRandHash());
+    pwalletMain->SetBestChain(CBlockLocator(vHave));
+    {
+        CWalletDBReader walletdb(pwalletMain->strWalletFile);
+        BOOST_CHECK(walletdb.HaveTx(wtx2.GetHash()));
+        CBlockLocator locator;
+        BOOST_CHECK(walletdb.ReadBestBlock(locator));
+        BOOST_CHECK(locator.vHave == vHave);
+    }
+
+    // in one database transaction, so they are dropped together too
+    CWalletTx wtx3 = QueueTestTx();
+    std::vector<uint256> vHaveAborted(1, GetRandHash());
+    {
+        CWalletDBReader walletdb(pwalletMain->strWalletFile);
+        BOOST_REQUIRE(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WriteTx(wtx3.GetHash(), wtx3));
+        BOOST_CHECK(walletdb.WriteBestBlock(CBlockLocator(vHaveAborted)));
+        BOOST_CHECK(walletdb.TxnAbort());
+        BOOST_CHECK(!walletdb.HaveTx(wtx3.GetHash()));
+        CBlockLocator locator;
+        BOOST_CHECK(walletdb.ReadBestBlock(locator));
+        BOOST_CHECK(locator.vHave == vHave);
+    }
+    BOOST_CHECK(pwalletMain->FlushQueuedTxs());
+    BOOST_CHECK(CWalletDBReader(pwalletMain->strWalletFile).HaveTx(wtx3.GetHash()));
+
+    pwalletMain->EraseFromWallet(wtx1.GetHash());
+    pwalletMain->EraseFromWallet(wtx2.GetHash());
+    pwalletMain->EraseFromWallet(wtx3.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,12 +7,18 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
+#include "random.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -32,6 +38,12 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Besides its own fee and size, every entry tracks the totals of its
+ * in-mempool ancestors and descendants (each including the entry itself):
+ * the ancestor totals are what a miner has to include to get this
+ * transaction into a block, the descendant totals are what is lost when
+ * it is evicted. CTxMemPool keeps them up to date as transactions come and go.
  */
 class CTxMemPoolEntry
 {
@@ -40,9 +52,21 @@ private:
     CAmount nFee; //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; //! ... and avoid recomputing tx size
     size_t nModSize; //! ... and modified size for priority
+    size_t nUsageSize; //! ... and total memory usage
     int64_t nTime; //! Local time when entering the mempool
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta; //! Fee delta from prioritisetransaction
+    unsigned int nValidatedScriptFlags; //! Script flags the inputs passed with on acceptance, 0 if not checked
+    int nCoinbaseSpendHeight; //! Height of the youngest chain coinbase it spends, -1 if none
+
+    uint64_t nCountWithDescendants; //! number of descendant transactions
+    uint64_t nSizeWithDescendants; //! ... and size
+    CAmount nModFeesWithDescendants; //! ... and total fees, with deltas
+
+    uint64_t nCountWithAncestors; //! number of ancestor transactions
+    uint64_t nSizeWithAncestors; //! ... and size
+    CAmount nModFeesWithAncestors; //! ... and total fees, with deltas
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -53,12 +77,170 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    unsigned int GetValidatedScriptFlags() const { return nValidatedScriptFlags; }
+    void SetValidatedScriptFlags(unsigned int flags) { nValidatedScriptFlags = flags; }
+    int GetCoinbaseSpendHeight() const { return nCoinbaseSpendHeight; }
+    void SetCoinbaseSpendHeight(int nCoinbaseHeight) { nCoinbaseSpendHeight = nCoinbaseHeight; }
+
+    /** Adjust the descendant totals by the given amounts */
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    /** Adjust the ancestor totals by the given amounts */
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    /** Replace the prioritisetransaction fee delta, keeping the totals in step */
+    void UpdateFeeDelta(CAmount newFeeDelta);
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+// extracts a transaction hash from CTxMempoolEntry or CTransaction
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Hash txids with a per-pool random salt so peers cannot pick colliding ones */
+class SaltedTxidHasher
+{
+private:
+    uint256 salt;
+
+public:
+    SaltedTxidHasher() : salt(GetRandHash()) {}
+
+    size_t operator()(const uint256& txid) const {
+        return txid.GetHash(salt);
+    }
+};
+
+/** \class CompareTxMemPoolEntryByDescendantScore
+ *
+ *  Sort an entry by max(fee rate of entry, fee rate of all descendants),
+ *  lowest first. The first entry is the cheapest package to evict.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aModFee = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+
+        double bModFee = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aModFee * bSize;
+        double f2 = aSize * bModFee;
+
+        if (f1 == f2) {
+            return a.GetTime() >= b.GetTime();
+        }
+        return f1 < f2;
+    }
+
+    // Calculate which score to use for an entry (avoiding division).
+    bool UseDescendantScore(const CTxMemPoolEntry &a) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+/** \class CompareTxMemPoolEntryByAncestorFee
+ *
+ *  Sort an entry by the fee rate of itself plus all its unconfirmed
+ *  ancestors, highest first. This is the order a miner wants packages in.
+ *  Also used by the miner on its own entries that discount ancestors
+ *  already in the block.
+ */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    template<typename T>
+    bool operator()(const T& a, const T& b) const
+    {
+        double aFees = a.GetModFeesWithAncestors();
+        double aSize = a.GetSizeWithAncestors();
+
+        double bFees = b.GetModFeesWithAncestors();
+        double bSize = b.GetSizeWithAncestors();
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aFees * bSize;
+        double f2 = aSize * bFees;
+
+        if (f1 == f2) {
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        }
+        return f1 > f2;
+    }
 };
 
-class CMinerPolicyEstimator;
+// Multi_index tag names
+struct descendant_score {};
+struct ancestor_score {};
+
+class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
@@ -85,17 +267,74 @@ public:
  */
 class CTxMemPool
 {
+public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
+
 private:
     bool fSanityCheck; //! Normally false, true if -checkmempool or -regtest
+    bool fLoaded; //! Set once mempool.dat has been loaded (or skipped) at startup
     unsigned int nTransactionsUpdated;
-    CMinerPolicyEstimator* minerPolicyEstimator;
+    CBlockPolicyEstimator* minerPolicyEstimator;
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    mutable double rollingMinimumFeeRate; //! minimum fee rate (per kB) to get into the pool, decays towards zero
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+
+    /** Raise the rolling minimum fee to the rate of a package that was evicted */
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // lookup by txid
+            boost::multi_index::hashed_unique<mempoolentry_txid, SaltedTxidHasher>,
+            // sorted by fee rate with descendants (eviction order)
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by fee rate with ancestors (mining order)
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee
+            >
+        >
+    > indexed_transaction_set;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+private:
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks; //! in-mempool parents and children of every entry
+
+    typedef std::multimap<int, txiter> coinbaseSpendsMap;
+    coinbaseSpendsMap mapCoinbaseSpends; //! entries spending a chain coinbase, by the coinbase's height
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+
+public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
@@ -111,18 +350,79 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
-    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
+    /**
+     * Add to the pool without any policy checks. The second form takes the
+     * in-mempool ancestors the caller already computed (and limit-checked)
+     * with CalculateMemPoolAncestors; the first looks them up itself.
+     * fCurrentEstimate is false while the chain is not synced, so the fee
+     * estimator does not track the transaction.
+     */
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate = true);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
-    void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
+    /**
+     * Remove transactions spending a coinbase that is immature at
+     * nMemPoolHeight (after a block was disconnected). Only the entries
+     * spending recent coinbases are looked at, not the whole pool.
+     */
+    void removeCoinbaseSpends(unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                        std::list<CTransaction>& conflicts);
+                        std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void clear();
+    /** Remove a set of entries. updateDescendants must be true unless stage
+     *  already includes every descendant of its members. */
+    void RemoveStaged(setEntries &stage, bool updateDescendants);
+
+    /**
+     * After transactions from a disconnected block are back in the pool,
+     * link them to in-mempool children that already spent them and fix up
+     * the ancestor/descendant totals. vHashesToUpdate is in block order.
+     */
+    void UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate);
+
+    /**
+     * Collect the in-mempool ancestors of entry into setAncestors, failing
+     * (with errString set) as soon as one of the limits would be exceeded
+     * by adding entry. With fSearchForParents false entry must already be in
+     * the pool and its recorded parents are used.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string &errString, bool fSearchForParents = true) const;
+
+    /** Add entryit and all its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter entryit, setEntries &setDescendants) const;
+
+    const setEntries & GetMemPoolParents(txiter entry) const;
+    const setEntries & GetMemPoolChildren(txiter entry) const;
+
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    /** Whether the startup load of mempool.dat is done; until then the pool must not be dumped over it */
+    bool IsLoaded() const;
+    void SetIsLoaded(bool fLoadedIn);
+
+    /**
+     * The minimum fee to get into the pool, which may itself not be enough
+     * for larger-sized transactions. After the pool has been trimmed it is
+     * the fee rate of the last evicted package plus the relay fee; it then
+     * halves every ROLLING_FEE_HALFLIFE (faster while the pool is well below
+     * sizelimit), but only once a block has been connected since the bump.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /**
+     * Evict packages (a transaction and its in-mempool descendants) lowest
+     * descendant fee rate first until the pool's dynamic memory usage is
+     * below sizelimit.
+     */
+    void TrimToSize(size_t sizelimit);
+
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
@@ -147,15 +447,46 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    /**
+     * Sort txids by their number of in-mempool ancestors, so that parents
+     * come before their children. Transactions not in the pool go last.
+     */
+    void SortByAncestorCount(std::vector<uint256>& vHashes) const;
+
+    /** Memory used by the pool: entries, their indexes and links, and the outpoint maps */
+    size_t DynamicMemoryUsage() const;
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
+    /**
+     * Estimate fee rate needed to get into the next nBlocks, trying longer
+     * targets if there is no estimate for nBlocks, and at least the
+     * mempool minimum fee. answerFoundAtBlocks is set to the target used.
+     */
+    CFeeRate estimateSmartFee(int nBlocks, int *answerFoundAtBlocks = NULL) const;
+
     /** Estimate priority needed to get into the next nBlocks */
     double estimatePriority(int nBlocks) const;
+
+    /** Estimate priority needed to get into the next nBlocks, as estimateSmartFee */
+    double estimateSmartPriority(int nBlocks, int *answerFoundAtBlocks = NULL) const;
     
     /** Write/Read estimates to disk */
     bool WriteFeeEstimates(CAutoFile& fileout) const;
     bool ReadFeeEstimates(CAutoFile& filein);
+
+private:
+    /** Add (or take away) it to the descendant totals of setAncestors and
+     *  link it to its in-mempool parents */
+    void UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors);
+    /** Set the ancestor totals of a new entry */
+    void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors);
+    /** Fix up the totals and links of everything around entriesToRemove */
+    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants);
+    void UpdateChildrenForRemoval(txiter entry);
+    /** Erase a single entry; totals and links must have been updated */
+    void removeUnchecked(txiter entry);
 };
 
 /** 
@@ -11,6 +11,7 @@
 #include "net.h"
 #include "script/script.h"
 #include "script/sign.h"
+#include "script/standard.h"
 #include "timedata.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -68,7 +69,45 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
     return &(it->second);
 }
 
-CPubKey CWallet::GenerateNewKey()
+std::vector<const CWalletTx*> CWallet::GetTxsByDestination(const CTxDestination& dest) const
+{
+    LOCK(cs_wallet);
+    std::vector<const CWalletTx*> vWtx;
+    TxsByDestination::const_iterator it = mapTxsByDestination.find(dest);
+    if (it == mapTxsByDestination.end())
+        return vWtx;
+    vWtx.reserve(it->second.size());
+    BOOST_FOREACH(const uint256& wtxid, it->second)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end())
+            vWtx.push_back(&mit->second);
+    }
+    return vWtx;
+}
+
+std::vector<const CWalletTx*> CWallet::GetTxsSinceHeight(int nHeight) const
+{
+    LOCK(cs_wallet);
+    std::set<uint256> setTxids;
+    TxsByHeight::const_iterator it = mapTxsByHeight.find(-1);
+    if (it != mapTxsByHeight.end())
+        setTxids.insert(it->second.begin(), it->second.end());
+    for (it = mapTxsByHeight.upper_bound(std::max(nHeight, -1)); it != mapTxsByHeight.end(); ++it)
+        setTxids.insert(it->second.begin(), it->second.end());
+
+    std::vector<const CWalletTx*> vWtx;
+    vWtx.reserve(setTxids.size());
+    BOOST_FOREACH(const uint256& wtxid, setTxids)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end())
+            vWtx.push_back(&mit->second);
+    }
+    return vWtx;
+}
+
+CPubKey CWallet::GenerateNewKey(CWalletDB* pwalletdb)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
@@ -79,7 +118,7 @@ CPubKey CWallet::GenerateNewKey()
 
     // Compressed public keys were introduced in version 0.6.0
     if (fCompressed)
-        SetMinVersion(FEATURE_COMPRPUBKEY);
+        SetMinVersion(FEATURE_COMPRPUBKEY, pwalletdb);
 
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
@@ -90,15 +129,30 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
-    if (!AddKeyPubKey(secret, pubkey))
+    if (pwalletdb ? !AddKeyPubKeyWithDB(*pwalletdb, secret, pubkey) : !AddKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
     return pubkey;
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
+{
+    CWalletDB walletdb(strWalletFile);
+    return AddKeyPubKeyWithDB(walletdb, secret, pubkey);
+}
+
+bool CWallet::AddKeyPubKeyWithDB(CWalletDB& walletdb, const CKey& secret, const CPubKey &pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
-    if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
+
+    // CCryptoKeyStore::AddKeyPubKey writes the encrypted key through
+    // AddCryptedKey below, so hand it walletdb the way EncryptWallet does
+    bool fTunnelDB = !pwalletdbEncryption;
+    if (fTunnelDB)
+        pwalletdbEncryption = &walletdb;
+    bool fAdded = CCryptoKeyStore::AddKeyPubKey(secret, pubkey);
+    if (fTunnelDB)
+        pwalletdbEncryption = NULL;
+    if (!fAdded)
         return false;
 
     // check if we need to remove from watch-only
@@ -110,9 +164,9 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey,
-                                                 secret.GetPrivKey(),
-                                                 mapKeyMetadata[pubkey.GetID()]);
+        return walletdb.WriteKey(pubkey,
+                                 secret.GetPrivKey(),
+                                 mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
@@ -157,6 +211,10 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        InvalidateSnapshot();
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -208,11 +266,13 @@ bool CWallet::LoadWatchOnly(const CScript &dest)
     return CCryptoKeyStore::AddWatchOnly(dest);
 }
 
-bool CWallet::Unlock(const SecureString& strWalletPassphrase)
+bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool* pfCorrupted)
 {
     CCrypter crypter;
     CKeyingMaterial vMasterKey;
 
+    if (pfCorrupted)
+        *pfCorrupted = false;
     {
         LOCK(cs_wallet);
         BOOST_FOREACH(const MasterKeyMap::value_type& pMasterKey, mapMasterKeys)
@@ -221,8 +281,15 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
                 return false;
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 continue; // try another master key
-            if (CCryptoKeyStore::Unlock(vMasterKey))
+            bool fCorrupted;
+            if (CCryptoKeyStore::Unlock(vMasterKey, &fCorrupted))
                 return true;
+            if (fCorrupted)
+            {
+                if (pfCorrupted)
+                    *pfCorrupted = true;
+                return false;
+            }
         }
     }
     return false;
@@ -276,8 +343,51 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
+    LOCK(cs_wallet);
+    CWalletDB walletdb(strWalletFile);
+    bool fTxn = walletdb.TxnBegin();
+    if (!WriteQueuedTxs(walletdb) || !walletdb.WriteBestBlock(loc))
+    {
+        if (fTxn)
+            walletdb.TxnAbort();
+        return;
+    }
+    if (!fTxn || walletdb.TxnCommit())
+        setTxsToWrite.clear();
+}
+
+bool CWallet::WriteQueuedTxs(CWalletDB& walletdb)
+{
+    AssertLockHeld(cs_wallet);
+    BOOST_FOREACH(const uint256& hash, setTxsToWrite)
+    {
+        std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end() && !walletdb.WriteTx(hash, it->second))
+            return false;
+    }
+    return true;
+}
+
+bool CWallet::FlushQueuedTxs()
+{
+    LOCK(cs_wallet);
+    if (setTxsToWrite.empty())
+        return true;
+
     CWalletDB walletdb(strWalletFile);
-    walletdb.WriteBestBlock(loc);
+    if (!walletdb.TxnBegin())
+        return false;
+    if (!WriteQueuedTxs(walletdb))
+    {
+        walletdb.TxnAbort();
+        return false;
+    }
+    if (!walletdb.TxnCommit())
+        return false;
+
+    LogPrint("db", "CWallet::FlushQueuedTxs : wrote %u transactions\n", setTxsToWrite.size());
+    setTxsToWrite.clear();
+    return true;
 }
 
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
@@ -291,6 +401,7 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
             nVersion = FEATURE_LATEST;
 
     nWalletVersion = nVersion;
+    InvalidateSnapshot();
 
     if (nVersion > nWalletMaxVersion)
         nWalletMaxVersion = nVersion;
@@ -419,6 +530,118 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+void CWallet::AddToDestinationIndex(const CWalletTx& wtx)
+{
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination dest;
+        if (ExtractDestination(txout.scriptPubKey, dest))
+            mapTxsByDestination[dest].insert(wtx.GetHash());
+    }
+}
+
+void CWallet::UpdateHeightIndex(CWalletTx& wtx)
+{
+    int nHeight = -1;
+    if (wtx.hashBlock != 0)
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+            nHeight = mi->second->nHeight;
+    }
+
+    TxsByHeight::iterator it = mapTxsByHeight.find(wtx.nIndexedHeight);
+    if (it != mapTxsByHeight.end())
+    {
+        if (nHeight == wtx.nIndexedHeight && it->second.count(wtx.GetHash()))
+            return;
+        it->second.erase(wtx.GetHash());
+        if (it->second.empty())
+            mapTxsByHeight.erase(it);
+    }
+    mapTxsByHeight[nHeight].insert(wtx.GetHash());
+    wtx.nIndexedHeight = nHeight;
+}
+
+void CWallet::RemoveFromDestinationIndex(const CWalletTx& wtx)
+{
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination dest;
+        if (!ExtractDestination(txout.scriptPubKey, dest))
+            continue;
+        TxsByDestination::iterator it = mapTxsByDestination.find(dest);
+        if (it == mapTxsByDestination.end())
+            continue;
+        it->second.erase(wtx.GetHash());
+        if (it->second.empty())
+            mapTxsByDestination.erase(it);
+    }
+}
+
+/**
+ * Unlike IsSpent, only spends that are in a block count here: whether an
+ * unconfirmed spend is conflicted can change without the wallet being told,
+ * while confirmations always come with a SyncTransaction.
+ */
+bool CWallet::IsSpentInMainChain(const COutPoint& outpoint) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            return true;
+    }
+    return false;
+}
+
+void CWallet::UpdateWalletUTXOOutputs(const CWalletTx& wtx) const
+{
+    const uint256 wtxid = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        const COutPoint outpoint(wtxid, i);
+        if (IsMine(wtx.vout[i]) != ISMINE_NO && !IsSpentInMainChain(outpoint))
+            setWalletUTXO.insert(outpoint);
+        else
+            setWalletUTXO.erase(outpoint);
+    }
+}
+
+void CWallet::UpdateWalletUTXO(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    fBalancesCached = false;
+    if (!fWalletUTXOValid)
+        return;
+
+    UpdateWalletUTXOOutputs(wtx);
+
+    // A change in confirmation state of wtx changes whether the outputs it
+    // spends are still unspent
+    if (wtx.IsCoinBase())
+        return;
+    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(txin.prevout.hash);
+        if (mit != mapWallet.end())
+            UpdateWalletUTXOOutputs(mit->second);
+    }
+}
+
+void CWallet::BuildWalletUTXO() const
+{
+    AssertLockHeld(cs_wallet);
+    setWalletUTXO.clear();
+    for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateWalletUTXOOutputs(it->second);
+    fWalletUTXOValid = true;
+    fBalancesCached = false;
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -501,6 +724,7 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
         Unlock(strWalletPassphrase);
         NewKeyPool();
         Lock();
+        InvalidateSnapshot();
 
         // Need to completely rewrite the wallet file; if we don't, bdb might keep
         // bits of the unencrypted private key in slack space in the database file.
@@ -524,29 +748,30 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
+    AssertLockHeld(cs_wallet); // wtxOrdered
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+void CWallet::ReloadOrderedTxItems(CWalletDB& walletdb)
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+    wtxOrdered.clear();
+    laccentries.clear();
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    walletdb.ListAccountCreditDebit("*", laccentries);
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
     }
-
-    return txOrdered;
 }
 
 void CWallet::MarkDirty()
@@ -555,10 +780,14 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // What is ours may have changed (e.g. imported keys)
+        fWalletUTXOValid = false;
+        fBalancesCached = false;
+        InvalidateSnapshot();
     }
 }
 
-bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
+bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, bool fQueueWrite)
 {
     uint256 hash = wtxIn.GetHash();
 
@@ -567,6 +796,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        AddToDestinationIndex(mapWallet[hash]);
+        UpdateHeightIndex(mapWallet[hash]);
+        fWalletUTXOValid = false;
+        InvalidateSnapshot();
     }
     else
     {
@@ -580,6 +813,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -591,9 +825,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -627,6 +859,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                              wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
+            AddToDestinationIndex(wtx);
         }
 
         bool fUpdated = false;
@@ -656,11 +889,22 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Write to disk
         if (fInsertedNew || fUpdated)
-            if (!wtx.WriteToDisk())
-                return false;
+        {
+            if (fQueueWrite && fFileBacked)
+                setTxsToWrite.insert(hash);
+            else
+            {
+                if (!wtx.WriteToDisk())
+                    return false;
+                setTxsToWrite.erase(hash);
+            }
+        }
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        UpdateWalletUTXO(wtx);
+        UpdateHeightIndex(wtx);
+        InvalidateSnapshot();
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -683,7 +927,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
  * pblock is optional, but should be provided if the transaction is known to be in a block.
  * If fUpdate is true, existing transactions will be updated.
  */
-bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate, bool fQueueWrite)
 {
     {
         AssertLockHeld(cs_wallet);
@@ -695,7 +939,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             // Get merkle branch if transaction was found in a block
             if (pblock)
                 wtx.SetMerkleBranch(*pblock);
-            return AddToWallet(wtx);
+            return AddToWallet(wtx, false, fQueueWrite);
         }
     }
     return false;
@@ -704,9 +948,16 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
-    if (!AddToWalletIfInvolvingMe(tx, pblock, true))
+    // Every connected and disconnected block comes through here, if only
+    // with its coinbase, and changes the depth of the wallet's transactions
+    if (pblock || tx.IsCoinBase())
+        InvalidateSnapshot();
+    if (!AddToWalletIfInvolvingMe(tx, pblock, true, true))
         return; // Not one of ours
 
+    if (setTxsToWrite.size() >= MAX_QUEUED_TX_WRITES)
+        FlushQueuedTxs();
+
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
     // recomputed, also:
@@ -723,8 +974,33 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        setTxsToWrite.erase(hash);
+        std::map<uint256, CWalletTx>::iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+        {
+            RemoveFromDestinationIndex(it->second);
+            TxsByHeight::iterator itHeight = mapTxsByHeight.find(it->second.nIndexedHeight);
+            if (itHeight != mapTxsByHeight.end())
+            {
+                itHeight->second.erase(hash);
+                if (itHeight->second.empty())
+                    mapTxsByHeight.erase(itHeight);
+            }
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(it->second.nOrderPos);
+            for (TxItems::iterator itOrdered = range.first; itOrdered != range.second; ++itOrdered)
+            {
+                if (itOrdered->second.first == &it->second)
+                {
+                    wtxOrdered.erase(itOrdered);
+                    break;
+                }
+            }
+            mapWallet.erase(it);
             CWalletDB(strWalletFile).EraseTx(hash);
+            fWalletUTXOValid = false;
+            fBalancesCached = false;
+            InvalidateSnapshot();
+        }
     }
     return;
 }
@@ -924,10 +1200,171 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+namespace {
+
+/** Upper bound on the threads reading blocks for a rescan */
+static const int MAX_RESCAN_THREADS = 8;
+/** How many blocks a rescan may read ahead of the one the wallet is on */
+static const size_t RESCAN_READ_AHEAD = 64;
+
+/**
+ * The keys, scripts and watch-only scripts of a wallet, copied so that
+ * outputs can be matched without taking its locks. MaybeMine is a superset
+ * of IsMine: it only looks at whether the output pays to something the
+ * wallet knows about, not whether the wallet can actually spend it.
+ */
+class CRescanFilter
+{
+private:
+    std::set<CKeyID> setKeyIDs;
+    std::set<CScriptID> setScriptIDs;
+    std::set<CScript> setWatchOnly;
+
+public:
+    CRescanFilter(const std::set<CKeyID>& setKeyIDsIn, const std::set<CScriptID>& setScriptIDsIn, const std::set<CScript>& setWatchOnlyIn) :
+        setKeyIDs(setKeyIDsIn), setScriptIDs(setScriptIDsIn), setWatchOnly(setWatchOnlyIn) {}
+
+    bool MaybeMine(const CScript& scriptPubKey) const
+    {
+        if (setWatchOnly.count(scriptPubKey))
+            return true;
+
+        std::vector<std::vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        if (!Solver(scriptPubKey, whichType, vSolutions))
+            return false;
+
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            return setKeyIDs.count(CPubKey(vSolutions[0]).GetID()) > 0;
+        case TX_PUBKEYHASH:
+            return setKeyIDs.count(CKeyID(uint160(vSolutions[0]))) > 0;
+        case TX_SCRIPTHASH:
+            return setScriptIDs.count(CScriptID(uint160(vSolutions[0]))) > 0;
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (setKeyIDs.count(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            return false;
+        default:
+            return false;
+        }
+    }
+};
+
+/** A block read by a rescan thread, with the transactions that may pay the wallet marked */
+struct CRescanBlock
+{
+    CBlock block;
+    bool fRead;
+    std::vector<bool> vMaybeMine;
+};
+
+/**
+ * Reads the blocks of a rescan in worker threads, at most RESCAN_READ_AHEAD
+ * blocks ahead of the caller, and hands them back in chain order.
+ */
+class CRescanReader
+{
+private:
+    const std::vector<CBlockIndex*>& vBlocks;
+    const CRescanFilter& filter;
+
+    boost::mutex cs;
+    boost::condition_variable cond;
+    size_t nNextRead;
+    size_t nNextGet;
+    std::map<size_t, CRescanBlock*> mapRead;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void ThreadRead()
+    {
+        while (true)
+        {
+            size_t n;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fStop && nNextRead < vBlocks.size() && nNextRead >= nNextGet + RESCAN_READ_AHEAD)
+                    cond.wait(lock);
+                if (fStop || nNextRead >= vBlocks.size())
+                    return;
+                n = nNextRead++;
+            }
+
+            CRescanBlock* pblock = new CRescanBlock();
+            pblock->fRead = ReadBlockFromDisk(pblock->block, vBlocks[n]);
+            pblock->vMaybeMine.resize(pblock->block.vtx.size(), false);
+            for (unsigned int i = 0; i < pblock->block.vtx.size(); i++)
+            {
+                BOOST_FOREACH(const CTxOut& txout, pblock->block.vtx[i].vout)
+                {
+                    if (filter.MaybeMine(txout.scriptPubKey))
+                    {
+                        pblock->vMaybeMine[i] = true;
+                        break;
+                    }
+                }
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                mapRead[n] = pblock;
+            }
+            cond.notify_all();
+        }
+    }
+
+public:
+    CRescanReader(const std::vector<CBlockIndex*>& vBlocksIn, const CRescanFilter& filterIn, int nThreads) :
+        vBlocks(vBlocksIn), filter(filterIn), nNextRead(0), nNextGet(0), fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CRescanReader::ThreadRead, this));
+    }
+
+    ~CRescanReader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+        }
+        cond.notify_all();
+        threadGroup.join_all();
+        for (std::map<size_t, CRescanBlock*>::iterator it = mapRead.begin(); it != mapRead.end(); ++it)
+            delete it->second;
+    }
+
+    /** Wait for the next block in chain order; the caller must delete it */
+    CRescanBlock* GetNext()
+    {
+        CRescanBlock* pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            std::map<size_t, CRescanBlock*>::iterator it;
+            while ((it = mapRead.find(nNextGet)) == mapRead.end())
+                cond.wait(lock);
+            pblock = it->second;
+            mapRead.erase(it);
+            nNextGet++;
+        }
+        cond.notify_all();
+        return pblock;
+    }
+};
+
+} // anon namespace
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and their outputs matched against the wallet's keys and
+ * scripts in worker threads; only the transactions that may be ours, that
+ * spend from the wallet or are already in it are then checked and added in
+ * chain order under the wallet lock.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -943,27 +1380,66 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        std::vector<CBlockIndex*> vBlocks;
+        for (CBlockIndex* pindexScan = pindex; pindexScan; pindexScan = chainActive.Next(pindexScan))
+            vBlocks.push_back(pindexScan);
+
+        std::set<CKeyID> setKeyIDs;
+        GetKeys(setKeyIDs);
+        std::set<CScriptID> setScriptIDs;
+        std::set<CScript> setWatchOnlyScripts;
+        {
+            LOCK(cs_KeyStore);
+            for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+                setScriptIDs.insert(it->first);
+            setWatchOnlyScripts = setWatchOnly;
+        }
+        CRescanFilter filter(setKeyIDs, setScriptIDs, setWatchOnlyScripts);
+
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_RESCAN_THREADS));
+        nThreads = std::min(nThreads, (int)std::max(vBlocks.size(), (size_t)1));
+        CRescanReader reader(vBlocks, filter, nThreads);
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        for (size_t n = 0; n < vBlocks.size(); n++)
         {
+            pindex = vBlocks[n];
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            CRescanBlock* pblock = reader.GetNext();
+            const CBlock& block = pblock->block;
+            for (unsigned int i = 0; i < block.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                const CTransaction& tx = block.vtx[i];
+                bool fCandidate = pblock->vMaybeMine[i] || mapWallet.count(tx.GetHash());
+                if (!fCandidate && !tx.IsCoinBase())
+                {
+                    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    {
+                        if (mapWallet.count(txin.prevout.hash))
+                        {
+                            fCandidate = true;
+                            break;
+                        }
+                    }
+                }
+                if (fCandidate && AddToWalletIfInvolvingMe(tx, &block, fUpdate, true))
                     ret++;
             }
-            pindex = chainActive.Next(pindex);
+            delete pblock;
+
+            if (setTxsToWrite.size() >= MAX_QUEUED_TX_WRITES)
+                FlushQueuedTxs();
+
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
             }
         }
+        FlushQueuedTxs();
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
     return ret;
@@ -972,6 +1448,8 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 void CWallet::ReacceptWalletTransactions()
 {
     LOCK2(cs_main, cs_wallet);
+    // Submit in wallet order, so parents come before their children
+    std::multimap<int64_t, const CWalletTx*> mapSorted;
     BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
     {
         const uint256& wtxid = item.first;
@@ -981,12 +1459,17 @@ void CWallet::ReacceptWalletTransactions()
         int nDepth = wtx.GetDepthInMainChain();
 
         if (!wtx.IsCoinBase() && nDepth < 0)
-        {
-            // Try to add to memory pool
-            LOCK(mempool.cs);
-            wtx.AcceptToMemoryPool(false);
-        }
+            mapSorted.insert(std::make_pair(wtx.nOrderPos, &wtx));
     }
+
+    // Try to add them to the memory pool as one batch
+    std::vector<CTransaction> vtx;
+    vtx.reserve(mapSorted.size());
+    for (std::multimap<int64_t, const CWalletTx*>::const_iterator it = mapSorted.begin(); it != mapSorted.end(); ++it)
+        vtx.push_back(*it->second);
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted;
+    AcceptToMemoryPoolBatch(mempool, vtx, vState, vAccepted, false, true);
 }
 
 void CWalletTx::RelayWalletTransaction()
@@ -1061,94 +1544,229 @@ void CWallet::ResendWalletTransactions()
  */
 
 
-CAmount CWallet::GetBalance() const
+const CWallet::CWalletBalances& CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    uint256 hashTip;
+    if (chainActive.Tip())
+        hashTip = chainActive.Tip()->GetBlockHash();
+    if (fBalancesCached && hashBalancesTip == hashTip && nBalancesMempoolUpdated == mempool.GetTransactionsUpdated())
+        return cachedBalances;
+
+    if (!fWalletUTXOValid)
+        BuildWalletUTXO();
+
+    CWalletBalances balances;
+    balances.nTrusted = balances.nUntrustedPending = balances.nImmature = 0;
+    balances.nWatchOnlyTrusted = balances.nWatchOnlyUntrustedPending = balances.nWatchOnlyImmature = 0;
+
+    // Non-final transactions may become final with time alone, so totals
+    // that depend on one are not cached
+    bool fCacheable = true;
+
+    const CWalletTx* pcoin = NULL;
+    bool fTrusted = false, fPending = false, fImmature = false, fAvailable = false;
+    for (std::set<COutPoint>::const_iterator it = setWalletUTXO.begin(); it != setWalletUTXO.end(); ++it)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (pcoin == NULL || pcoin->GetHash() != it->hash)
+        {
+            std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->hash);
+            assert(mit != mapWallet.end());
+            pcoin = &mit->second;
+
+            bool fFinal = IsFinalTx(*pcoin);
+            if (!fFinal)
+                fCacheable = false;
+            int nDepth = pcoin->GetDepthInMainChain();
+            fTrusted = pcoin->IsTrusted();
+            fPending = !fFinal || (!fTrusted && nDepth == 0);
+            bool fImmatureCoinBase = pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0;
+            fImmature = fImmatureCoinBase && nDepth > 0;
+            fAvailable = !fImmatureCoinBase;
+        }
+
+        const CTxOut& txout = pcoin->vout[it->n];
+        if (fImmature)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            balances.nImmature += GetCredit(txout, ISMINE_SPENDABLE);
+            balances.nWatchOnlyImmature += GetCredit(txout, ISMINE_WATCH_ONLY);
+        }
+        if (fAvailable && (fTrusted || fPending) && !IsSpent(it->hash, it->n))
+        {
+            CAmount nCredit = GetCredit(txout, ISMINE_SPENDABLE);
+            CAmount nWatchCredit = GetCredit(txout, ISMINE_WATCH_ONLY);
+            if (fTrusted)
+            {
+                balances.nTrusted += nCredit;
+                balances.nWatchOnlyTrusted += nWatchCredit;
+            }
+            if (fPending)
+            {
+                balances.nUntrustedPending += nCredit;
+                balances.nWatchOnlyUntrustedPending += nWatchCredit;
+            }
         }
     }
 
-    return nTotal;
+    cachedBalances = balances;
+    fBalancesCached = fCacheable;
+    hashBalancesTip = hashTip;
+    nBalancesMempoolUpdated = mempool.GetTransactionsUpdated();
+    return cachedBalances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUntrustedPending;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyUntrustedPending;
+}
+
+CAmount CWallet::GetImmatureWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyImmature;
+}
+
+void CWallet::InvalidateSnapshot()
+{
+    AssertLockHeld(cs_wallet);
+    LOCK(cs_snapshot);
+    pSnapshot.reset();
+    pUnspentSnapshot.reset();
+}
+
+template <typename T>
+static bool IsSnapshotCurrent(const boost::shared_ptr<const T>& snapshot, unsigned int nMempoolUpdated)
+{
+    return snapshot && !snapshot->fTimeDependent && snapshot->nMempoolUpdated == nMempoolUpdated;
+}
+
+boost::shared_ptr<const CWalletSnapshot> CWallet::GetSnapshot() const
+{
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
+        LOCK(cs_snapshot);
+        if (IsSnapshotCurrent(pSnapshot, nMempoolUpdated))
+            return pSnapshot;
     }
-    return nTotal;
+
+    LOCK2(cs_main, cs_wallet);
+    nMempoolUpdated = mempool.GetTransactionsUpdated();
+    {
+        // Someone else may have rebuilt it while we waited for the locks
+        LOCK(cs_snapshot);
+        if (IsSnapshotCurrent(pSnapshot, nMempoolUpdated))
+            return pSnapshot;
+    }
+
+    boost::shared_ptr<CWalletSnapshot> snapshot(new CWalletSnapshot());
+    snapshot->nMempoolUpdated = nMempoolUpdated;
+
+    const CWalletBalances& balances = GetBalances();
+    snapshot->nBalance = balances.nTrusted;
+    snapshot->nUnconfirmedBalance = balances.nUntrustedPending;
+    snapshot->fTimeDependent = !fBalancesCached;
+
+    snapshot->nWalletVersion = nWalletVersion;
+    snapshot->fCrypted = IsCrypted();
+    snapshot->nTxCount = mapWallet.size();
+    snapshot->nKeyPoolSize = setKeyPool.size();
+    // Read the oldest key directly, GetOldestKeyPoolTime reserving and
+    // returning it would change the key pool under the snapshot
+    snapshot->nKeyPoolOldest = GetTime();
+    if (!setKeyPool.empty())
+    {
+        CKeyPool keypool;
+        if (CWalletDB(strWalletFile).ReadPool(*setKeyPool.begin(), keypool))
+            snapshot->nKeyPoolOldest = keypool.nTime;
+    }
+
+    LOCK(cs_snapshot);
+    pSnapshot = snapshot;
+    return pSnapshot;
 }
 
-CAmount CWallet::GetImmatureWatchOnlyBalance() const
+boost::shared_ptr<const CWalletUnspentSnapshot> CWallet::GetUnspentSnapshot() const
 {
-    CAmount nTotal = 0;
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        LOCK(cs_snapshot);
+        if (IsSnapshotCurrent(pUnspentSnapshot, nMempoolUpdated))
+            return pUnspentSnapshot;
+    }
+
+    LOCK2(cs_main, cs_wallet);
+    nMempoolUpdated = mempool.GetTransactionsUpdated();
+    {
+        LOCK(cs_snapshot);
+        if (IsSnapshotCurrent(pUnspentSnapshot, nMempoolUpdated))
+            return pUnspentSnapshot;
+    }
+
+    boost::shared_ptr<CWalletUnspentSnapshot> snapshot(new CWalletUnspentSnapshot());
+    snapshot->nMempoolUpdated = nMempoolUpdated;
+    // AvailableCoins leaves out the same non-final transactions that keep
+    // the balances from being cached
+    GetBalances();
+    snapshot->fTimeDependent = !fBalancesCached;
+
+    vector<COutput> vecOutputs;
+    AvailableCoins(vecOutputs, false);
+    snapshot->vUnspent.reserve(vecOutputs.size());
+    BOOST_FOREACH(const COutput& out, vecOutputs)
+    {
+        CWalletUnspentSnapshot::CUnspent unspent;
+        unspent.txid = out.tx->GetHash();
+        unspent.n = out.i;
+        unspent.nValue = out.tx->vout[out.i].nValue;
+        unspent.scriptPubKey = out.tx->vout[out.i].scriptPubKey;
+        unspent.nDepth = out.nDepth;
+        unspent.fSpendable = out.fSpendable;
+        unspent.fHaveAccount = false;
+        if (ExtractDestination(unspent.scriptPubKey, unspent.address))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
+            unspent.strAddress = CBitcoinAddress(unspent.address).ToString();
+            std::map<CTxDestination, CAddressBookData>::const_iterator mi = mapAddressBook.find(unspent.address);
+            if (mi != mapAddressBook.end())
+            {
+                unspent.fHaveAccount = true;
+                unspent.strAccount = mi->second.name;
+            }
+            if (unspent.scriptPubKey.IsPayToScriptHash())
+                GetCScript(boost::get<CScriptID>(unspent.address), unspent.redeemScript);
         }
+        snapshot->vUnspent.push_back(unspent);
     }
-    return nTotal;
+
+    LOCK(cs_snapshot);
+    pUnspentSnapshot = snapshot;
+    return pUnspentSnapshot;
 }
 
 /**
@@ -1160,36 +1778,97 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (!fWalletUTXOValid)
+            BuildWalletUTXO();
+
+        // setWalletUTXO is ordered by txid, visit it one transaction at a time
+        std::set<COutPoint>::const_iterator it = setWalletUTXO.begin();
+        while (it != setWalletUTXO.end())
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256 wtxid = it->hash;
+            std::set<COutPoint>::const_iterator itEnd = it;
+            while (itEnd != setWalletUTXO.end() && itEnd->hash == wtxid)
+                ++itEnd;
 
-            if (!IsFinalTx(*pcoin))
-                continue;
+            const CWalletTx* pcoin = &mapWallet.find(wtxid)->second;
+            int nDepth = pcoin->GetDepthInMainChain();
+            if (IsFinalTx(*pcoin) && (!fOnlyConfirmed || pcoin->IsTrusted()) &&
+                !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) && nDepth >= 0)
+            {
+                for (; it != itEnd; ++it) {
+                    unsigned int i = it->n;
+                    isminetype mine = IsMine(pcoin->vout[i]);
+                    if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
+                        !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue >= nMinimumInputThreshold &&
+                        (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
+                            vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+                }
+            }
+            it = itEnd;
+        }
+    }
+}
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+typedef pair<CAmount, pair<const CWalletTx*, unsigned int> > CValueCoin;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+/** Give up looking for an exact match after this many search steps */
+static const int MAX_EXACT_MATCH_TRIES = 100000;
+/** Beyond this many coins below the target, the stochastic solver only sees the largest ones */
+static const unsigned int MAX_APPROXIMATE_COINS = 1000;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
+/**
+ * Branch and bound search for a subset of vValue (sorted by descending value)
+ * adding up to exactly nTargetValue. A branch is cut when the coins left
+ * cannot reach the target; a coin that would overshoot it is passed over,
+ * and so are the coins equal to one just left out, which would only repeat
+ * the search.
+ */
+static bool SelectExactMatch(const vector<CValueCoin>& vValue, const CAmount& nTargetValue, vector<char>& vfSelected)
+{
+    // vRemaining[i] is the total value of vValue[i..]
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue >= nMinimumInputThreshold &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+    vector<unsigned int> vIncluded;
+    CAmount nTotal = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < MAX_EXACT_MATCH_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfSelected.assign(vValue.size(), false);
+            BOOST_FOREACH(unsigned int j, vIncluded)
+                vfSelected[j] = true;
+            return true;
+        }
+
+        if (i == vValue.size() || nTotal + vRemaining[i] < nTargetValue)
+        {
+            // Backtrack: leave out the last coin taken, and its equals
+            if (vIncluded.empty())
+                return false;
+            unsigned int j = vIncluded.back();
+            vIncluded.pop_back();
+            nTotal -= vValue[j].first;
+            i = j + 1;
+            while (i < vValue.size() && vValue[i].first == vValue[j].first)
+                i++;
+        }
+        else
+        {
+            if (nTotal + vValue[i].first <= nTargetValue)
+            {
+                vIncluded.push_back(i);
+                nTotal += vValue[i].first;
             }
+            i++;
         }
     }
+    return false;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+static void ApproximateBestSubset(const vector<CValueCoin>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1235,35 +1914,28 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
-                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+/**
+ * Select coins for nTargetValue out of vCandidates, which are all eligible
+ * for this attempt. vCandidates is shuffled in place.
+ */
+static bool SelectCoinsFromCandidates(const CAmount& nTargetValue, vector<CValueCoin>& vCandidates,
+                                      set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet)
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
     // List of values less than target
-    pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    CValueCoin coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<CAmount>::max();
     coinLowestLarger.second.first = NULL;
-    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
+    vector<CValueCoin> vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    random_shuffle(vCandidates.begin(), vCandidates.end(), GetRandInt);
 
-    BOOST_FOREACH(const COutput &output, vCoins)
+    BOOST_FOREACH(const CValueCoin& coin, vCandidates)
     {
-        if (!output.fSpendable)
-            continue;
-
-        const CWalletTx *pcoin = output.tx;
-
-        if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
-            continue;
-
-        int i = output.i;
-        CAmount n = pcoin->vout[i].nValue;
-
-        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+        CAmount n = coin.first;
 
         if (n == nTargetValue)
         {
@@ -1301,14 +1973,39 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Largest first; the shuffle above decides the order of equal coins
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (SelectExactMatch(vValue, nTargetValue, vfBest))
+        nBest = nTargetValue;
+    else
+    {
+        // Solve subset sum by stochastic approximation. Each try walks all the
+        // coins, so in large wallets only use the largest ones, enough to make
+        // up the target twice over, and a sample spread over the others to
+        // get close to the target with.
+        if (vValue.size() > MAX_APPROXIMATE_COINS)
+        {
+            CAmount nTotal = 0;
+            unsigned int nCoins = 0;
+            while (nCoins < vValue.size() && nTotal < 2 * (nTargetValue + CENT))
+                nTotal += vValue[nCoins++].first;
+            unsigned int nStep = std::max((size_t)1, (vValue.size() - nCoins) / MAX_APPROXIMATE_COINS);
+            for (unsigned int i = nCoins; i < vValue.size(); i += nStep)
+            {
+                nTotal += vValue[i].first;
+                vValue[nCoins++] = vValue[i];
+            }
+            vValue.resize(nCoins);
+            nTotalLower = nTotal;
+        }
+
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1336,6 +2033,27 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     return true;
 }
 
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
+                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    vector<CValueCoin> vCandidates;
+    vCandidates.reserve(vCoins.size());
+    BOOST_FOREACH(const COutput &output, vCoins)
+    {
+        if (!output.fSpendable)
+            continue;
+
+        const CWalletTx *pcoin = output.tx;
+
+        if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+            continue;
+
+        vCandidates.push_back(make_pair(pcoin->vout[output.i].nValue, make_pair(pcoin, output.i)));
+    }
+
+    return SelectCoinsFromCandidates(nTargetValue, vCandidates, setCoinsRet, nValueRet);
+}
+
 bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
 {
     vector<COutput> vCoins;
@@ -1354,9 +2072,42 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    // The attempts below are SelectCoinsMinConf with (nConfMine, nConfTheirs)
+    // of (1, 6), then (1, 1), then (0, 1), each allowing all the coins of the
+    // one before. Bucket the coins by the first attempt that can use them, so
+    // each attempt only adds its bucket to the candidates of the last one.
+    vector<CValueCoin> vBuckets[3];
+    BOOST_FOREACH(const COutput& out, vCoins)
+    {
+        if (!out.fSpendable)
+            continue;
+
+        bool fFromMe = out.tx->IsFromMe(ISMINE_ALL);
+        int nBucket;
+        if (out.nDepth >= (fFromMe ? 1 : 6))
+            nBucket = 0;
+        else if (out.nDepth >= 1)
+            nBucket = 1;
+        else if (fFromMe && out.nDepth >= 0)
+            nBucket = 2;
+        else
+            continue;
+        vBuckets[nBucket].push_back(make_pair(out.tx->vout[out.i].nValue, make_pair(out.tx, out.i)));
+    }
+
+    int nAttempts = bSpendZeroConfChange ? 3 : 2;
+    vector<CValueCoin> vCandidates;
+    vCandidates.reserve(vCoins.size());
+    for (int nAttempt = 0; nAttempt < nAttempts; nAttempt++)
+    {
+        // Without new candidates the attempt would fail again
+        if (nAttempt > 0 && vBuckets[nAttempt].empty())
+            continue;
+        vCandidates.insert(vCandidates.end(), vBuckets[nAttempt].begin(), vBuckets[nAttempt].end());
+        if (SelectCoinsFromCandidates(nTargetValue, vCandidates, setCoinsRet, nValueRet))
+            return true;
+    }
+    return false;
 }
 
 
@@ -1652,6 +2403,12 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        LOCK(cs_wallet);
+        CWalletDB walletdb(strWalletFile);
+        ReloadOrderedTxItems(walletdb);
+    }
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -1692,6 +2449,7 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
         mapAddressBook[address].name = strName;
         if (!strPurpose.empty()) /* update purpose only if requested */
             mapAddressBook[address].purpose = strPurpose;
+        InvalidateSnapshot();
     }
     NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address) != ISMINE_NO,
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
@@ -1717,6 +2475,7 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
             }
         }
         mapAddressBook.erase(address);
+        InvalidateSnapshot();
     }
 
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address) != ISMINE_NO, "", CT_DELETED);
@@ -1750,6 +2509,7 @@ bool CWallet::NewKeyPool()
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
         setKeyPool.clear();
+        InvalidateSnapshot();
 
         if (IsLocked())
             return false;
@@ -1761,6 +2521,7 @@ bool CWallet::NewKeyPool()
             walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
             setKeyPool.insert(nIndex);
         }
+        InvalidateSnapshot();
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -1768,33 +2529,97 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
+
+    // Each batch of keys is written in one database transaction, and
+    // cs_wallet is let go of in between, so a large top-up in the key pool
+    // thread does not hold up the rest of the wallet for its whole length
+    while (true)
     {
         LOCK(cs_wallet);
 
         if (IsLocked())
             return false;
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
 
         CWalletDB walletdb(strWalletFile);
-
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
-
-        while (setKeyPool.size() < (nTargetSize + 1))
+        bool fTxn = walletdb.TxnBegin();
+        for (unsigned int i = 0; i < KEYPOOL_TOPUP_BATCH && setKeyPool.size() < nTargetSize + 1; i++)
         {
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey(&walletdb))))
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
             setKeyPool.insert(nEnd);
             LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
         }
+        if (fTxn && !walletdb.TxnCommit())
+            throw runtime_error("TopUpKeyPool() : committing generated keys failed");
+        InvalidateSnapshot();
+    }
+}
+
+void CWallet::RequestKeyPoolTopUp()
+{
+    {
+        LOCK(cs_wallet);
+        if (!fKeyPoolThread)
+        {
+            TopUpKeyPool();
+            return;
+        }
+    }
+    boost::unique_lock<boost::mutex> lock(mutKeyPoolTopUp);
+    fKeyPoolTopUpRequested = true;
+    condKeyPoolTopUp.notify_one();
+}
+
+void CWallet::StartKeyPoolThread(boost::thread_group& threadGroup)
+{
+    // Set before the thread starts, so key requests made right after this
+    // already leave the top-up to it
+    {
+        LOCK(cs_wallet);
+        fKeyPoolThread = true;
+    }
+    threadGroup.create_thread(boost::bind(&CWallet::ThreadTopUpKeyPool, this));
+}
+
+void CWallet::ThreadTopUpKeyPool()
+{
+    RenameThread("bata-keypool");
+
+    try
+    {
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutKeyPoolTopUp);
+                while (!fKeyPoolTopUpRequested)
+                    condKeyPoolTopUp.wait(lock);
+                fKeyPoolTopUpRequested = false;
+            }
+
+            try {
+                TopUpKeyPool();
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadTopUpKeyPool()");
+            }
+        }
+    }
+    catch (const boost::thread_interrupted&)
+    {
+        LOCK(cs_wallet);
+        fKeyPoolThread = false;
+        throw;
     }
-    return true;
 }
 
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
@@ -1804,8 +2629,10 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        // With the key pool thread running, keys are only generated here
+        // when there are none left
+        if (!IsLocked() && (!fKeyPoolThread || setKeyPool.empty()))
+            TopUpKeyPool(fKeyPoolThread ? 1 : 0);
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -1815,12 +2642,17 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
+        InvalidateSnapshot();
         if (!walletdb.ReadPool(nIndex, keypool))
             throw runtime_error("ReserveKeyFromKeyPool() : read failed");
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
         assert(keypool.vchPubKey.IsValid());
         LogPrintf("keypool reserve %d\n", nIndex);
+
+        if (fKeyPoolThread && !IsLocked() &&
+            (int64_t)setKeyPool.size() * 100 < max(GetArg("-keypool", 100), (int64_t) 0) * KEYPOOL_LOW_WATER_PERCENT)
+            RequestKeyPoolTopUp();
     }
 }
 
@@ -1841,6 +2673,7 @@ void CWallet::ReturnKey(int64_t nIndex)
     {
         LOCK(cs_wallet);
         setKeyPool.insert(nIndex);
+        InvalidateSnapshot();
     }
     LogPrintf("keypool return %d\n", nIndex);
 }
@@ -2090,18 +2923,21 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    InvalidateSnapshot();
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    InvalidateSnapshot();
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    InvalidateSnapshot();
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
@@ -18,6 +18,7 @@
 #include "walletdb.h"
 
 #include <algorithm>
+#include <list>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -26,6 +27,10 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 /**
  * Settings
  */
@@ -48,13 +53,21 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 0.1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 5000;
+//! Write the queued transaction records once this many are waiting
+static const unsigned int MAX_QUEUED_TX_WRITES = 1000;
+//! Refill the key pool in the background once fewer than this percentage of -keypool keys are left
+static const unsigned int KEYPOOL_LOW_WATER_PERCENT = 75;
+//! Keys generated and written in one database transaction when topping up the key pool
+static const unsigned int KEYPOOL_TOPUP_BATCH = 100;
 
 class CAccountingEntry;
 class CCoinControl;
 class COutput;
 class CReserveKey;
 class CScript;
+class CWalletSnapshot;
 class CWalletTx;
+class CWalletUnspentSnapshot;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -137,6 +150,91 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Wallet transactions by the destinations their outputs pay to, so the
+     * received-by RPCs only look at the transactions of the addresses asked
+     * about. The outputs of a transaction never change, so entries are only
+     * added when a transaction enters mapWallet and removed when it is erased.
+     */
+    typedef std::map<CTxDestination, std::set<uint256> > TxsByDestination;
+    TxsByDestination mapTxsByDestination;
+    void AddToDestinationIndex(const CWalletTx& wtx);
+    void RemoveFromDestinationIndex(const CWalletTx& wtx);
+
+    /**
+     * Wallet transactions by the height of the main chain block they are
+     * in, -1 for unconfirmed, conflicted and disconnected ones. Re-keyed
+     * whenever AddToWallet sees a transaction, which SyncTransaction does for
+     * the transactions of every connected and disconnected block.
+     */
+    typedef std::map<int, std::set<uint256> > TxsByHeight;
+    TxsByHeight mapTxsByHeight;
+    void UpdateHeightIndex(CWalletTx& wtx);
+
+    /**
+     * Our outputs that no wallet transaction in the main chain spends. This
+     * is a superset of the outputs that can count towards a balance or be
+     * selected as inputs, so balances and coin selection only look at these
+     * instead of all of mapWallet. Updated as transactions are added to the
+     * wallet or change confirmation state (SyncTransaction on connected and
+     * disconnected blocks), and rebuilt on first use after MarkDirty().
+     */
+    mutable std::set<COutPoint> setWalletUTXO;
+    mutable bool fWalletUTXOValid;
+    bool IsSpentInMainChain(const COutPoint& outpoint) const;
+    void UpdateWalletUTXOOutputs(const CWalletTx& wtx) const;
+    void UpdateWalletUTXO(const CWalletTx& wtx);
+    void BuildWalletUTXO() const;
+
+    /** Balance totals by confirmation state, summed over setWalletUTXO */
+    struct CWalletBalances
+    {
+        CAmount nTrusted;
+        CAmount nUntrustedPending;
+        CAmount nImmature;
+        CAmount nWatchOnlyTrusted;
+        CAmount nWatchOnlyUntrustedPending;
+        CAmount nWatchOnlyImmature;
+    };
+    //! Cached totals stay valid for the tip and mempool state they were computed at
+    mutable CWalletBalances cachedBalances;
+    mutable bool fBalancesCached;
+    mutable uint256 hashBalancesTip;
+    mutable unsigned int nBalancesMempoolUpdated;
+    const CWalletBalances& GetBalances() const;
+
+    /**
+     * Transactions added or updated by SyncTransaction and rescans whose
+     * records are not written yet. They are written together in one
+     * database transaction by FlushQueuedTxs, which the wallet flush thread
+     * calls every half second, and with the best block by SetBestChain, so
+     * the best block on disk is never ahead of the transactions.
+     */
+    std::set<uint256> setTxsToWrite;
+    bool WriteQueuedTxs(CWalletDB& walletdb);
+
+    /**
+     * Key pool top-ups for ThreadTopUpKeyPool, so that handing out a key
+     * only waits for new ones to be generated when the pool is empty.
+     * Without that thread running, key requests top up the pool themselves.
+     */
+    boost::mutex mutKeyPoolTopUp;
+    boost::condition_variable condKeyPoolTopUp;
+    bool fKeyPoolTopUpRequested;
+    bool fKeyPoolThread;
+
+    /**
+     * The wallet state the read-only RPCs report, published for them to read
+     * without cs_main or cs_wallet. Everything that changes what they hold
+     * drops both while holding cs_wallet, and the next GetSnapshot or
+     * GetUnspentSnapshot rebuilds the one it returns. The unspent outputs
+     * are kept apart so balance readers never pay for building the list.
+     */
+    mutable CCriticalSection cs_snapshot;
+    mutable boost::shared_ptr<const CWalletSnapshot> pSnapshot;
+    mutable boost::shared_ptr<const CWalletUnspentSnapshot> pUnspentSnapshot;
+    void InvalidateSnapshot();
+
 public:
     /*
      * Main wallet lock.
@@ -187,10 +285,25 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fWalletUTXOValid = false;
+        fBalancesCached = false;
+        nBalancesMempoolUpdated = 0;
+        fKeyPoolTopUpRequested = false;
+        fKeyPoolThread = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
 
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::multimap<int64_t, TxPair > TxItems;
+    /**
+     * The wallet's activity log: transactions and accounting entries of all
+     * accounts by nOrderPos, kept up to date as they are added so that the
+     * newest items can be read without looking at the rest.
+     */
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -203,12 +316,16 @@ public:
     int64_t nTimeFirstKey;
 
     const CWalletTx* GetWalletTx(const uint256& hash) const;
+    //! Wallet transactions with an output paying to dest, in txid order
+    std::vector<const CWalletTx*> GetTxsByDestination(const CTxDestination& dest) const;
+    //! Wallet transactions in main chain blocks above nHeight or not in the main chain, in txid order
+    std::vector<const CWalletTx*> GetTxsSinceHeight(int nHeight) const;
 
     //! check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -222,9 +339,11 @@ public:
      * keystore implementation
      * Generate a new key
      */
-    CPubKey GenerateNewKey();
+    CPubKey GenerateNewKey(CWalletDB* pwalletdb = NULL);
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
+    //! As AddKeyPubKey, writing through an open database handle
+    bool AddKeyPubKeyWithDB(CWalletDB& walletdb, const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
     //! Load metadata (used by LoadWallet)
@@ -254,7 +373,8 @@ public:
     //! Adds a watch-only address to the store, without saving it to disk (used by LoadWallet)
     bool LoadWatchOnly(const CScript &dest);
 
-    bool Unlock(const SecureString& strWalletPassphrase);
+    //! pfCorrupted is set when the passphrase decrypts some keys but not others
+    bool Unlock(const SecureString& strWalletPassphrase, bool* pfCorrupted = NULL);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
     bool EncryptWallet(const SecureString& strWalletPassphrase);
 
@@ -266,20 +386,21 @@ public:
      */
     int64_t IncOrderPosNext(CWalletDB *pwalletdb = NULL);
 
-    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef std::multimap<int64_t, TxPair > TxItems;
+    //! Add an accounting entry to the activity log, once it is committed to the database
+    void AddAccountingEntry(const CAccountingEntry& acentry);
 
     /**
-     * Get the wallet's activity log
-     * @return multimap of ordered transactions and accounting entries
-     * @warning Returned pointers are *only* valid within the scope of passed acentries
+     * Rebuild wtxOrdered and laccentries from mapWallet and the accounting
+     * entries in the database, after the wallet is loaded or reordered
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    void ReloadOrderedTxItems(CWalletDB& walletdb);
 
     void MarkDirty();
-    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
+    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false, bool fQueueWrite=false);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
-    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate, bool fQueueWrite=false);
+    //! Write the queued transaction records, see setTxsToWrite
+    bool FlushQueuedTxs();
     void EraseFromWallet(const uint256 &hash);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
@@ -290,6 +411,15 @@ public:
     CAmount GetWatchOnlyBalance() const;
     CAmount GetUnconfirmedWatchOnlyBalance() const;
     CAmount GetImmatureWatchOnlyBalance() const;
+
+    /**
+     * The current snapshot of the wallet state. Only the caller that finds
+     * it out of date takes cs_main and cs_wallet to rebuild it, so it can
+     * be called without holding either.
+     */
+    boost::shared_ptr<const CWalletSnapshot> GetSnapshot() const;
+    //! The same for the unspent outputs listunspent reports
+    boost::shared_ptr<const CWalletUnspentSnapshot> GetUnspentSnapshot() const;
     bool CreateTransaction(const std::vector<std::pair<CScript, CAmount> >& vecSend,
                            CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl = NULL);
     bool CreateTransaction(CScript scriptPubKey, const CAmount& nValue,
@@ -301,6 +431,10 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    //! Have ThreadTopUpKeyPool top up the key pool, or do it now if it is not running
+    void RequestKeyPoolTopUp();
+    void StartKeyPoolThread(boost::thread_group& threadGroup);
+    void ThreadTopUpKeyPool();
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -591,6 +725,7 @@ public:
     mutable CAmount nImmatureWatchCreditCached;
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
+    int nIndexedHeight; //! key in the wallet's by-height index, -1 if not in the main chain
 
     CWalletTx()
     {
@@ -641,6 +776,7 @@ public:
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
         nOrderPos = -1;
+        nIndexedHeight = -1;
     }
 
     ADD_SERIALIZE_METHODS;
@@ -934,6 +1070,54 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * An immutable copy of the wallet state that getbalance, getunconfirmedbalance
+ * and getwalletinfo report. It is shared between the callers that read it,
+ * and replaced rather than modified when the wallet changes.
+ */
+class CWalletSnapshot
+{
+public:
+    CAmount nBalance;
+    CAmount nUnconfirmedBalance;
+    int nWalletVersion;
+    bool fCrypted;
+    unsigned int nTxCount;
+    unsigned int nKeyPoolSize;
+    int64_t nKeyPoolOldest;
+
+    //! Mempool state it was built at, since depths depend on what is in the mempool
+    unsigned int nMempoolUpdated;
+    //! Built while a non-final transaction was in the wallet, so time alone can outdate it
+    bool fTimeDependent;
+};
+
+/** An immutable copy of the unspent outputs listunspent reports, shared like CWalletSnapshot */
+class CWalletUnspentSnapshot
+{
+public:
+    /** An output AvailableCoins(vCoins, false) returns, with what listunspent shows of it */
+    struct CUnspent
+    {
+        uint256 txid;
+        unsigned int n;
+        CAmount nValue;
+        CScript scriptPubKey;
+        int nDepth;
+        bool fSpendable;
+        CTxDestination address;
+        std::string strAddress;
+        bool fHaveAccount;
+        std::string strAccount;
+        CScript redeemScript;
+    };
+
+    std::vector<CUnspent> vUnspent;
+
+    unsigned int nMempoolUpdated;
+    bool fTimeDependent;
+};
+
 
 
 
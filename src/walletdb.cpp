@@ -6,6 +6,7 @@
 #include "walletdb.h"
 
 #include "base58.h"
+#include "init.h"
 #include "protocol.h"
 #include "serialize.h"
 #include "sync.h"
@@ -320,6 +321,7 @@ DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
         }
     }
     WriteOrderPosNext(nOrderPosNext);
+    pwallet->ReloadOrderedTxItems(*this);
 
     return DB_LOAD_OK;
 }
@@ -796,8 +798,7 @@ void ThreadFlushWalletDB(const string& strFile)
     if (fOneThread)
         return;
     fOneThread = true;
-    if (!GetBoolArg("-flushwallet", true))
-        return;
+    bool fFlushWallet = GetBoolArg("-flushwallet", true);
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
@@ -806,6 +807,13 @@ void ThreadFlushWalletDB(const string& strFile)
     {
         MilliSleep(500);
 
+        // Write the transactions queued since the last pass in one go
+        if (pwalletMain)
+            pwalletMain->FlushQueuedTxs();
+
+        if (!fFlushWallet)
+            continue;
+
         if (nLastSeen != nWalletDBUpdated)
         {
             nLastSeen = nWalletDBUpdated;
@@ -849,10 +857,11 @@ void ThreadFlushWalletDB(const string& strFile)
     }
 }
 
-bool BackupWallet(const CWallet& wallet, const string& strDest)
+bool BackupWallet(CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+    wallet.FlushQueuedTxs();
     while (true)
     {
         {
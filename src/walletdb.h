@@ -137,6 +137,6 @@ private:
     bool WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccountingEntry& acentry);
 };
 
-bool BackupWallet(const CWallet& wallet, const std::string& strDest);
+bool BackupWallet(CWallet& wallet, const std::string& strDest);
 
 #endif // BITCOIN_WALLETDB_H